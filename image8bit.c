@@ -17,13 +17,33 @@
 // Date:
 //
 
+#define _GNU_SOURCE   // for cpu sets, thread affinity and sched_getcpu
+
 #include "image8bit.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "instrumentation.h"
 
 // The data structure
@@ -41,6 +61,11 @@
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
+//
+// A tiled image (see ImageOpenTiled) has no pixel array: its pixels stay in
+// a PGM file and are accessed through a cache of tiles (the tiles field).
+// Internal functions should reach pixels through pixelSpan(), which works
+// for both kinds of images.
 
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
@@ -50,7 +75,12 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  uint8* pixel; // pixel data (a raster scan), or NULL if tiled
+  struct tileCache* tiles;  // tile cache, for tiled images only
+  // Pixels changed since the last ImageClearDirty: [x0, x1) x [y0, y1)
+  int dirtyX0, dirtyY0, dirtyX1, dirtyY1;
+  unsigned long* hist;  // cached histogram of the levels, or NULL if unknown
+  size_t mapped;  // length of the mapping of pixel, or 0 if allocated
 };
 
 
@@ -74,10 +104,12 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+// (Like errno, it is kept per thread, so that concurrent clients do not
+// overwrite each other's error causes.)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -142,14 +174,11 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters, and start the pool of
+/// threads for parallel operations, with the default size (see
+/// ImageInitThreads).
 void ImageInit(void) { ///
-  InstrCalibrate();
-  InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
-  // Name other counters here...
-  InstrName[1] = "pixel reads";
-  InstrName[2] = "pixel writes";
-  
+  ImageInitThreads(0);
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -160,18 +189,738 @@ void ImageInit(void) { ///
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
-//Para arredondar os píxeis desfocados para o uint8 mais próximo em vez de truncar.
-int arred(float f) {
-	int i = 0;
-	while(f >= 1) {
-		f--;
-		i++;
-	}
-	if(f >= 0.5) {
-		i++;
-	}
-	
-	return i;
+// Parallel execution
+//
+// Some operations split their work in ranges of rows (or other items),
+// which are processed concurrently by parallelFor.
+// All operations, in all threads that call them, share one pool of worker
+// threads, started once (by ImageInitThreads, or on first use): the number
+// of threads that run parallel code never exceeds the pool size plus the
+// number of callers.  The pool size is set by ImageInitThreads, or else by
+// the IMAGE8BIT_THREADS environment variable, or else it is the number of
+// online processors (minus the caller, which always takes part).
+//
+// Load is balanced by work stealing.  parallelFor splits [0, n) into one
+// contiguous range per participant.  Each participant takes chunks from
+// the front of its own range, and when it runs dry, it steals the back half
+// of the largest range left, so that slow or late participants do not hold
+// up the operation.  Workers join the operations posted to the pool,
+// oldest first, and the caller returns once every item is done.
+//
+// The instrumentation counters are per thread.  The counts of the range
+// functions run by each participant are added to those of the caller of
+// parallelFor, so that each thread counts all the work of the operations
+// it calls, whichever threads run it.
+//
+// On machines with several memory nodes (NUMA), a thread reaches the memory
+// of its own node faster than that of the others.  If the IMAGE8BIT_NUMA
+// environment variable is set, the workers are spread evenly over the nodes
+// (each bound to the processors of its node), and the pixels of large
+// images (NUMAMIN bytes or more) are mapped directly, placed on the nodes
+// with the mbind system call, and first touched in parallel:
+//   IMAGE8BIT_NUMA=interleave spreads the pages round-robin over the nodes,
+//     which balances the memory bandwidth for any access pattern;
+//   IMAGE8BIT_NUMA=partition splits the rows in one band per node, in order,
+//     and prefers to place each band on its node.
+// parallelFor then gives range i (of t) to a participant of node i*nodes/t,
+// where possible, matching the bands, so that operations on ranges of rows
+// mostly touch local memory; stealing still balances the load across nodes.
+// The nodes and their processors are read from /sys/devices/system/node.
+// With a single node, all this is skipped, unless IMAGE8BIT_NUMA_NODES=N
+// splits the processors into N pretend nodes (with their memory all on the
+// real node), so that these code paths can be tested anywhere.
+
+// A function that processes items [begin, end) with the given argument
+typedef void (*RangeFn)(void* arg, int begin, int end);
+
+// Maximum number of threads in the pool
+#define MAXTHREADS 256
+
+// Maximum number of NUMA nodes used
+#define MAXNODES 64
+
+// Minimum raster size for NUMA-aware allocation
+#define NUMAMIN (4 << 20)
+
+enum { NUMA_OFF, NUMA_INTERLEAVE, NUMA_PARTITION };
+
+static struct {
+  int mode;
+  int nnodes;                 // NUMA-aware only if > 1
+  int memnode[MAXNODES];      // the memory node of each node
+  cpu_set_t cpus[MAXNODES];   // the processors of each node
+} numa = { .mode = NUMA_OFF, .nnodes = 1 };
+
+// The node of a pool worker (-1 in other threads)
+static _Thread_local int threadNode = -1;
+
+// Read the first line of a (sysfs) file into buf.  Returns 0 on failure.
+static int readLine(const char* path, char* buf, int size) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0;
+  int ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+// Parse a sysfs list of numbers ("0-3,8,10-11") into set.
+// Returns the count of numbers in set.
+static int parseList(const char* s, cpu_set_t* set) {
+  CPU_ZERO(set);
+  for (;;) {
+    char* e;
+    long a = strtol(s, &e, 10);
+    if (e == s) break;
+    long b = a;
+    if (*e == '-') {
+      s = e + 1;
+      b = strtol(s, &e, 10);
+      if (e == s) break;
+    }
+    for (long i = a; i <= b && i < CPU_SETSIZE; i++) CPU_SET((int)i, set);
+    if (*e != ',') break;
+    s = e + 1;
+  }
+  return CPU_COUNT(set);
+}
+
+// Set up numa from IMAGE8BIT_NUMA, IMAGE8BIT_NUMA_NODES and the topology.
+static void numaInit(void) {
+  const char* mode = getenv("IMAGE8BIT_NUMA");
+  if (mode == NULL) return;
+  if (strcmp(mode, "interleave") == 0) numa.mode = NUMA_INTERLEAVE;
+  else if (strcmp(mode, "partition") == 0) numa.mode = NUMA_PARTITION;
+  else return;
+  // The online nodes that have processors
+  char buf[4096], path[64];
+  cpu_set_t online;
+  if (!readLine("/sys/devices/system/node/online", buf, sizeof buf)) return;
+  parseList(buf, &online);
+  int n = 0;
+  for (int node = 0; node < CPU_SETSIZE && n < MAXNODES; node++) {
+    if (!CPU_ISSET(node, &online)) continue;
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    if (readLine(path, buf, sizeof buf) && parseList(buf, &numa.cpus[n]) > 0)
+      numa.memnode[n++] = node;
+  }
+  // Pretend nodes, dealing the processors round-robin
+  const char* env = getenv("IMAGE8BIT_NUMA_NODES");
+  int fake = (env != NULL) ? atoi(env) : 0;
+  if (n == 1 && fake > 1) {
+    if (fake > MAXNODES) fake = MAXNODES;
+    cpu_set_t all = numa.cpus[0];
+    for (int k = 0; k < fake; k++) {
+      CPU_ZERO(&numa.cpus[k]);
+      numa.memnode[k] = numa.memnode[0];
+    }
+    for (int cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &all)) CPU_SET(cpu, &numa.cpus[i++ % fake]);
+    n = fake;
+  }
+  numa.nnodes = n;
+}
+
+// The node of the calling thread
+static int currentNode(void) {
+  if (numa.nnodes < 2) return 0;
+  if (threadNode >= 0) return threadNode;
+  int cpu = sched_getcpu();
+  for (int k = 0; cpu >= 0 && k < numa.nnodes; k++)
+    if (CPU_ISSET(cpu, &numa.cpus[k])) return k;
+  return 0;
+}
+
+// The items of a job not taken yet by one of its participants
+struct jobRange {
+  pthread_mutex_t lock;
+  int begin, end;
+  int node;               // the node that should work on it
+  int taken;              // has a participant started on it? (pool lock)
+};
+
+// A parallelFor call, as posted to the pool
+struct poolJob {
+  RangeFn fn;
+  void* arg;
+  int grain;
+  int nranges;            // one per participant (the caller is range 0)
+  struct jobRange* range;
+  // Protected by the pool lock:
+  int joined;             // participants so far
+  int active;             // participants still using the job
+  int pending;            // items not done yet
+  struct poolJob* next;   // in the list of posted jobs
+  int posted;             // is it in the list?
+  unsigned long count[NUMCOUNTERS];  // instrumentation counts of the ranges
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;    // signalled when a job is posted
+  pthread_cond_t done;    // signalled when a job is finished
+  struct poolJob* jobs;   // jobs that workers may join, oldest first
+  int nthreads;           // workers, plus one for the caller
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 1 };
+
+static int poolRequest = 0;   // pool size requested by ImageInitThreads
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+// Take a chunk of the items of range r: a quarter of what is left (but
+// at least grain items), so that the per-call cost of range functions is
+// paid a few times per range, while the tail is left in small pieces.
+// Returns 0 if the range is empty.
+static int takeChunk(struct jobRange* r, int grain, int* begin, int* end) {
+  pthread_mutex_lock(&r->lock);
+  int left = r->end - r->begin;
+  int n = left / 4 > grain ? left / 4 : grain;
+  if (n > left) n = left;
+  *begin = r->begin;
+  *end = r->begin += n;
+  pthread_mutex_unlock(&r->lock);
+  return n > 0;
+}
+
+// Number of items left in range r
+static int rangeLeft(struct jobRange* r) {
+  pthread_mutex_lock(&r->lock);
+  int left = r->end - r->begin;
+  pthread_mutex_unlock(&r->lock);
+  return left;
+}
+
+// Steal the back half of the largest range of job j into (empty) range home.
+// Returns 0 if there was nothing left to steal.
+static int steal(struct poolJob* j, int home) {
+  for (;;) {
+    int victim = -1, most = 0;
+    for (int i = 0; i < j->nranges; i++) {
+      int left = (i != home) ? rangeLeft(&j->range[i]) : 0;
+      if (left > most) {
+        victim = i;
+        most = left;
+      }
+    }
+    if (victim < 0) return 0;
+    // The victim keeps the front half (none, if a single item is left)
+    struct jobRange* v = &j->range[victim];
+    pthread_mutex_lock(&v->lock);
+    int mid = v->begin + (v->end - v->begin) / 2;
+    int end = v->end;
+    v->end = mid;
+    pthread_mutex_unlock(&v->lock);
+    if (mid < end) {
+      pthread_mutex_lock(&j->range[home].lock);
+      j->range[home].begin = mid;
+      j->range[home].end = end;
+      pthread_mutex_unlock(&j->range[home].lock);
+      return 1;
+    }
+  }
+}
+
+// Work on job j, starting with range home, until no items are left to take.
+// Called with the pool lock held, which is released meanwhile.
+// The instrumentation counts of the work are moved to the job, for its
+// caller to collect (counters are per thread).
+static void participate(struct poolJob* j, int home) {
+  pthread_mutex_unlock(&pool.lock);
+  unsigned long before[NUMCOUNTERS];
+  memcpy(before, InstrCount, sizeof before);
+  int done = 0;
+  int begin, end;
+  for (;;) {
+    if (!takeChunk(&j->range[home], j->grain, &begin, &end)) {
+      if (!steal(j, home)) break;
+      continue;
+    }
+    j->fn(j->arg, begin, end);
+    done += end - begin;
+  }
+  pthread_mutex_lock(&pool.lock);
+  // Nothing is left to take: no more workers need to join
+  if (j->posted) {
+    struct poolJob** pp = &pool.jobs;
+    while (*pp != j) pp = &(*pp)->next;
+    *pp = j->next;
+    j->posted = 0;
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    j->count[i] += InstrCount[i] - before[i];
+    InstrCount[i] = before[i];
+  }
+  j->pending -= done;
+  if (j->pending == 0) pthread_cond_broadcast(&pool.done);
+}
+
+// The first posted job that a worker may join, or NULL
+static struct poolJob* joinableJob(void) {
+  struct poolJob* j = pool.jobs;
+  while (j != NULL && j->joined >= j->nranges) j = j->next;
+  return j;
+}
+
+// Join job j, on node: take the first range not taken yet, preferably one
+// of that node.  Called with the pool lock held.  Returns the range.
+static int joinJob(struct poolJob* j, int node) {
+  int home = -1;
+  for (int i = 0; i < j->nranges; i++) {
+    if (j->range[i].taken) continue;
+    if (home < 0) home = i;
+    if (j->range[i].node == node) {
+      home = i;
+      break;
+    }
+  }
+  j->range[home].taken = 1;
+  j->joined++;
+  j->active++;
+  return home;
+}
+
+static void* poolWorker(void* arg) {
+  threadNode = (int)(intptr_t)arg;
+  if (threadNode >= 0)  // (the binding is only a hint: ignore failures)
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa.cpus[threadNode]);
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    struct poolJob* j;
+    while ((j = joinableJob()) == NULL)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    int home = joinJob(j, threadNode);
+    participate(j, home);
+    if (--j->active == 0) pthread_cond_broadcast(&pool.done);
+  }
+  return NULL;
+}
+
+static void poolStart(void) {
+  int n = poolRequest;
+  if (n <= 0) {
+    const char* env = getenv("IMAGE8BIT_THREADS");
+    n = (env != NULL) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (n > MAXTHREADS) n = MAXTHREADS;
+  if (n < 1) n = 1;
+  numaInit();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t tid;
+  for (int i = 1; i < n; i++) {
+    // Worker i is on node i*nodes/n, like range i of a job with n ranges
+    intptr_t node = (numa.nnodes > 1) ? (intptr_t)i*numa.nnodes/n : -1;
+    if (pthread_create(&tid, &attr, poolWorker, (void*)node) != 0) break;
+    pool.nthreads++;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// Number of threads used by parallel operations (workers and caller)
+static int numThreads(void) {
+  pthread_once(&poolOnce, poolStart);
+  return pool.nthreads;
+}
+
+// Run fn(arg, begin, end) over a partition of [0, n) into contiguous ranges
+// of at least grain items (but the last piece of a range), concurrently,
+// on the pool.  Returns when all are done.
+// Range functions may call parallelFor too.
+static void parallelFor(int n, int grain, RangeFn fn, void* arg) {
+  int t = numThreads();
+  if (grain < 1) grain = 1;
+  if (t > n / grain) t = n / grain;
+  if (t <= 1) {
+    if (n > 0) fn(arg, 0, n);
+    return;
+  }
+  struct jobRange range[t];
+  for (int i = 0; i < t; i++) {
+    pthread_mutex_init(&range[i].lock, NULL);
+    range[i].begin = (int)((long)n*i/t);
+    range[i].end = (int)((long)n*(i+1)/t);
+    range[i].node = (int)((long)i*numa.nnodes/t);
+    range[i].taken = 0;
+  }
+  struct poolJob j = { fn, arg, grain, t, range, 0, 0, n, NULL, 1, { 0 } };
+
+  // Post the job, and take part in it
+  int node = currentNode();
+  pthread_mutex_lock(&pool.lock);
+  struct poolJob** pp = &pool.jobs;
+  while (*pp != NULL) pp = &(*pp)->next;
+  *pp = &j;
+  int home = joinJob(&j, node);
+  pthread_cond_broadcast(&pool.work);
+  participate(&j, home);
+  // Wait for the items taken by others, and for them to let go of the job
+  j.active--;
+  while (j.pending > 0 || j.active > 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < NUMCOUNTERS; i++) InstrCount[i] += j.count[i];
+  for (int i = 0; i < t; i++) pthread_mutex_destroy(&range[i].lock);
+}
+
+struct touchArgs {
+  uint8* p;
+  int width;
+  long page;
+};
+
+// Touch the pages of rows [begin, end), to map them (on the current node,
+// by default).
+static void touchRows(void* arg, int begin, int end) {
+  struct touchArgs* a = (struct touchArgs*)arg;
+  uintptr_t q = (uintptr_t)a->p + (size_t)a->width*begin;
+  uintptr_t e = (uintptr_t)a->p + (size_t)a->width*end;
+  q = (q + a->page - 1) / a->page * a->page;  // the first page starting here
+  for (; q < e; q += a->page) *(volatile uint8*)q = 0;
+}
+
+// Set the NUMA policy of the len bytes of pixels at p, for a raster of
+// width x height (see Parallel execution).  Failures are ignored: the
+// pages then go where they are first touched.
+static void numaPlace(uint8* p, size_t len, int width, int height, long page) {
+#if defined(__linux__) && defined(SYS_mbind)
+  unsigned long mask[CPU_SETSIZE / (8*sizeof(unsigned long))];
+  unsigned long maxnode = 8*sizeof mask + 1;
+  memset(mask, 0, sizeof mask);
+  if (numa.mode == NUMA_INTERLEAVE) {
+    for (int k = 0; k < numa.nnodes; k++)
+      mask[numa.memnode[k] / (8*sizeof *mask)] |= 1UL << (numa.memnode[k] % (8*sizeof *mask));
+    syscall(SYS_mbind, p, len, MPOL_INTERLEAVE, mask, maxnode, 0);
+    return;
+  }
+  // One band of rows per node, rounded to whole pages
+  size_t begin = 0;
+  for (int k = 0; k < numa.nnodes; k++) {
+    size_t end = (k == numa.nnodes - 1) ? len
+        : (size_t)width*(int)((long)height*(k+1)/numa.nnodes) / page * page;
+    if (end <= begin) continue;
+    int node = numa.memnode[k];
+    memset(mask, 0, sizeof mask);
+    mask[node / (8*sizeof *mask)] = 1UL << (node % (8*sizeof *mask));
+    syscall(SYS_mbind, p + begin, end - begin, MPOL_PREFERRED, mask, maxnode, 0);
+    begin = end;
+  }
+#else
+  (void)p; (void)len; (void)width; (void)height; (void)page;
+#endif
+}
+
+// Allocate the (black) pixels of a width x height raster.
+// Large rasters are NUMA-aware, if enabled (see Parallel execution): they are
+// mapped directly, and *mapped is set to the length of the mapping, to be
+// released by freePixels.  Otherwise, *mapped is 0.
+// Returns NULL on failure.
+static uint8* allocPixels(int width, int height, size_t* mapped) {
+  size_t n = (size_t)width*height;
+  *mapped = 0;
+  pthread_once(&poolOnce, poolStart);  // (numa is set up with the pool)
+  if (numa.nnodes < 2 || n < NUMAMIN) return (uint8*)calloc(n, sizeof(uint8));
+  long page = sysconf(_SC_PAGESIZE);
+  size_t len = (n + page - 1) / page * page;
+  void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  numaPlace((uint8*)p, len, width, height, page);
+  struct touchArgs a = { (uint8*)p, width, page };
+  parallelFor(height, 1, touchRows, &a);
+  *mapped = len;
+  return (uint8*)p;
+}
+
+// Release pixels from allocPixels.
+static void freePixels(uint8* pixel, size_t mapped) {
+  if (mapped > 0) munmap(pixel, mapped);
+  else free(pixel);
+}
+
+/// Init Image library, with nthreads threads for parallel operations
+/// (nthreads = 0 means the default: IMAGE8BIT_THREADS, or the number of
+/// online processors).  (Call once, before any other function!)
+/// The threads form a pool shared by all operations, in all threads of
+/// the program: programs that run several operations concurrently may
+/// ask for fewer threads, so as not to oversubscribe the processors.
+/// On NUMA machines, IMAGE8BIT_NUMA=interleave (or partition) spreads the
+/// threads over the memory nodes, and the pixels of large images over the
+/// nodes (page by page, or in one band of rows per node).
+/// IMAGE8BIT_NUMA_NODES=N pretends there are N nodes, for testing.
+void ImageInitThreads(int nthreads) { ///
+  assert (nthreads >= 0);
+  poolRequest = nthreads;
+  pthread_once(&poolOnce, poolStart);
+  InstrCalibrate();
+  InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  // Name other counters here...
+  InstrName[1] = "pixel reads";
+  InstrName[2] = "pixel writes";
+}
+
+
+// Tiled images
+//
+// A tiled image keeps its pixels in a raw PGM file, instead of memory.
+// The raster is split into TILE x TILE tiles, which are read on demand
+// (by offset into the file) into a cache with a fixed number of slots,
+// and evicted in least-recently-used order.  Modified tiles are written back
+// when evicted, or by ImageFlush.  The modified tiles of read-only images
+// are evicted to a private scratch file instead (created when first needed,
+// and already unlinked), from where they are read again.
+
+#define TILE 256
+
+struct tileCache {
+  int fd;           // the PGM file
+  off_t offset;     // file offset of the first pixel
+  int writable;     // may modified tiles be written back?
+  int scratch;      // scratch file for modified tiles of read-only images, or -1
+  uint8* spilled;   // spilled[t]: is tile t in the scratch file? (read-only)
+  int ioerr;        // errno of the first failed tile read/write, or 0
+  int ntx;          // number of tiles across
+  int capacity;     // number of cache slots
+  int* slotOf;      // slotOf[t] = slot holding tile t, or -1
+  struct tileSlot {
+    int tile;       // tile held in this slot, or -1
+    int dirty;      // modified since read?
+    int prev, next; // links in the LRU list
+    uint8* data;    // TILE*TILE pixels (row stride TILE)
+  } *slot;
+  int mru, lru;     // ends of the LRU list (most/least recently used)
+};
+
+// Create an anonymous scratch file (unlinked at once).
+// Returns its descriptor, or -1 on failure.
+static int scratchFile(void) {
+  const char* dir = getenv("TMPDIR");
+  char name[PATH_MAX];
+  snprintf(name, sizeof name, "%s/image8bit-XXXXXX", dir != NULL ? dir : "/tmp");
+  int fd = mkstemp(name);
+  if (fd >= 0) unlink(name);
+  return fd;
+}
+
+// Read (or write back) the tile in slot s of tiled image img.
+// Errors are recorded in the cache: tile accesses cannot fail, by contract.
+static void tileIO(Image img, struct tileSlot* s, int write) {
+  struct tileCache* tc = img->tiles;
+  int x0 = (s->tile % tc->ntx) * TILE;
+  int y0 = (s->tile / tc->ntx) * TILE;
+  int tw = (img->width - x0 < TILE) ? img->width - x0 : TILE;
+  int th = (img->height - y0 < TILE) ? img->height - y0 : TILE;
+  int fd = tc->fd;
+  off_t pos0 = tc->offset + (off_t)y0*img->width + x0;
+  off_t stride = img->width;
+  if (!tc->writable && (write || tc->spilled[s->tile])) {
+    // In the scratch file, tile t is at offset t*TILE*TILE, as in memory
+    if (tc->scratch < 0 && (tc->scratch = scratchFile()) < 0 && tc->ioerr == 0) tc->ioerr = errno;
+    fd = tc->scratch;
+    pos0 = (off_t)s->tile*TILE*TILE;
+    stride = TILE;
+    if (write) tc->spilled[s->tile] = 1;
+  }
+  for (int r = 0; r < th; r++) {
+    uint8* row = s->data + r*TILE;
+    off_t pos = pos0 + r*stride;
+    ssize_t done = 0;
+    while (done < tw) {
+      ssize_t n = write ? pwrite(fd, row + done, tw - done, pos + done)
+                        : pread(fd, row + done, tw - done, pos + done);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (tc->ioerr == 0) tc->ioerr = (n < 0) ? errno : EIO;
+        if (!write) memset(row + done, 0, tw - done);
+        break;
+      }
+      done += n;
+    }
+  }
+  PIXMEM += (unsigned long)tw*th;  // count pixel memory accesses
+  s->dirty = 0;
+}
+
+// Move slot i to the most recently used end of the LRU list.
+static void tileTouch(struct tileCache* tc, int i) {
+  if (tc->mru == i) return;
+  struct tileSlot* s = &tc->slot[i];
+  // unlink
+  tc->slot[s->prev].next = s->next;
+  if (s->next >= 0) tc->slot[s->next].prev = s->prev;
+  else tc->lru = s->prev;
+  // insert at front
+  s->prev = -1;
+  s->next = tc->mru;
+  tc->slot[tc->mru].prev = i;
+  tc->mru = i;
+}
+
+// Return the pixels of tile t of tiled image img, reading it if necessary.
+// If write is true, the tile is marked as modified.
+// The returned pointer is valid until the next access to another tile.
+static uint8* tileFetch(Image img, int t, int write) {
+  struct tileCache* tc = img->tiles;
+  int i = tc->slotOf[t];
+  if (i < 0) {
+    // Miss: reuse the least recently used slot
+    i = tc->lru;
+    struct tileSlot* s = &tc->slot[i];
+    if (s->tile >= 0) {
+      if (s->dirty) tileIO(img, s, 1);
+      tc->slotOf[s->tile] = -1;
+    }
+    s->tile = t;
+    tc->slotOf[t] = i;
+    tileIO(img, s, 0);
+  }
+  tileTouch(tc, i);
+  tc->slot[i].dirty |= write;
+  return tc->slot[i].data;
+}
+
+// Return a pointer to pixel (x,y) of img, and set *n to the number of
+// pixels, starting at that one, that are contiguous in memory (in row y).
+// If write is true, the caller may modify those pixels.
+// For tiled images, the pointer is only valid until the next pixel access.
+static uint8* pixelSpan(Image img, int x, int y, int* n, int write) {
+  if (img->tiles == NULL) {
+    *n = img->width - x;
+    return img->pixel + (size_t)y*img->width + x;
+  }
+  int tx = x / TILE;
+  int t = (y / TILE)*img->tiles->ntx + tx;
+  uint8* data = tileFetch(img, t, write);
+  int end = (tx + 1)*TILE < img->width ? (tx + 1)*TILE : img->width;
+  *n = end - x;
+  return data + (y % TILE)*TILE + (x % TILE);
+}
+
+// Write back all modified tiles of a tiled image.
+// Returns 0 if any tile read or write failed (errno is set accordingly).
+static int tilesFlush(Image img) {
+  struct tileCache* tc = img->tiles;
+  for (int i = 0; i < tc->capacity; i++) {
+    if (tc->slot[i].tile >= 0 && tc->slot[i].dirty) tileIO(img, &tc->slot[i], 1);
+  }
+  if (tc->ioerr != 0) {
+    errno = tc->ioerr;
+    return 0;
+  }
+  return 1;
+}
+
+// Free the tile cache of img, writing back modified tiles.
+static void tilesClose(Image img) {
+  struct tileCache* tc = img->tiles;
+  if (tc == NULL) return;
+  if (tc->writable) tilesFlush(img);
+  for (int i = 0; i < tc->capacity; i++) free(tc->slot[i].data);
+  free(tc->slot);
+  free(tc->slotOf);
+  free(tc->spilled);
+  if (tc->fd >= 0) close(tc->fd);
+  if (tc->scratch >= 0) close(tc->scratch);
+  free(tc);
+  img->tiles = NULL;
+}
+
+
+// Depth-generic kernels
+//
+// The inner loops of the pixel operations are written once, in terms of a
+// pixel type PIX, and instantiated for 8-bit (suffix 8) and 16-bit
+// (suffix 16) images by DEPTH_KERNELS.  They work on spans (contiguous
+// runs of pixels in a row), so the 8-bit operations may apply them to the
+// spans returned by pixelSpan, for tiled or non-tiled images alike.
+// Kernels do not update instrumentation counters: callers do.
+
+#define DEPTH_KERNELS(PIX, SFX)                                               \
+/* Negate n pixels */                                                        \
+static inline void negSpan##SFX(PIX* p, int n, unsigned maxval) {                   \
+  for (int i = 0; i < n; i++) p[i] = (PIX)(maxval - p[i]);                   \
+}                                                                            \
+/* Threshold n pixels */                                                     \
+static inline void thrSpan##SFX(PIX* p, int n, unsigned thr, unsigned maxval) {     \
+  for (int i = 0; i < n; i++) p[i] = (PIX)(p[i] < thr ? 0 : maxval);         \
+}                                                                            \
+/* Multiply n pixels by factor, saturating at maxval (before narrowing) */  \
+static inline void briSpan##SFX(PIX* p, int n, double factor, unsigned maxval) {    \
+  for (int i = 0; i < n; i++) {                                              \
+    double v = p[i]*factor;                                                  \
+    p[i] = (PIX)(v > maxval ? maxval : v);                                   \
+  }                                                                          \
+}                                                                            \
+/* Blend n pixels of s into d, rounding and saturating on both ends */      \
+static inline void blendSpan##SFX(PIX* d, const PIX* s, int n, double alpha, unsigned maxval) { \
+  for (int i = 0; i < n; i++) {                                              \
+    double v = (1.0 - alpha)*d[i] + alpha*s[i] + 0.5;                        \
+    if (v < 0.0) v = 0.0;                                                    \
+    if (v > maxval) v = maxval;                                              \
+    d[i] = (PIX)v;                                                           \
+  }                                                                          \
+}                                                                            \
+/* Update *min and *max with n pixels */                                     \
+static inline void minmaxSpan##SFX(const PIX* p, int n, unsigned* min, unsigned* max) { \
+  unsigned lo = *min, hi = *max;                                             \
+  for (int i = 0; i < n; i++) {                                              \
+    if (p[i] < lo) lo = p[i];                                                \
+    if (p[i] > hi) hi = p[i];                                                \
+  }                                                                          \
+  *min = lo;                                                                 \
+  *max = hi;                                                                 \
+}                                                                            \
+/* Copy n pixels of s to d in reverse order */                               \
+static inline void revSpan##SFX(PIX* d, const PIX* s, int n) {                      \
+  for (int i = 0; i < n; i++) d[n-1-i] = s[i];                               \
+}                                                                            \
+/* Rotate n pixels starting at (x, y) of a w pixels wide image into */       \
+/* dense dst (of width dw), at (y, w-1-x) */                                 \
+static inline void rotSpan##SFX(PIX* dst, int dw, const PIX* s, int n, int x, int y, int w) { \
+  for (int i = 0; i < n; i++) dst[(size_t)(w-1-x-i)*dw + y] = s[i];         \
+}                                                                            \
+/* Row y of a 64-bit summed-area table of dense pixels p (w x ...) */        \
+static inline void satRow##SFX(uint64_t* t, const PIX* p, int w, int y) {           \
+  uint64_t rowsum = 0;                                                       \
+  uint64_t* row = t + (size_t)y*w;                                           \
+  for (int x = 0; x < w; x++) {                                              \
+    rowsum += p[(size_t)y*w + x];                                            \
+    row[x] = rowsum + (y > 0 ? row[x - w] : 0);                              \
+  }                                                                          \
+}                                                                            \
+/* Rows [y0, y1) of the mean filter of a w x h image, from its SAT */        \
+static inline void boxRows##SFX(PIX* d, const uint64_t* t, int w, int h,           \
+                         int y0, int y1, int dx, int dy) {                   \
+  for (int y = y0; y < y1; y++) {                                            \
+    int yt = y - dy < 0 ? 0 : y - dy;                                        \
+    int yb = y + dy > h - 1 ? h - 1 : y + dy;                                \
+    for (int x = 0; x < w; x++) {                                            \
+      int xl = x - dx < 0 ? 0 : x - dx;                                      \
+      int xr = x + dx > w - 1 ? w - 1 : x + dx;                              \
+      uint64_t sum = t[(size_t)yb*w + xr];                                   \
+      if (xl > 0) sum -= t[(size_t)yb*w + xl-1];                             \
+      if (yt > 0) sum -= t[(size_t)(yt-1)*w + xr];                           \
+      if (xl > 0 && yt > 0) sum += t[(size_t)(yt-1)*w + xl-1];               \
+      uint64_t area = (uint64_t)(xr - xl + 1)*(yb - yt + 1);                 \
+      d[(size_t)y*w + x] = (PIX)((sum + area/2) / area);                     \
+    }                                                                        \
+  }                                                                          \
+}
+
+DEPTH_KERNELS(uint8, 8)
+DEPTH_KERNELS(uint16_t, 16)
+
+// Threshold n 8-bit pixels, 16 at a time where SSE2 is available:
+// p >= thr exactly where max(p, thr) == p.
+static inline void thrSpanFast8(uint8* p, int n, uint8 thr, uint8 maxval) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i t = _mm_set1_epi8((char)thr);
+  const __m128i m = _mm_set1_epi8((char)maxval);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(ge, m));
+  }
+#endif
+  thrSpan8(p + i, n - i, thr, maxval);
 }
 
 
@@ -197,10 +946,12 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 	  return NULL;
   }
   
-  uint8* pixel = (uint8*)malloc(width*height);
+  size_t mapped;
+  uint8* pixel = allocPixels(width, height, &mapped); // black
   if(pixel == NULL) {
 	  errno = ENOMEM; //Será que deixo o próprio malloc definir o errno?
 	  errCause = "Falha ao alocar memória para os píxeis da nova imagem\n"; //Será que uso o check para definir o errCause?
+	  free(img);
 	  return NULL;
   }
   
@@ -208,6 +959,12 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   img->height = height;
   img->maxval = maxval;
   img->pixel = pixel;
+  img->tiles = NULL;
+  img->dirtyX0 = img->dirtyY0 = 0;   // new images are all dirty
+  img->dirtyX1 = width;
+  img->dirtyY1 = height;
+  img->hist = NULL;
+  img->mapped = mapped;
   
   return img;
 }
@@ -220,56 +977,503 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
   // Insert your code here!
+  if(*imgp == NULL)
+	  return;
+  errsave = errno;
+  tilesClose(*imgp);
+  errno = errsave;
+  freePixels((*imgp)->pixel, (*imgp)->mapped);
+  free((*imgp)->hist);
   free(*imgp);
   *imgp = NULL;
 }
 
+// Exchange the pixel arrays of two in-memory images of the same size.
+static void swapPixels(Image a, Image b) {
+  assert (a->pixel != NULL && b->pixel != NULL);
+  uint8* t = a->pixel;
+  a->pixel = b->pixel;
+  b->pixel = t;
+  size_t m = a->mapped;
+  a->mapped = b->mapped;
+  b->mapped = m;
+}
+
 
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Buffered reader for PNM files.
+// Headers and ASCII (plain) pixel data are parsed by hand from a large
+// buffer, which is much faster than calling fscanf for each value.
+// The file is read with plain read() calls, bypassing stdio: a file that
+// fits in the buffer (a thumbnail, say) takes a single read, and the
+// pixels of larger raw files are read directly into the image.
+#define PNMBUFSIZE 65536
+
+struct pnmReader {
+  int fd;
+  size_t pos, len;        // next byte and end of valid data in buf
+  uint8 buf[PNMBUFSIZE];
+};
+
+// Read up to n bytes from fd into dst, retrying short reads until n bytes
+// or end-of-file.  Returns the number of bytes read, or -1 on error.
+static ssize_t readFull(int fd, uint8* dst, size_t n) {
+  size_t k = 0;
+  while (k < n) {
+    ssize_t m = read(fd, dst + k, n - k);
+    if (m < 0 && errno == EINTR) continue;
+    if (m < 0) return -1;
+    if (m == 0) break;
+    k += m;
   }
-  return i;
+  return k;
+}
+
+// Return the next byte, or EOF.
+static inline int pnmGetc(struct pnmReader* r) {
+  if (r->pos == r->len) {
+    ssize_t m = readFull(r->fd, r->buf, PNMBUFSIZE);
+    r->len = m > 0 ? m : 0;
+    r->pos = 0;
+    if (r->len == 0) return EOF;
+  }
+  return r->buf[r->pos++];
+}
+
+// Skip whitespace and comments (from # to end-of-line), then parse a
+// non-negative decimal integer, up to max.  Returns -1 if there is none.
+static int pnmInt(struct pnmReader* r, int max) {
+  int c = pnmGetc(r);
+  for (;;) {
+    if (c == '#') {
+      while (c != '\n' && c != EOF) c = pnmGetc(r);
+    } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '\v' && c != '\f') {
+      break;
+    }
+    c = pnmGetc(r);
+  }
+  if (c < '0' || c > '9') return -1;
+  int v = 0;
+  do {
+    if (v > (max - (c - '0')) / 10) return -1;
+    v = 10*v + (c - '0');
+    c = pnmGetc(r);
+  } while (c >= '0' && c <= '9');
+  if (c != EOF) r->pos--;   // unget the delimiter
+  return v;
+}
+
+// Parse the header of a PNM file (see ImageLoad) from r: the format
+// ('1' to '6', after the P, or 'Z' for PZ files), the width and height,
+// the maxval (up to maxmax; PixMax for bitmaps), and, for PZ files, the
+// stripe height (1 otherwise).  On success, r is at the first byte of the
+// pixels.  Returns 0 on failure, with errno/errCause set.
+static int pnmHeader(struct pnmReader* r, int maxmax, int* fmt, int* w, int* h, int* maxval, int* rows) {
+  *maxval = PixMax;
+  *rows = 1;
+  return
+  check( pnmGetc(r) == 'P' && (((*fmt = pnmGetc(r)) >= '1' && *fmt <= '6') || *fmt == 'Z') , "Invalid file format" ) &&
+  check( (*w = pnmInt(r, INT_MAX)) >= 0 , "Invalid width" ) &&
+  check( (*h = pnmInt(r, INT_MAX)) >= 0 , "Invalid height" ) &&
+  check( (*fmt == '1' || *fmt == '4' || (*maxval = pnmInt(r, maxmax)) > 0) , "Invalid maxval" ) &&
+  check( (*fmt != 'Z' || (*rows = pnmInt(r, INT_MAX)) > 0) , "Invalid stripe height" ) &&
+  check( (*fmt == '1' || isspace(pnmGetc(r))) , "Whitespace expected" );
+}
+
+// Read n bytes of raw data (what is left in the buffer, then the rest
+// directly from the file).  Returns 0 on a short read.
+static int pnmRead(struct pnmReader* r, uint8* dst, size_t n) {
+  size_t k = r->len - r->pos;
+  if (k > n) k = n;
+  memcpy(dst, r->buf + r->pos, k);
+  r->pos += k;
+  return k == n || readFull(r->fd, dst + k, n - k) == (ssize_t)(n - k);
+}
+
+// Read the pixels of a plain (ASCII) image with samples per pixel.
+// Gray pixels are the rounded luma of RGB pixels.
+static int pnmReadPlain(struct pnmReader* r, Image img, int samples, int maxval) {
+  size_t n = (size_t)img->width*img->height;
+  for (size_t i = 0; i < n; i++) {
+    if (samples == 1) {
+      int v = pnmInt(r, maxval);
+      if (v < 0) return 0;
+      img->pixel[i] = (uint8)v;
+    } else {
+      int cr = pnmInt(r, maxval), cg = pnmInt(r, maxval), cb = pnmInt(r, maxval);
+      if (cr < 0 || cg < 0 || cb < 0) return 0;
+      img->pixel[i] = (uint8)((299*cr + 587*cg + 114*cb + 500) / 1000);
+    }
+  }
+  return 1;
+}
+
+// Read the pixels of a raw PPM image, converting to gray (rounded luma).
+static int pnmReadRawRGB(struct pnmReader* r, Image img) {
+  int w = img->width;
+  uint8* row = (uint8*)malloc(3*(size_t)w);
+  if (!check(row != NULL, "Allocating row buffer")) return 0;
+  int ok = 1;
+  for (int y = 0; ok && y < img->height; y++) {
+    ok = pnmRead(r, row, 3*(size_t)w);
+    uint8* d = img->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      d[x] = (uint8)((299*row[3*x] + 587*row[3*x+1] + 114*row[3*x+2] + 500) / 1000);
+    }
+  }
+  free(row);
+  return ok;
+}
+
+// Read the pixels of a raw PBM image: bit 1 (black) becomes 0 and
+// bit 0 (white) becomes img->maxval.  Rows are padded to whole bytes.
+static int pnmReadBits(struct pnmReader* r, Image img) {
+  int w = img->width;
+  size_t rowbytes = ((size_t)w + 7) / 8;
+  uint8* row = (uint8*)malloc(rowbytes + 1);
+  if (!check(row != NULL, "Allocating row buffer")) return 0;
+  int ok = 1;
+  for (int y = 0; ok && y < img->height; y++) {
+    ok = pnmRead(r, row, rowbytes);
+    uint8* d = img->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      d[x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 0 : img->maxval;
+    }
+  }
+  free(row);
+  return ok;
+}
+
+// Compressed images
+//
+// The compressed format (magic number PZ) has a PGM-like text header
+//   PZ\n<width> <height>\n<maxval>\n<stripe rows>\n
+// followed by the size of each stripe (4 bytes, little endian) and the
+// stripes.  A stripe holds <stripe rows> consecutive rows (the last one may
+// hold less), and is coded independently of the others, so that stripes
+// can be compressed and decompressed in parallel.
+//
+// Each row is first transformed by a PNG-style predictor (None, Sub, Up,
+// or Paeth, chosen per row for the smallest sum of absolute residuals),
+// where rows above the stripe count as black.  The residuals are then
+// coded by a byte-wise rANS coder with a static order-0 model per stripe.
+// A stripe is: mode byte (0 = raw, 1 = coded); one predictor byte per
+// row; then, if coded, 256 frequencies (2 bytes each, summing to RANSTOT),
+// the final coder state (4 bytes) and the coded bytes.
+
+#define PZROWS 64               // default rows per stripe
+#define RANSBITS 12             // frequency precision
+#define RANSTOT (1 << RANSBITS)
+#define RANSLOW (1u << 23)      // lower bound of the coder state
+
+// Paeth predictor, as in PNG
+static inline int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// Residual of pixel x of row cur, with predictor f (prev is the row above)
+static inline uint8 predict(int f, const uint8* cur, const uint8* prev, int x) {
+  int a = x > 0 ? cur[x-1] : 0;
+  int b = prev[x];
+  int c = x > 0 ? prev[x-1] : 0;
+  switch (f) {
+  case 1: return a;
+  case 2: return b;
+  case 3: return (uint8)paeth(a, b, c);
+  }
+  return 0;
+}
+
+// Scale the symbol counts of n symbols to frequencies summing to RANSTOT,
+// keeping every present symbol at least 1.
+static void ransNormalize(const uint32_t* count, uint32_t n, uint16_t* freq) {
+  uint32_t sum = 0;
+  int big = 0;
+  for (int s = 0; s < 256; s++) {
+    freq[s] = 0;
+    if (count[s] == 0) continue;
+    freq[s] = (uint16_t)((uint64_t)count[s]*RANSTOT / n);
+    if (freq[s] == 0) freq[s] = 1;
+    sum += freq[s];
+    if (freq[s] > freq[big]) big = s;
+  }
+  // Fix the total on the most frequent symbols
+  while (sum > RANSTOT) {
+    for (int s = 0; s < 256 && sum > RANSTOT; s++) {
+      if (freq[s] > 1 && (freq[s] >= freq[big]/2)) { freq[s]--; sum--; }
+    }
+  }
+  freq[big] += RANSTOT - sum;
+}
+
+// A compressed stripe
+struct pzStripe {
+  uint8* data;
+  size_t len;
+};
+
+// Arguments for the stripe coders
+struct pzArgs {
+  Image img;            // dense
+  int rows;             // rows per stripe
+  struct pzStripe* s;
+  int failed;           // set (only) by the decoder, under lock
+  pthread_mutex_t lock;
+};
+
+// Compress stripes [begin, end).  On failure, a stripe gets data==NULL.
+static void pzEncodeStripes(void* arg, int begin, int end) {
+  struct pzArgs* a = (struct pzArgs*)arg;
+  int w = a->img->width;
+  for (int k = begin; k < end; k++) {
+    int y0 = k*a->rows;
+    int nr = a->img->height - y0 < a->rows ? a->img->height - y0 : a->rows;
+    size_t n = (size_t)w*nr;
+    // Worst case: raw stripe
+    uint8* out = (uint8*)malloc(1 + nr + n);
+    uint8* res = (uint8*)malloc(n + 1);
+    uint8* zero = (uint8*)calloc(w + 1, 1);
+    a->s[k].data = out;
+    if (out == NULL || res == NULL || zero == NULL) {
+      free(out); free(res); free(zero);
+      a->s[k].data = NULL;
+      continue;
+    }
+    // Prediction: choose the predictor with the smallest residuals
+    uint32_t count[256] = { 0 };
+    for (int r = 0; r < nr; r++) {
+      const uint8* cur = a->img->pixel + (size_t)(y0 + r)*w;
+      const uint8* prev = r > 0 ? cur - w : zero;
+      int best = 0;
+      unsigned long bestCost = ~0UL;
+      for (int f = 0; f < 4; f++) {
+        unsigned long cost = 0;
+        for (int x = 0; x < w; x++) {
+          int d = (int8_t)(uint8)(cur[x] - predict(f, cur, prev, x));
+          cost += abs(d);
+        }
+        if (cost < bestCost) { bestCost = cost; best = f; }
+      }
+      out[1 + r] = (uint8)best;
+      uint8* d = res + (size_t)r*w;
+      for (int x = 0; x < w; x++) {
+        d[x] = (uint8)(cur[x] - predict(best, cur, prev, x));
+        count[d[x]]++;
+      }
+    }
+    free(zero);
+
+    // Entropy coding, backwards from the end of a temporary buffer
+    size_t len = 0;
+    if (n > 0) {
+      uint16_t freq[256];
+      uint32_t start[257];
+      ransNormalize(count, (uint32_t)n, freq);
+      start[0] = 0;
+      for (int s = 0; s < 256; s++) start[s+1] = start[s] + freq[s];
+      size_t cap = n + n/2 + 16;
+      uint8* buf = (uint8*)malloc(cap);
+      if (buf != NULL) {
+        uint8* p = buf + cap;
+        uint32_t x = RANSLOW;
+        for (size_t i = n; i-- > 0 && p > buf + 4; ) {
+          uint32_t f = freq[res[i]];
+          uint32_t xmax = ((RANSLOW >> RANSBITS) << 8) * f;
+          while (x >= xmax && p > buf + 4) { *--p = (uint8)x; x >>= 8; }
+          x = ((x / f) << RANSBITS) + (x % f) + start[res[i]];
+        }
+        p -= 4;
+        p[0] = (uint8)x; p[1] = (uint8)(x >> 8); p[2] = (uint8)(x >> 16); p[3] = (uint8)(x >> 24);
+        len = buf + cap - p;
+        if (p > buf && 512 + len < n) {   // worth it (and did not run out of room)
+          uint8* q = out + 1 + nr;
+          for (int s = 0; s < 256; s++) { q[2*s] = (uint8)freq[s]; q[2*s+1] = (uint8)(freq[s] >> 8); }
+          memcpy(q + 512, p, len);
+          len += 512;
+        } else {
+          len = 0;
+        }
+        free(buf);
+      }
+    }
+    if (len > 0) {
+      out[0] = 1;
+      a->s[k].len = 1 + nr + len;
+    } else {
+      out[0] = 0;
+      memcpy(out + 1 + nr, res, n);
+      a->s[k].len = 1 + nr + n;
+    }
+    free(res);
+  }
+}
+
+// Decompress stripes [begin, end) into a->img.  Sets a->failed on corrupt data.
+static void pzDecodeStripes(void* arg, int begin, int end) {
+  struct pzArgs* a = (struct pzArgs*)arg;
+  int w = a->img->width;
+  uint8* zero = (uint8*)calloc(w + 1, 1);
+  int ok = (zero != NULL);
+  for (int k = begin; ok && k < end; k++) {
+    int y0 = k*a->rows;
+    int nr = a->img->height - y0 < a->rows ? a->img->height - y0 : a->rows;
+    size_t n = (size_t)w*nr;
+    const uint8* in = a->s[k].data;
+    size_t len = a->s[k].len;
+    uint8* res = a->img->pixel + (size_t)y0*w;   // residuals, then pixels
+    if (len < 1 + (size_t)nr || in[0] > 1) { ok = 0; break; }
+    for (int r = 0; r < nr; r++) ok = ok && in[1 + r] < 4;
+    const uint8* p = in + 1 + nr;
+    const uint8* pend = in + len;
+    if (in[0] == 0) {
+      ok = ok && (size_t)(pend - p) == n;
+      if (ok) memcpy(res, p, n);
+    } else if (ok) {
+      uint16_t freq[256];
+      uint32_t start[257];
+      static _Thread_local uint8 sym[RANSTOT];
+      ok = (pend - p) >= 512 + 4;
+      start[0] = 0;
+      for (int s = 0; ok && s < 256; s++) {
+        freq[s] = (uint16_t)(p[2*s] | p[2*s+1] << 8);
+        start[s+1] = start[s] + freq[s];
+        ok = start[s+1] <= RANSTOT;
+      }
+      ok = ok && start[256] == RANSTOT;
+      for (int s = 0; ok && s < 256; s++) memset(sym + start[s], s, freq[s]);
+      if (ok) {
+        p += 512;
+        uint32_t x = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        p += 4;
+        for (size_t i = 0; i < n; i++) {
+          uint8 s = sym[x & (RANSTOT - 1)];
+          res[i] = s;
+          x = freq[s] * (x >> RANSBITS) + (x & (RANSTOT - 1)) - start[s];
+          while (x < RANSLOW && p < pend) x = (x << 8) | *p++;
+        }
+        ok = (p == pend && x == RANSLOW);
+      }
+    }
+    // Undo prediction, in place
+    for (int r = 0; ok && r < nr; r++) {
+      uint8* cur = res + (size_t)r*w;
+      const uint8* prev = r > 0 ? cur - w : zero;
+      int f = in[1 + r];
+      for (int x = 0; x < w; x++) cur[x] = (uint8)(cur[x] + predict(f, cur, prev, x));
+    }
+  }
+  free(zero);
+  if (!ok) {
+    pthread_mutex_lock(&a->lock);
+    a->failed = 1;
+    pthread_mutex_unlock(&a->lock);
+  }
+}
+
+// Read the stripes of a compressed image (after the header) into img.
+// rows comes from the file: any positive value is valid.
+static int pzRead(struct pnmReader* r, Image img, int rows) {
+  // A stripe taller than the image holds all its rows
+  if (rows > img->height) rows = img->height > 0 ? img->height : 1;
+  int ns = (img->height + rows - 1) / rows;
+  assert ((long)ns*rows >= img->height);
+  struct pzArgs a = { img, rows, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+  uint8* sizes = (uint8*)malloc(4*(size_t)ns + 1);
+  a.s = (struct pzStripe*)calloc(ns + 1, sizeof(struct pzStripe));
+  uint8* data = NULL;
+  int ok = check( sizes != NULL && a.s != NULL, "Allocating stripes" ) &&
+           check( pnmRead(r, sizes, 4*(size_t)ns), "Reading stripes" );
+  size_t total = 0;
+  for (int k = 0; ok && k < ns; k++) {
+    a.s[k].len = sizes[4*k] | sizes[4*k+1] << 8 | sizes[4*k+2] << 16 | (size_t)sizes[4*k+3] << 24;
+    total += a.s[k].len;
+  }
+  ok = ok && check( (data = (uint8*)malloc(total + 1)) != NULL, "Allocating stripes" ) &&
+             check( pnmRead(r, data, total), "Reading stripes" );
+  if (ok) {
+    size_t off = 0;
+    for (int k = 0; k < ns; k++) {
+      a.s[k].data = data + off;
+      off += a.s[k].len;
+    }
+    parallelFor(ns, 1, pzDecodeStripes, &a);
+    ok = check( !a.failed, "Corrupt compressed data" );
+  }
+  free(data);
+  free(a.s);
+  free(sizes);
+  return ok;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file (or another Netpbm file, converted to gray).
+/// The format is detected from the magic number:
+///   P5 (raw PGM) and P2 (plain PGM): up to maxval 255
+///     (see Image16Load for deeper ones);
+///   P4 (raw PBM) and P1 (plain PBM): black pixels become 0 and white
+///     pixels PixMax;
+///   P6 (raw PPM) and P3 (plain PPM): pixels become the rounded luma
+///     (0.299R + 0.587G + 0.114B), so gray PPM files keep their levels;
+///   PZ: compressed images (see ImageSaveCompressed), decompressed in parallel.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
   int w, h;
   int maxval;
-  char c;
-  FILE* f = NULL;
+  int fmt;
+  int rows;
+  struct pnmReader* r = NULL;
   Image img = NULL;
 
-  int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  int success =
+  check( (r = (struct pnmReader*)malloc(sizeof(struct pnmReader))) != NULL, "Allocating read buffer" ) &&
+  check( (r->fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0, "Open failed" );
+  if (success) {
+    r->pos = r->len = 0;
+    success =
+    pnmHeader(r, PixMax, &fmt, &w, &h, &maxval, &rows) &&
+    // Allocate image
+    (img = ImageCreate(w, h, (uint8)maxval)) != NULL;
+  }
+  if (success) {
+    // Read pixels
+    switch (fmt) {
+    case '5':
+      success = check( pnmRead(r, img->pixel, (size_t)w*h) , "Reading pixels" );
+      break;
+    case '2':
+      success = check( pnmReadPlain(r, img, 1, maxval) , "Reading pixels" );
+      break;
+    case '6':
+      success = check( pnmReadRawRGB(r, img) , "Reading pixels" );
+      break;
+    case '3':
+      success = check( pnmReadPlain(r, img, 3, maxval) , "Reading pixels" );
+      break;
+    case '4':
+      success = check( pnmReadBits(r, img) , "Reading pixels" );
+      break;
+    case 'Z':
+      success = pzRead(r, img, rows);
+      break;
+    case '1':
+      // Plain PBM: one digit per pixel, whitespace is optional
+      for (size_t i = 0, n = (size_t)w*h; success && i < n; i++) {
+        int c;
+        do c = pnmGetc(r); while (isspace(c));
+        success = check( c == '0' || c == '1' , "Reading pixels" );
+        img->pixel[i] = (c == '1') ? 0 : PixMax;
+      }
+      break;
+    }
+    PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+  }
 
   // Cleanup
   if (!success) {
@@ -277,11 +1481,55 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
+  if (r != NULL && r->fd >= 0) close(r->fd);
+  free(r);
   return img;
 }
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Write the n buffers of iov to fd, gathered with writev, resuming after
+// short writes.  The iov array is consumed.  Returns 0 on failure.
+static int writeFull(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    if (iov->iov_len == 0) { iov++; n--; continue; }
+    ssize_t m = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+    if (m < 0 && errno == EINTR) continue;
+    if (m < 0) return 0;
+    while (n > 0 && (size_t)m >= iov->iov_len) {
+      m -= iov->iov_len;
+      iov++; n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8*)iov->iov_base + m;
+      iov->iov_len -= m;
+    }
+  }
+  return 1;
+}
+
+// Create (or truncate) filename for writing.  Returns -1 on failure.
+static int createFile(const char* filename) {
+  return open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
+// Close fd, opened with createFile, after writing it with the given
+// success, which is returned (or 0 if close failed).  Preserves errno
+// on failure.
+static int closeFile(int fd, int success) {
+  if (fd < 0) return success;
+  errsave = errno;
+  if (close(fd) != 0 && success) {
+    return check( 0, "Writing pixels failed" );
+  }
+  errno = errsave;
+  return success;
+}
+
 /// Save image to PGM file.
+/// The header and pixels are written with a single writev call.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
@@ -290,33 +1538,261 @@ int ImageSave(Image img, const char* filename) { ///
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
-  FILE* f = NULL;
+  char header[64];
+  struct iovec iov[2] = { { header, 0 }, { img->pixel, (size_t)w*h } };
+  iov[0].iov_len = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", w, h, maxval);
+  int fd = -1;
 
   int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
+  check( (fd = createFile(filename)) >= 0, "Open failed" );
+  if (img->tiles == NULL) {
+    success = success &&
+    check( writeFull(fd, iov, 2), "Writing pixels failed" );
+  } else {
+    // Tiled: write each row in tile-wide spans, one at a time, as fetching
+    // a span may evict the previous one from the cache
+    success = success &&
+    check( writeFull(fd, iov, 1), "Writing header failed" );
+    for (int y = 0; success && y < h; y++) {
+      for (int x = 0, n; success && x < w; x += n) {
+        uint8* span = pixelSpan(img, x, y, &n, 0);
+        struct iovec v = { span, (size_t)n };
+        success = check( writeFull(fd, &v, 1), "Writing pixels failed" );
+      }
+    }
+  }
   PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
 
   // Cleanup
-  if (f != NULL) fclose(f);
-  return success;
+  return closeFile(fd, success);
 }
 
 
-/// Information queries
+/// Save image to a plain (ASCII, P2) PGM file.
+/// Pixels are written as decimal numbers, in lines of at most 70 characters.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveAscii(Image img, const char* filename) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  FILE* f = NULL;
+  char line[80];
 
-/// These functions do not modify the image and never fail.
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P2\n%d %d\n%u\n", w, h, img->maxval) > 0, "Writing header failed" );
+  for (int y = 0; success && y < h; y++) {
+    int len = 0;
+    for (int x = 0, n; x < w; x += n) {
+      const uint8* span = pixelSpan(img, x, y, &n, 0);
+      for (int i = 0; i < n; i++) {
+        // Format by hand: at most 3 digits and a separator
+        unsigned v = span[i];
+        if (len > 66) {
+          line[len++] = '\n';
+          success = success && check( fwrite(line, 1, len, f) == (size_t)len, "Writing pixels failed" );
+          len = 0;
+        } else if (len > 0) {
+          line[len++] = ' ';
+        }
+        if (v >= 100) line[len++] = (char)('0' + v/100);
+        if (v >= 10) line[len++] = (char)('0' + v/10%10);
+        line[len++] = (char)('0' + v%10);
+      }
+    }
+    line[len++] = '\n';
+    success = success && check( fwrite(line, 1, len, f) == (size_t)len, "Writing pixels failed" );
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+  // Cleanup
+  if (f != NULL && fclose(f) != 0) success = check( 0, "Writing pixels failed" );
+  return success;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
+
+/// Save image to a compressed file.
+/// The format (magic number PZ) is specific to this module: rows are
+/// transformed by PNG-style predictors and entropy coded, in independent
+/// stripes of rows that are compressed in parallel.  ImageLoad reads it.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  int ns = (h + PZROWS - 1) / PZROWS;
+  int fd = -1;
+  struct pzArgs a = { img, PZROWS, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+  uint8* sizes = NULL;
+  struct iovec* iov = NULL;
+  char header[80];
+
+  int success =
+  check( (a.s = (struct pzStripe*)calloc(ns + 1, sizeof(struct pzStripe))) != NULL, "Allocating stripes" ) &&
+  check( (sizes = (uint8*)malloc(4*(size_t)ns + 1)) != NULL, "Allocating stripes" ) &&
+  check( (iov = (struct iovec*)malloc((ns + 2)*sizeof(struct iovec))) != NULL, "Allocating stripes" );
+  if (success && img->tiles != NULL) {
+    // The tile cache is not thread-safe: work on a dense copy
+    success = (a.img = ImageCrop(img, 0, 0, w, h)) != NULL;
+  }
+  if (success) {
+    parallelFor(ns, 1, pzEncodeStripes, &a);
+    PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+    for (int k = 0; k < ns; k++) {
+      success = success && check( a.s[k].data != NULL, "Compressing stripes" );
+      sizes[4*k] = (uint8)a.s[k].len;
+      sizes[4*k+1] = (uint8)(a.s[k].len >> 8);
+      sizes[4*k+2] = (uint8)(a.s[k].len >> 16);
+      sizes[4*k+3] = (uint8)(a.s[k].len >> 24);
+      iov[2+k].iov_base = a.s[k].data;
+      iov[2+k].iov_len = a.s[k].len;
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, sizeof(header), "PZ\n%d %d\n%u\n%d\n", w, h, img->maxval, PZROWS);
+    iov[1].iov_base = sizes;
+    iov[1].iov_len = 4*(size_t)ns;
+  }
+  success = success &&
+  check( (fd = createFile(filename)) >= 0, "Open failed" ) &&
+  check( writeFull(fd, iov, ns + 2), "Writing pixels failed" );
+
+  // Cleanup
+  errsave = errno;
+  for (int k = 0; a.s != NULL && k < ns; k++) free(a.s[k].data);
+  free(a.s);
+  free(sizes);
+  free(iov);
+  if (a.img != img) ImageDestroy(&a.img);
+  errno = errsave;
+  return closeFile(fd, success);
+}
+
+
+/// Open a raw PGM file as a tiled image.
+/// The pixels are not loaded: they are read on demand in tiles of 256x256,
+/// through a cache that holds at most cacheTiles tiles (at least 4), so
+/// memory scales with the working set, not the file size.
+/// If writable is true, the file is opened for update, and changes to
+/// the image are written back to it (on tile eviction, ImageFlush, or
+/// ImageDestroy).  Otherwise, the file is never modified: changed tiles
+/// evicted from the cache are kept in a private scratch file.
+/// Tiled images may be used with all other functions.  ImageGetPixel,
+/// ImageSetPixel, ImageCrop, ImagePaste, ImageMatchSubImage and
+/// ImageLocateSubImage access whole tile rows at a time.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageOpenTiled(const char* filename, int cacheTiles, int writable) { ///
+  assert (cacheTiles > 0);
+  int w, h;
+  int maxval;
+  int fmt;
+  int rows;
+  off_t offset = 0;
+  struct pnmReader* r = NULL;
+  struct stat st;
+  Image img = NULL;
+  struct tileCache* tc = NULL;
+
+  int success =
+  check( (r = (struct pnmReader*)malloc(sizeof(struct pnmReader))) != NULL, "Allocating read buffer" ) &&
+  check( (r->fd = open(filename, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC)) >= 0, "Open failed" );
+  if (success) {
+    r->pos = r->len = 0;
+    success =
+    // Parse header, as in ImageLoad: the pixels start after what was parsed
+    pnmHeader(r, PixMax, &fmt, &w, &h, &maxval, &rows) &&
+    check( fmt == '5' , "Invalid file format (not raw PGM)" ) &&
+    check( (offset = lseek(r->fd, 0, SEEK_CUR) - (off_t)(r->len - r->pos)) > 0 , "Invalid file offset" ) &&
+    check( fstat(r->fd, &st) == 0 && st.st_size >= offset + (off_t)w*h , "File too short" ) &&
+    // Allocate image (without pixels) and tile cache
+    check( (img = (Image)malloc(sizeof(struct image))) != NULL , "Allocating image" ) &&
+    check( (tc = (struct tileCache*)calloc(1, sizeof(struct tileCache))) != NULL , "Allocating tile cache" );
+  }
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->pixel = NULL;
+    img->tiles = tc;
+    img->dirtyX0 = img->dirtyY0 = 0;
+    img->dirtyX1 = w;
+    img->dirtyY1 = h;
+    img->hist = NULL;
+    img->mapped = 0;
+    tc->fd = r->fd;  // the tiles are read from the same file
+    r->fd = -1;
+    tc->offset = offset;
+    tc->writable = writable;
+    tc->scratch = -1;
+    tc->ntx = (w + TILE - 1) / TILE;
+    int ntiles = tc->ntx * ((h + TILE - 1) / TILE);
+    tc->capacity = cacheTiles < 4 ? 4 : cacheTiles;
+    if (tc->capacity > ntiles) tc->capacity = ntiles > 0 ? ntiles : 1;
+    success =
+    check( (tc->slotOf = (int*)malloc((ntiles > 0 ? ntiles : 1)*sizeof(int))) != NULL , "Allocating tile cache" ) &&
+    check( writable || (tc->spilled = (uint8*)calloc(ntiles > 0 ? ntiles : 1, 1)) != NULL , "Allocating tile cache" ) &&
+    check( (tc->slot = (struct tileSlot*)calloc(tc->capacity, sizeof(struct tileSlot))) != NULL , "Allocating tile cache" );
+    for (int t = 0; success && t < ntiles; t++) tc->slotOf[t] = -1;
+    for (int i = 0; success && i < tc->capacity; i++) {
+      struct tileSlot* s = &tc->slot[i];
+      s->tile = -1;
+      s->prev = i - 1;
+      s->next = (i + 1 < tc->capacity) ? i + 1 : -1;
+      success = check( (s->data = (uint8*)malloc(TILE*TILE)) != NULL , "Allocating tile cache" );
+    }
+    tc->mru = 0;
+    tc->lru = tc->capacity - 1;
+  }
+
+  // Cleanup
+  if (r != NULL && r->fd >= 0) close(r->fd);
+  free(r);
+  if (!success) {
+    errsave = errno;
+    if (img != NULL && tc != NULL) {
+      tc->writable = 0;  // nothing to write back
+      ImageDestroy(&img);
+    } else {
+      free(img);
+      free(tc);
+      img = NULL;
+    }
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Write back the modified pixels of a tiled image to its file.
+/// For images that are not tiled, does nothing and succeeds.
+/// On success, returns nonzero.
+/// On failure (including previous failed tile reads or writes),
+/// returns 0 and errno/errCause are set appropriately.
+int ImageFlush(Image img) { ///
+  assert (img != NULL);
+  if (img->tiles == NULL) return 1;
+  if (!img->tiles->writable) return check(img->tiles->ioerr == 0, "Reading tiles failed");
+  return check( tilesFlush(img), "Writing tiles failed" );
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
   return img->height;
 }
 
@@ -326,33 +1802,132 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+/// Change tracking
+
+// Each image keeps the bounding rectangle of the pixels changed since the
+// last ImageClearDirty (all of them, for a new image), so that results
+// derived from it (as by ImageBlurDirty) can be brought up to date by
+// recomputing only what depends on that rectangle.
+// An image may also cache the histogram of its levels, built by ImageStats.
+// Operations that change few pixels (ImageSetPixel, ImagePaste and
+// ImageBlend) update it, by taking out the old levels of the pixels
+// changed and adding the new ones; the others drop it.
+
+// Grow the dirty rectangle of img to include (x, y, w, h).
+static inline void markDirty(Image img, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return;
+  if (img->dirtyX0 >= img->dirtyX1 || img->dirtyY0 >= img->dirtyY1) {
+    img->dirtyX0 = x;
+    img->dirtyY0 = y;
+    img->dirtyX1 = x + w;
+    img->dirtyY1 = y + h;
+    return;
+  }
+  if (x < img->dirtyX0) img->dirtyX0 = x;
+  if (y < img->dirtyY0) img->dirtyY0 = y;
+  if (x + w > img->dirtyX1) img->dirtyX1 = x + w;
+  if (y + h > img->dirtyY1) img->dirtyY1 = y + h;
+}
+
+// Record that any pixel of img may have changed.
+static void imageChanged(Image img) {
+  markDirty(img, 0, 0, img->width, img->height);
+  free(img->hist);
+  img->hist = NULL;
+}
+
+// Add (sign = 1) or take out (sign = -1) the levels of the pixels in the
+// rectangle (x, y, w, h) of img to or from the histogram hist.
+static void histRect(unsigned long* hist, Image img, int x, int y, int w, int h, int sign) {
+  // Four partial histograms, so that runs of equal levels do not stall
+  unsigned long part[4][PixMax + 1];
+  memset(part, 0, sizeof(part));
+  for (int r = 0; r < h; r++) {
+    for (int c = 0, n; c < w; c += n) {
+      const uint8* span = pixelSpan(img, x + c, y + r, &n, 0);
+      if (n > w - c) n = w - c;
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        part[0][span[i]]++;
+        part[1][span[i+1]]++;
+        part[2][span[i+2]]++;
+        part[3][span[i+3]]++;
+      }
+      for (; i < n; i++) part[0][span[i]]++;
+    }
+  }
+  for (int v = 0; v <= PixMax; v++) {
+    unsigned long t = part[0][v] + part[1][v] + part[2][v] + part[3][v];
+    hist[v] = (sign > 0) ? hist[v] + t : hist[v] - t;
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+}
+
+/// Get the rectangle of the pixels of img changed since the last call to
+/// ImageClearDirty (or since img was created): its bounding box is stored
+/// in *x, *y, *w, *h, and 1 (true) is returned.  If no pixels changed,
+/// returns 0 (false) and *x, *y, *w, *h are set to 0.
+/// (The rectangle may include pixels that did not change.)
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) { ///
+  assert (img != NULL);
+  if (img->dirtyX0 >= img->dirtyX1 || img->dirtyY0 >= img->dirtyY1) {
+    *x = *y = *w = *h = 0;
+    return 0;
+  }
+  *x = img->dirtyX0;
+  *y = img->dirtyY0;
+  *w = img->dirtyX1 - img->dirtyX0;
+  *h = img->dirtyY1 - img->dirtyY0;
+  return 1;
+}
+
+/// Mark all pixels of img as unchanged (see ImageDirtyRect).
+void ImageClearDirty(Image img) { ///
+  assert (img != NULL);
+  img->dirtyX0 = img->dirtyY0 = img->dirtyX1 = img->dirtyY1 = 0;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// The histogram of the image is built by the first call, and kept up to
+/// date by ImageSetPixel, ImagePaste and ImageBlend (at the cost of the
+/// pixels they change), so that later calls take constant time.
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
   // Insert your code here!
-  int img_size = img->width*img->height;
-  
-  //O que fazer se o tamanho da imagem for zero?
-  *min = *max = img->pixel[0];
-  
-  if(img_size == 1)
-	return;
+  //Imagem vazia: não há píxeis, devolve-se [0, 0]
+  if(img->width == 0 || img->height == 0) {
+	  *min = *max = 0;
+	  return;
+  }
   
   //Achar os píxeis de valor mínimo e máximo
-  uint8 amin = *min, amax = *max;
-  for(int i = 1; i < img_size; i++) {
-	  if(img->pixel[i] < amin)
-		  amin = img->pixel[i];
-	  else if(img->pixel[i] > amax)
-		  amax = img->pixel[i];
+  unsigned amin = PixMax, amax = 0;
+  if (img->hist == NULL) {
+    // Build the histogram, kept up to date by small changes to the image
+    img->hist = (unsigned long*)calloc(PixMax + 1, sizeof(unsigned long));
+    if (img->hist != NULL) histRect(img->hist, img, 0, 0, img->width, img->height, 1);
   }
-  
-  *min = amin;
-  *max = amax;
+  if (img->hist != NULL) {
+    amin = 0;
+    while (img->hist[amin] == 0) amin++;
+    amax = PixMax;
+    while (img->hist[amax] == 0) amax--;
+  } else {
+    // Out of memory for the histogram: scan the pixels
+    for(int y = 0; y < img->height; y++) {
+      for(int x = 0, n; x < img->width; x += n) {
+        const uint8* span = pixelSpan(img, x, y, &n, 0);
+        minmaxSpan8(span, n, &amin, &amax);
+      }
+    }
+    PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+  }
+  *min = (uint8)amin;
+  *max = (uint8)amax;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -365,8 +1940,8 @@ int ImageValidPos(Image img, int x, int y) { ///
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   // Insert your code here!
-  //Se o canto inferior direito da área retangular estiver dentro da imagem, então toda a área retangular estará dentro da imagem
-  return(ImageValidPos(img, x+w-1, y+h-1));
+  //O canto superior esquerdo e o inferior direito da área retangular têm de estar dentro da imagem
+  return (0 <= x && 0 <= y && 0 <= w && 0 <= h) && (x+w <= img->width) && (y+h <= img->height);
 }
 
 /// Pixel get & set operations
@@ -393,6 +1968,10 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (read)
   PIXRD++;
+  if (img->tiles != NULL) {
+    int n;
+    return *pixelSpan(img, x, y, &n, 0);
+  }
   return img->pixel[G(img, x, y)];
 } 
 
@@ -402,10 +1981,42 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
   PIXWR++;
-  img->pixel[G(img, x, y)] = level;
+  markDirty(img, x, y, 1, 1);
+  uint8* p;
+  if (img->tiles != NULL) {
+    int n;
+    p = pixelSpan(img, x, y, &n, 1);
+  } else {
+    p = &img->pixel[G(img, x, y)];
+  }
+  if (img->hist != NULL) {
+    img->hist[*p]--;
+    img->hist[level]++;
+  }
+  *p = level;
 } 
 
 
+// Copy the w x h rectangle at (sx, sy) of src to position (dx, dy) of dst,
+// one row span at a time.  Both rectangles must be inside their images.
+// Works for tiled and non-tiled images (but src and dst must differ).
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h) {
+  assert (dst != src);
+  for (int r = 0; r < h; r++) {
+    int nd, ns;
+    for (int c = 0, n; c < w; c += n) {
+      uint8* d = pixelSpan(dst, dx + c, dy + r, &nd, 1);
+      const uint8* s = pixelSpan(src, sx + c, sy + r, &ns, 0);
+      n = nd < ns ? nd : ns;
+      if (n > w - c) n = w - c;
+      memcpy(d, s, n);
+    }
+  }
+  PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses
+  PIXRD += (unsigned long)w*h;
+  PIXWR += (unsigned long)w*h;
+}
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -419,10 +2030,15 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) { ///
   assert (img != NULL);
+  imageChanged(img);
   // Insert your code here!
-  uint8 maxval = img->maxval;
-  for(int i = 0; i < img->width*img->height; i++)
-    img->pixel[i] = maxval - img->pixel[i];
+  for(int y = 0; y < img->height; y++) {
+    for(int x = 0, n; x < img->width; x += n) {
+      uint8* span = pixelSpan(img, x, y, &n, 1);
+      negSpan8(span, n, img->maxval);
+    }
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
 }
 
 /// Apply threshold to image.
@@ -430,22 +2046,14 @@ void ImageNegative(Image img) { ///
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
-  assert (img != NULL);
-    img->width = ImageWidth(img); //nao sei se aqui é assim ou int width
-    img->height = ImageHeight(img);
-    img->maxval = ImageMaxval(img);
-
-    for ( uint32_t  i = 0; i < img->height; i++) {
-        for (uint32_t  j = 0; j < img->width; j++) {
-            uint8 pixel = ImageGetPixel(img, j, i);
-
-            if (pixel < thr) {
-                ImageSetPixel(img, j, i, 0);
-            } else {
-                ImageSetPixel(img, j, i, img->maxval);
-            }
-        }
+  imageChanged(img);
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, n; x < img->width; x += n) {
+      uint8* span = pixelSpan(img, x, y, &n, 1);
+      thrSpanFast8(span, n, thr, img->maxval);
     }
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
 }
 
 /// Brighten image by a factor.
@@ -454,20 +2062,15 @@ void ImageThreshold(Image img, uint8 thr) { ///
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
-   assert (factor >= 0.0);
-  
-    for (uint32_t i = 0; i < img->height; i++) {
-        for (uint32_t j = 0; j < img->width; j++) {
-            uint8_t pixel = ImageGetPixel(img, j, i);
-            uint8_t brightenedPixel = (uint8_t)((double)pixel * factor);
-
-            if (brightenedPixel > img->maxval) {
-                brightenedPixel = img->maxval;
-            }
-
-            ImageSetPixel(img, j, i, brightenedPixel);
-        }
+  assert (factor >= 0.0);
+  imageChanged(img);
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, n; x < img->width; x += n) {
+      uint8* span = pixelSpan(img, x, y, &n, 1);
+      briSpan8(span, n, factor, img->maxval);
     }
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
 }
 
 
@@ -486,7 +2089,7 @@ void ImageBrighten(Image img, double factor) { ///
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counter-clockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -499,19 +2102,15 @@ Image ImageRotate(Image img) { ///
 
   Image rotated_img = ImageCreate(height, width, img->maxval);
   if (!rotated_img) return NULL; // error already set
-   if(rotated_img= NULL){
-      /*errno = ENOMEM;
-	    errCause = "Falha ao alocar memória para a imagem resultante do crop\n";*/
-      return NULL;
-   }
-   for (int i = 0; i < width; ++i) {
-    for(int j = 0; j < height; ++j){
-      int rotated_i = j;
-      int rotated_j = width -1 -i;
-      ImageSetPixel(rotated_img, rotated_i,rotated_j, ImageGetPixel(img, i, j));
+  // pixel (i, j) goes to (j, width-1-i)
+  for (int j = 0; j < height; j++) {
+    for (int i = 0, n; i < width; i += n) {
+      const uint8* span = pixelSpan(img, i, j, &n, 0);
+      rotSpan8(rotated_img->pixel, height, span, n, i, j, width);
     }
-   }
-   return rotated_img;
+  }
+  PIXMEM += 2*(unsigned long)width*height;  // count pixel memory accesses
+  return rotated_img;
 }
 
 /// Mirror an image = flip left-right.
@@ -525,20 +2124,16 @@ Image ImageMirror(Image img) { ///
   assert (img != NULL);
    Image mirrored_img = ImageCreate(img->width, img->height, img->maxval);
     if (mirrored_img == NULL) {
-        errno = ENOMEM;
-	      errCause = "Falha ao alocar memória para a imagem resultante do crop\n";
-        return NULL;
+        return NULL; // error already set
     }
-    for (uint32_t i = 0; i < img->height; i++) {
-        for (uint32_t j= 0; j < img->width; j++) {
-
-            // coordenadas img 1(i, j)
-            img->pixel = ImageGetPixel(img, i, j);
-
-            // mudar as coordenadas (j, i) na img espelhada para o pixel value da img original
-            ImageSetPixel(mirrored_img, j, i, img->pixel);
+    for (int i = 0; i < img->height; i++) {
+        for (int j = 0, n; j < img->width; j += n) {
+            // span [j, j+n) goes reversed to [width-j-n, width-j) of the mirrored img
+            const uint8* span = pixelSpan(img, j, i, &n, 0);
+            revSpan8(mirrored_img->pixel + (size_t)i*img->width + img->width - j - n, span, n);
         }
     }
+    PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
 
     return mirrored_img;
 }
@@ -567,12 +2162,7 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   }
   
   //Copiar os píxeis da zona adequada de img para a nova imagem
-  for(int ay = y; ay < y+h; ay++) {
-	  for(int ax = x; ax < x+w; ax++) {
-		  //~ ret->pixel[i++] = img->pixel[G(img, ax, ay)];
-		  ImageSetPixel(ret, ax, ay, ImageGetPixel(img, ax, ay));
-	  }
-  }
+  copyRect(ret, 0, 0, img, x, y, w, h);
   
   return ret;
 }
@@ -588,16 +2178,15 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-    for (int i = 0; i < img2->height; i++) {
-        for (int j = 0; j < img2->width; j++) {
-
-            // Get the pixel value from the second image at coordinates (i, j)
-           uint8_t pixel = ImageGetPixel(img2, i, j);
-
-            // Set the pixel value at coordinates (x + j, y + i) in the first image to the pixel value from the second image
-            ImageSetPixel(img1, x + j, y + i, pixel);
-        }
-    }
+  int w = img2->width;
+  int h = img2->height;
+  markDirty(img1, x, y, w, h);
+  if (img1->hist != NULL) {
+    histRect(img1->hist, img1, x, y, w, h, -1);
+    histRect(img1->hist, img2, 0, 0, w, h, 1);
+  }
+  // Copy img2 into the rectangle at (x, y) of img1, a row span at a time
+  copyRect(img1, x, y, img2, 0, 0, w, h);
 }
 
 /// Blend an image into a larger image.
@@ -610,6 +2199,20 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  markDirty(img1, x, y, img2->width, img2->height);
+  if (img1->hist != NULL) histRect(img1->hist, img1, x, y, img2->width, img2->height, -1);
+  for (int i = 0; i < img2->height; i++) {
+    int n1, n2;
+    for (int j = 0, n; j < img2->width; j += n) {
+      uint8* d = pixelSpan(img1, x + j, y + i, &n1, 1);
+      const uint8* s = pixelSpan(img2, j, i, &n2, 0);
+      n = n1 < n2 ? n1 : n2;
+      if (n > img2->width - j) n = img2->width - j;
+      blendSpan8(d, s, n, alpha, img1->maxval);
+    }
+  }
+  PIXMEM += 3*(unsigned long)img2->width*img2->height;  // count pixel memory accesses
+  if (img1->hist != NULL) histRect(img1->hist, img1, x, y, img2->width, img2->height, 1);
     //~ assert (ImageValidRect(img1, x, y, img2->width, img2->height));
   
     //~ // Iterate over each pixel in the second image
@@ -641,20 +2244,22 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   if(!ImageValidRect(img1, x, y, img2->width, img2->height))
 	return 0;
   
-  //Criar a sub-imagem para comparação
-  Image sub = ImageCrop(img1, x, y, img2->width, img2->height);
-  
-  //Comparar a imagem 2 com a sub-imagem
-  int match = 1;
-    for(int ay = y; ay < y+img2->height; ay++) {
-	  for(int ax = x; ax < x+img1->width; ax++) {
-		  if(ImageGetPixel(img2, ax, ay) != ImageGetPixel(sub, ax, ay)) {
-			  match = 0;
-			  break;
+  //Comparar a imagem 2 com a zona correspondente da imagem 1 (sem criar uma cópia)
+  for(int ay = 0; ay < img2->height; ay++) {
+	  int n1, n2;
+	  for(int ax = 0, n; ax < img2->width; ax += n) {
+		  //Comparar os troços contíguos das duas linhas
+		  const uint8* s1 = pixelSpan(img1, x+ax, y+ay, &n1, 0);
+		  const uint8* s2 = pixelSpan(img2, ax, ay, &n2, 0);
+		  n = n1 < n2 ? n1 : n2;
+		  if(n > img2->width - ax) n = img2->width - ax;
+		  PIXMEM += 2*(unsigned long)n;
+		  if(memcmp(s1, s2, n) != 0) {
+			  return 0;
 		  }
 	  }
-    }
-  return match;
+  }
+  return 1;
 }
 
 /// Locate a subimage inside another image.
@@ -684,6 +2289,332 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   return 0;
 }
 
+/// Image pyramids
+
+// Maximum number of pyramid levels
+#define PYRMAXLEVELS 16
+
+// Minimum needle size (in pixels) for a pyramid level to be searched
+#define PYRMINSIZE 4
+
+// A pyramid holds successively halved versions of an image, obtained by
+// 2x2 box downsampling: level[0] is the original image (not owned by the
+// pyramid), level[l+1] is half the width and height of level[l].
+struct pyramid {
+  int levels;   // <= PYRMAXLEVELS
+  Image* level;
+};
+
+// Arguments for the downsampling kernel
+struct downArgs {
+  Image src;
+  Image dst;
+  int ox, oy;   // position of the first block in src
+};
+
+// Downsample rows [begin, end) of dst from src: each pixel is the rounded
+// mean of a 2x2 block of src.
+static void downsampleRows(void* arg, int begin, int end) {
+  struct downArgs* a = (struct downArgs*)arg;
+  int w = a->dst->width;
+  int sw = a->src->width;
+  for (int y = begin; y < end; y++) {
+    const uint8* r0 = a->src->pixel + (size_t)(2*y + a->oy)*sw + a->ox;
+    const uint8* r1 = r0 + sw;
+    uint8* d = a->dst->pixel + (size_t)y*w;
+    int x = 0;
+#ifdef __SSE2__
+    // 8 output pixels per iteration: split each 16-byte row chunk into its
+    // even and odd bytes (as 16-bit lanes), and add the four of each block.
+    const __m128i lo = _mm_set1_epi16(0x00FF);
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 8 <= w; x += 8) {
+      __m128i a0 = _mm_loadu_si128((const __m128i*)(r0 + 2*x));
+      __m128i a1 = _mm_loadu_si128((const __m128i*)(r1 + 2*x));
+      __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, lo), _mm_srli_epi16(a0, 8)),
+                                  _mm_add_epi16(_mm_and_si128(a1, lo), _mm_srli_epi16(a1, 8)));
+      sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+      _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(sum, sum));
+    }
+#endif
+    for (; x < w; x++) {
+      d[x] = (uint8)((r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) >> 2);
+    }
+  }
+}
+
+// Return a new image with half the size of img (rounded down), by 2x2 box
+// downsampling, or NULL on failure.
+static Image downsample(Image img) {
+  Image dst = ImageCreate(img->width/2, img->height/2, img->maxval);
+  if (dst == NULL) return NULL;
+  Image src = img;
+  if (img->tiles != NULL) {
+    // The tile cache is not thread-safe: work on a dense copy
+    src = ImageCrop(img, 0, 0, img->width, img->height);
+    if (src == NULL) { ImageDestroy(&dst); return NULL; }
+  }
+  struct downArgs a = { src, dst, 0, 0 };
+  parallelFor(dst->height, 16, downsampleRows, &a);
+  PIXMEM += 5*(unsigned long)dst->width*dst->height;  // 4 reads + 1 write
+  if (src != img) ImageDestroy(&src);
+  return dst;
+}
+
+/// Build a pyramid of successively halved versions of img.
+/// Level 0 is img itself and level l+1 is obtained from level l by 2x2
+/// box downsampling (each pixel is the rounded mean of a 2x2 block).
+/// At most levels levels (and no more than 16) are built, stopping before
+/// any dimension would become 0.  The pyramid refers to img as level 0, so img must not be
+/// modified or destroyed while the pyramid is in use.
+/// Requires: levels >= 1.
+/// On success, a new pyramid is returned.
+/// (The caller is responsible for destroying it with ImageDestroyPyramid!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Pyramid ImageBuildPyramid(Image img, int levels) { ///
+  assert (img != NULL);
+  assert (levels >= 1);
+  if (levels > PYRMAXLEVELS) levels = PYRMAXLEVELS;
+  Pyramid p = (Pyramid)malloc(sizeof(struct pyramid));
+  Image* level = (Image*)malloc(levels*sizeof(Image));
+  if (!check(p != NULL && level != NULL, "Allocating pyramid")) {
+    free(p);
+    free(level);
+    return NULL;
+  }
+  p->level = level;
+  p->level[0] = img;
+  p->levels = 1;
+  while (p->levels < levels) {
+    Image prev = p->level[p->levels - 1];
+    if (prev->width < 2 || prev->height < 2) break;
+    Image next = downsample(prev);
+    if (next == NULL) {
+      errsave = errno;
+      ImageDestroyPyramid(&p);
+      errno = errsave;
+      return NULL;
+    }
+    p->level[p->levels++] = next;
+  }
+  return p;
+}
+
+/// Number of levels of a pyramid (at least 1).
+int ImagePyramidLevels(Pyramid p) { ///
+  assert (p != NULL);
+  return p->levels;
+}
+
+/// Image at a given level of a pyramid (level 0 is the original image).
+/// The image belongs to the pyramid: it must not be destroyed by the caller.
+/// Requires: 0 <= level < ImagePyramidLevels(p).
+Image ImagePyramidLevel(Pyramid p, int level) { ///
+  assert (p != NULL);
+  assert (0 <= level && level < p->levels);
+  return p->level[level];
+}
+
+/// Destroy the pyramid pointed to by (*pp), except for level 0.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImageDestroyPyramid(Pyramid* pp) { ///
+  assert (pp != NULL);
+  Pyramid p = *pp;
+  if (p == NULL) return;
+  for (int l = 1; l < p->levels; l++) ImageDestroy(&p->level[l]);
+  free(p->level);
+  free(p);
+  *pp = NULL;
+}
+
+// Coarse-to-fine search
+//
+// An exact match of img2 at (x, y) of level 0 is only an exact match at a
+// coarser level l if it is aligned with the 2^l x 2^l blocks of that level.
+// So img2 is cropped at each phase o in [0, 2^l) (in x and y) such that
+// x+o is a multiple of 2^l, and the crop is downsampled l times: then it
+// matches level l of the pyramid exactly at ((x+o)/2^l, (y+o)/2^l).
+// The crops of level l are obtained from those of level l-1, so building
+// all phases of a level costs about as much as downsampling img2 once.
+//
+// The search scans the coarsest level L for all phases, in an order that
+// visits level 0 positions in raster order, and refines each coarse match
+// at each finer level, with an exact verification at level 0.
+
+// Needle images for all phases of levels 0..L.
+// needle[l][oy*2^l + ox] is img2 cropped at (ox, oy) and downsampled l times.
+struct needles {
+  int L;
+  Image* needle[PYRMAXLEVELS];
+};
+
+// Return a new image by 2x2 box downsampling of img, from position (ox, oy).
+static Image downsampleAt(Image img, int ox, int oy) {
+  Image dst = ImageCreate((img->width - ox)/2, (img->height - oy)/2, img->maxval);
+  if (dst == NULL) return NULL;
+  struct downArgs a = { img, dst, ox, oy };
+  downsampleRows(&a, 0, dst->height);
+  PIXMEM += 5*(unsigned long)dst->width*dst->height;  // 4 reads + 1 write
+  return dst;
+}
+
+static void needlesDestroy(struct needles* n) {
+  for (int l = 0; l <= n->L; l++) {
+    if (n->needle[l] == NULL) continue;
+    for (int i = (l == 0); i < (1 << 2*l); i++) ImageDestroy(&n->needle[l][i]);
+    free(n->needle[l]);
+  }
+}
+
+// Build needles for levels 0..L from img2 (dense).  Returns 0 on failure.
+static int needlesBuild(struct needles* n, Image img2, int L) {
+  n->L = L;
+  for (int l = 0; l <= L; l++) n->needle[l] = (Image*)calloc((size_t)1 << 2*l, sizeof(Image));
+  for (int l = 0; l <= L; l++) {
+    if (!check(n->needle[l] != NULL, "Allocating pyramid")) return 0;
+  }
+  n->needle[0][0] = img2;
+  for (int l = 1; l <= L; l++) {
+    int s = 1 << l;
+    int h = s/2;
+    for (int oy = 0; oy < s; oy++) {
+      for (int ox = 0; ox < s; ox++) {
+        Image parent = n->needle[l-1][(oy % h)*h + ox % h];
+        n->needle[l][oy*s + ox] = downsampleAt(parent, ox / h, oy / h);
+        if (n->needle[l][oy*s + ox] == NULL) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Compare img2 with the subimage of dense img1 at (x, y), with no
+// instrumentation (so it can be used by concurrent threads).
+static int denseMatch(Image img1, int x, int y, Image img2) {
+  int w = img2->width;
+  for (int r = 0; r < img2->height; r++) {
+    if (memcmp(img1->pixel + (size_t)(y + r)*img1->width + x, img2->pixel + (size_t)r*w, w) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Arguments for the coarse-to-fine search
+struct searchArgs {
+  Pyramid pyr;
+  struct needles* n;
+  pthread_mutex_t lock;   // protects the fields below
+  int found, x, y;        // first match found so far (in raster order)
+};
+
+// Search for matches at level 0 positions (x, y) with y in
+// [begin*2^L - 2^L + 1, end*2^L), stopping at the first one (in raster order).
+// Coarse rows are scanned by concurrent threads, but the verification at
+// level 0 is done under the lock, since it uses instrumentation counters and
+// (maybe) the tile cache of the level 0 image.
+static void searchRows(void* arg, int begin, int end) {
+  struct searchArgs* a = (struct searchArgs*)arg;
+  int L = a->n->L;
+  int s = 1 << L;
+  Image img1 = a->pyr->level[0];
+  Image img2 = a->n->needle[0][0];
+  int Xmax = (img1->width - img2->width + s - 1)/s;
+  for (int Y = begin; Y < end; Y++) {
+    pthread_mutex_lock(&a->lock);
+    int done = a->found && a->y < Y*s - s + 1;  // a match before this row
+    pthread_mutex_unlock(&a->lock);
+    if (done) return;
+    for (int oy = s-1; oy >= 0; oy--) {
+      int y = Y*s - oy;
+      if (y < 0 || y > img1->height - img2->height) continue;
+      for (int X = 0; X <= Xmax; X++) {
+        for (int ox = s-1; ox >= 0; ox--) {
+          int x = X*s - ox;
+          if (x < 0 || x > img1->width - img2->width) continue;
+          // Check from the coarsest level down to level 1
+          int l = L;
+          for (; l > 0; l--) {
+            int m = (1 << l) - 1;
+            int o = (oy & m)*(m + 1) + (ox & m);
+            if (!denseMatch(a->pyr->level[l], (x + (ox & m)) >> l, (y + (oy & m)) >> l, a->n->needle[l][o]))
+              break;
+          }
+          if (l > 0) continue;
+          // Verify at level 0
+          pthread_mutex_lock(&a->lock);
+          int match = ImageMatchSubImage(img1, x, y, img2);
+          if (match && (!a->found || y < a->y || (y == a->y && x < a->x))) {
+            a->found = 1;
+            a->x = x;
+            a->y = y;
+          }
+          pthread_mutex_unlock(&a->lock);
+          if (match) return;
+        }
+      }
+    }
+  }
+}
+
+/// Locate a subimage inside another image, using a pyramid of the larger
+/// image for a coarse-to-fine search.
+/// Searches for img2 inside level 0 of pyr (the image it was built from),
+/// with the same result as ImageLocateSubImage(level0, px, py, img2).
+/// The search starts at the coarsest level where img2 still covers at least
+/// 4x4 pixels, where only positions whose downsampled pixels match exactly
+/// are refined at each finer level, down to an exact verification at level 0.
+/// Coarse rows are searched in parallel.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateSubImagePyramid(Pyramid pyr, int* px, int* py, Image img2) { ///
+  assert (pyr != NULL);
+  assert (img2 != NULL);
+  Image img1 = pyr->level[0];
+  if ((img2->width > img1->width) || (img2->height > img1->height)) {
+    return 0;
+  }
+
+  // Coarsest level where all phases of img2 have at least PYRMINSIZE pixels
+  int L = 0;
+  while (L+1 < pyr->levels && L+1 < PYRMAXLEVELS &&
+         (img2->width - (2 << L) + 1) >> (L+1) >= PYRMINSIZE &&
+         (img2->height - (2 << L) + 1) >> (L+1) >= PYRMINSIZE)
+    L++;
+  if (L == 0) return ImageLocateSubImage(img1, px, py, img2);
+
+  Image dense2 = NULL;
+  if (img2->tiles != NULL) {
+    dense2 = ImageCrop(img2, 0, 0, img2->width, img2->height);
+    if (dense2 == NULL) return ImageLocateSubImage(img1, px, py, img2);
+  }
+  struct needles n;
+  if (!needlesBuild(&n, dense2 != NULL ? dense2 : img2, L)) {
+    needlesDestroy(&n);
+    ImageDestroy(&dense2);
+    return ImageLocateSubImage(img1, px, py, img2);
+  }
+
+  struct searchArgs a;
+  a.pyr = pyr;
+  a.n = &n;
+  a.found = 0;
+  pthread_mutex_init(&a.lock, NULL);
+  int s = 1 << L;
+  int rows = (img1->height - img2->height + s - 1)/s + 1;  // coarse rows Y
+  parallelFor(rows, 2, searchRows, &a);
+  pthread_mutex_destroy(&a.lock);
+  Image hay = pyr->level[L];
+  PIXMEM += (unsigned long)hay->width*hay->height*s*s;  // approx. 1 coarse read per position
+
+  needlesDestroy(&n);
+  ImageDestroy(&dense2);
+  if (a.found) {
+    *px = a.x;
+    *py = a.y;
+  }
+  return a.found;
+}
 
 /// Filtering
 
@@ -693,8 +2624,8 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
 /// The image is changed in-place.
 //Tabela que para cada píxel (x, y) associa a soma dos valores de todos os píxeis do retângulo que vai de (0, 0)  a (x, y)
 unsigned long int* build_summed_area_table(Image img) {
-	//Pode produzir erros
-	unsigned long int* table = (unsigned long int*)malloc(img->width*img->height*sizeof(unsigned long int));
+	unsigned long int* table = (unsigned long int*)malloc((size_t)img->width*img->height*sizeof(unsigned long int));
+	if(!check(table != NULL, "Allocating summed-area table")) return NULL;
 	
 	for(int y = 0; y < img->height; y++) {
 		for(int x = 0; x < img->width; x++) {
@@ -723,128 +2654,2668 @@ unsigned long int* build_summed_area_table(Image img) {
 	return table;
 }
 
-void ImageBlur_naive_sem_borda(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  //Clonar imagem
-  Image img_cpy = ImageCrop(img, 0, 0, img->width, img->height);
-  
-  int soma;
-  float valor;
-  for(int y = dy; y < img->height-dy; y++) {
-	  for(int x = dx; x < img->width-dx; x++) {
-		  //Para cada pixel da imagem (somente os que causam a janela a ficar dentro da imagem)
-		  soma = 0;
-		  for(int i = y-dy; i <= y+dy; i++) {
-			  for(int j = x-dx; j <= x+dx; j++) {
-				  //Somar os valores dos pixeis da janela
-				  soma += ImageGetPixel(img_cpy, j, i);
-			  }
-		  }
-		  //Dividir pelo número de píxeis da janela
-		  valor = (float)soma / ((2*dx+1)*(2*dy+1));
-		  ImageSetPixel(img, x, y, (uint8)arred(valor));
-	  }
+// Specialized blur kernels
+//
+// The mean filter of the common small windows is computed directly, with
+// no summed-area table.  BLUR_KERNEL(DX, DY) instantiates a kernel with the
+// window size fixed at compile time, so the window loops are unrolled.
+// The kernel computes rows [y0, y1) of the interior of the image (where
+// the whole window fits), from a copy s of the pixels: it adds 2DY+1 rows
+// into 16-bit column sums col (w entries), and then 2DX+1 column sums for
+// each pixel, 16 and 8 pixels at a time with SSE2.  Rounding is to nearest,
+// as in boxRows8: the division of sum + area/2 by the area is done as a
+// multiplication by m and a shift right by k, exact for the sums of up to
+// 255*area + area/2 that occur (since that times area is at most 2^k).
+#define BLUR_KERNEL(DX, DY)                                                   \
+static void blurKernel##DX##x##DY(uint8* d, const uint8* s, int w,           \
+                                  int y0, int y1, uint16_t* col) {           \
+  const unsigned area = (2*DX + 1)*(2*DY + 1);                               \
+  int k = 16;                                                                \
+  while ((1u << k) < (255*area + area/2)*area) k++;                          \
+  const unsigned m = ((1u << k) + area - 1) / area;                          \
+  for (int y = y0; y < y1; y++) {                                            \
+    const uint8* r = s + (size_t)(y - DY)*w;                                 \
+    int x = 0;                                                               \
+    BLUR_COLS_SSE2(DY)                                                       \
+    for (; x < w; x++) {                                                     \
+      unsigned c = 0;                                                        \
+      for (int j = 0; j <= 2*DY; j++) c += r[(size_t)j*w + x];               \
+      col[x] = (uint16_t)c;                                                  \
+    }                                                                        \
+    uint8* o = d + (size_t)y*w;                                              \
+    x = DX;                                                                  \
+    BLUR_ROW_SSE2(DX)                                                        \
+    for (; x < w - DX; x++) {                                                \
+      unsigned sum = area/2;                                                 \
+      for (int i = -DX; i <= DX; i++) sum += col[x + i];                     \
+      o[x] = (uint8)((sum*m) >> k);                                          \
+    }                                                                        \
+  }                                                                          \
+}
+
+#ifdef __SSE2__
+// Column sums of 16 pixels per iteration, widened to 16 bits
+#define BLUR_COLS_SSE2(DY)                                                    \
+    for (; x + 16 <= w; x += 16) {                                           \
+      __m128i lo = _mm_setzero_si128(), hi = lo;                             \
+      for (int j = 0; j <= 2*DY; j++) {                                      \
+        __m128i v = _mm_loadu_si128((const __m128i*)(r + (size_t)j*w + x));  \
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, _mm_setzero_si128()));   \
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, _mm_setzero_si128()));   \
+      }                                                                      \
+      _mm_storeu_si128((__m128i*)(col + x), lo);                             \
+      _mm_storeu_si128((__m128i*)(col + x + 8), hi);                         \
+    }
+// Window sums of 8 pixels per iteration; with k >= 16, the 16-bit high
+// half of sum*m is shifted right by k-16
+#define BLUR_ROW_SSE2(DX)                                                     \
+    for (; x + 8 <= w - DX; x += 8) {                                        \
+      __m128i sum = _mm_set1_epi16((short)(area/2));                         \
+      for (int i = -DX; i <= DX; i++)                                        \
+        sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i*)(col + x + i))); \
+      __m128i q = _mm_srl_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16((short)m)), \
+                                _mm_cvtsi32_si128(k - 16));                  \
+      _mm_storel_epi64((__m128i*)(o + x), _mm_packus_epi16(q, q));           \
+    }
+#else
+#define BLUR_COLS_SSE2(DY)
+#define BLUR_ROW_SSE2(DX)
+#endif
+
+BLUR_KERNEL(1, 1)
+BLUR_KERNEL(2, 2)
+BLUR_KERNEL(3, 3)
+BLUR_KERNEL(1, 0)
+BLUR_KERNEL(0, 1)
+
+typedef void (*BlurKernel)(uint8* d, const uint8* s, int w, int y0, int y1, uint16_t* col);
+
+// Return the specialized kernel for window (dx, dy), or NULL if none.
+static BlurKernel blurKernel(int dx, int dy) {
+  static const struct { int dx, dy; BlurKernel fn; } kernels[] = {
+    { 1, 1, blurKernel1x1 }, { 2, 2, blurKernel2x2 }, { 3, 3, blurKernel3x3 },
+    { 1, 0, blurKernel1x0 }, { 0, 1, blurKernel0x1 },
+  };
+  for (size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+    if (kernels[i].dx == dx && kernels[i].dy == dy) return kernels[i].fn;
   }
-  
-  ImageDestroy(&img_cpy);
+  return NULL;
 }
 
-void ImageBlur_opt(Image img, int dx, int dy) {
-  int window_width = 2*dx+1;
-  int window_height = 2*dy+1;
-  int window_area = window_width*window_height;
-  
-  //Para cada tamanho possível da janela, um fator multiplicativo diferente (está assim para não dividir dentro do ciclo)
-  float fator[window_area];
-  for(int i = 0; i < window_area; fator[i++] = 1.0/(i+1));
-  
-  float valor;
-  unsigned long int* summed_area_table = build_summed_area_table(img);
-  
-  //~ for(int i = 0; i < img->height; i++) {
-	//~ for(int j = 0; j < img->width; j++) {
-		//~ printf("%ld ", summed_area_table[G(img, j, i)]);
-	//~ }
-	//~ printf("\n");
-  //~ }
-  
-  for(int y = 0; y < img->height; y++) {
-	  //Limites da janela
-	  int yt = (y-dy) < 0 ? 0:(y-dy);
-	  int yb = (y+dy) > (img->height-1) ? (img->height-1):(y+dy);
-	  int cw_height = yb-yt+1;
-	  
-	  for(int x = 0; x < img->width; x++) {
-		  //Para cada píxel da imagem
-		  //Limites da janela (interseção da janela (dx x dy) com a imagem)
-		  int xl = (x-dx) < 0 ? 0:(x-dx);
-		  int xr = (x+dx) > (img->width-1) ? (img->width-1):(x+dx);
-		  int cw_width = xr-xl+1;
-		  
-		  //Fator para esta janela (interseção da janela (dx x dy) com a imagem)
-		  int cw_area = cw_width*cw_height;
-		  float cw_fator = fator[cw_area-1];
-		  
-		  //Cálculo da soma dos valores dos píxeis da interseção da janela com a imagem
-		  //Interseção da janela com a imagem toca a margem esquerda ou superior da imagem
-		  if((xl == 0) || (yt == 0)) {
-			  //Interseção da janela com a imagem toca o canto superior esquerdo da imagem
-			  if((xl == 0) && (yt == 0)) {
-				  valor = summed_area_table[G(img, xr, yb)];
-			  }
-			  //Interseção da janela com a imagem toca a margem superior, mas não a esquerda da imagem
-			  else if(xl > 0) {
-				  valor = summed_area_table[G(img, xr, yb)] - summed_area_table[G(img, xl-1, yb)];
-			  }
-			  //Interseção da janela com a imagem toca a margem esquerda, mas não a superior da imagem
-			  else {
-				  valor = summed_area_table[G(img, xr, yb)] - summed_area_table[G(img, xr, yt-1)];
-			  }
-		  }
-		  //Janela não toca a margem esquerda nem superior da imagem
-		  else {
-			  valor = summed_area_table[G(img, xr, yb)] - summed_area_table[G(img, xl-1, yb)] - summed_area_table[G(img, xr, yt-1)] + summed_area_table[G(img, xl-1, yt-1)];
-		  }
-		  
-		  //Média dos valores somados
-		  ImageSetPixel(img, x, y, (uint8)arred(valor*cw_fator));
-		  
-		  //~ printf("(%d, %d):\n %ld\t%ld\n%ld\t%ld\n\n%f -> %d\n\n\n", x, y, summed_area_table[G(img, x-dx-1, y-dy-1)], summed_area_table[G(img, x+dx, y-dy-1)], summed_area_table[G(img, x-dx-1, y+dy)], summed_area_table[G(img, x+dx, y+dy)], valor, (uint8)arred(valor*cw_fator));
-		  //~ printf("(%d, %d):\n%f -> %d\t(fator = %f)\n\n\n", x, y, valor, (uint8)arred(valor*cw_fator), cw_fator);
-		  
-	  }
+// Mean of the window (dx, dy) around (x, y), clipped to the image, by
+// direct summation (for border pixels of the specialized kernels).
+static uint8 blurPixel(const uint8* s, int w, int h, int x, int y, int dx, int dy) {
+  int xl = x - dx < 0 ? 0 : x - dx;
+  int xr = x + dx > w - 1 ? w - 1 : x + dx;
+  int yt = y - dy < 0 ? 0 : y - dy;
+  int yb = y + dy > h - 1 ? h - 1 : y + dy;
+  unsigned sum = 0;
+  for (int j = yt; j <= yb; j++) {
+    for (int i = xl; i <= xr; i++) sum += s[(size_t)j*w + i];
   }
+  unsigned area = (unsigned)(xr - xl + 1)*(yb - yt + 1);
+  return (uint8)((sum + area/2) / area);
+}
 
-  unsigned long int** p = &summed_area_table;
-  free(*p);
-  *p = NULL;
-	
-	
-  //~ long int* table_cache = (long int*)malloc(img->width*img->height*sizeof(long int));
-  //~ for(int i = 0; i < img->height; i++) {
-	  //~ for(int j = 0; j < img->width; j++) {
-		  //~ table_cache[G(img, j, i)] = -1;
-	  //~ }
-  //~ }
-  
-  //~ summed_area(img, table_cache, img->width-1, img->height-1);
-  //~ for(int i = 0; i < img->height; i++) {
-	  //~ for(int j = 0; j < img->width; j++) {
-		  //~ printf("%ld ", table_cache[G(img, j, i)]);
-	  //~ }
-	  //~ printf("\n");
-  //~ }
-  
-  //~ long int** p = &table_cache;
-  //~ free(*p);
-  //~ *p = NULL
-  
+struct blurArgs {
+  uint8* d;             // output pixels (dense, w x h)
+  const uint8* s;       // copy of the input pixels (specialized kernels)
+  const uint64_t* sat;  // summed-area table of the input (generic path)
+  int w, h, dx, dy;
+  BlurKernel fn;        // specialized kernel, or NULL
+};
+
+// Blur rows [y0, y1) (a parallelFor range function).
+static void blurRows(void* arg, int y0, int y1) {
+  struct blurArgs* a = (struct blurArgs*)arg;
+  int w = a->w, h = a->h, dx = a->dx, dy = a->dy;
+  if (a->fn == NULL) {
+    boxRows8(a->d, a->sat, w, h, y0, y1, dx, dy);
+    return;
+  }
+  // Interior rows (with the window inside the image vertically)
+  int i0 = y0 > dy ? y0 : dy;
+  int i1 = y1 < h - dy ? y1 : h - dy;
+  uint16_t* col = (i0 < i1) ? (uint16_t*)malloc((size_t)w*sizeof(uint16_t)) : NULL;
+  if (col != NULL) {
+    a->fn(a->d, a->s, w, i0, i1, col);
+    free(col);
+  } else {
+    i0 = i1 = y0;   // no interior rows, or out of memory: all by hand
+  }
+  for (int y = y0; y < y1; y++) {
+    int interior = (y >= i0 && y < i1);
+    for (int x = 0; x < w; x++) {
+      if (interior && x == dx && dx < w - dx) x = w - dx;  // skip the interior
+      if (x < w) a->d[(size_t)y*w + x] = blurPixel(a->s, w, h, x, y, dx, dy);
+    }
+  }
+}
+
+// Blur img in-place, as in ImageBlur.  Returns 0 on failure (out of
+// memory), leaving img unchanged.
+static int blur(Image img, int dx, int dy) {
+  int w = img->width;
+  int h = img->height;
+  // Tiled images are blurred in a dense copy, then pasted back
+  Image work = (img->tiles == NULL) ? img : ImageCrop(img, 0, 0, w, h);
+  Image copy = NULL;
+  struct blurArgs a = { NULL, NULL, NULL, w, h, dx, dy, blurKernel(dx, dy) };
+  uint64_t* sat = NULL;
+  int success = work != NULL;
+  if (success && a.fn != NULL) {
+    success = (copy = ImageCrop(work, 0, 0, w, h)) != NULL;
+    a.s = success ? copy->pixel : NULL;
+  } else if (success) {
+    success = check( (sat = (uint64_t*)malloc((size_t)w*h*sizeof(uint64_t) + 1)) != NULL,
+                     "Allocating summed-area table" );
+    for (int y = 0; success && y < h; y++) satRow8(sat, work->pixel, w, y);
+    a.sat = sat;
+  }
+  if (success) {
+    a.d = work->pixel;
+    parallelFor(h, 16, blurRows, &a);
+    PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses
+    if (work != img) ImagePaste(img, 0, 0, work);
+  }
+  free(sat);
+  ImageDestroy(&copy);
+  if (work != img) ImageDestroy(&work);
+  return success;
 }
 
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), rounded to nearest.
+/// The image is changed in-place.
+/// Common small windows (3x3, 5x5, 7x7, 3x1 and 1x3) use kernels
+/// specialized for their size; others use a summed-area table.
+/// Rows are blurred in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
 void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  //~ ImageBlur_naive_sem_borda(img, dx, dy);
-  ImageBlur_opt(img, dx, dy);
-  
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  imageChanged(img);
+  blur(img, dx, dy);
+}
+
+/// Bring up to date a blurred copy of an image, after changes to a part
+/// of it.  dst must hold img blurred as by ImageBlur(dx, dy) when the dirty
+/// rectangle of img was last cleared (see ImageDirtyRect); for instance, a
+/// new black image, as all pixels of a new img are dirty.
+/// Only the pixels of dst whose windows meet the dirty rectangle are
+/// recomputed, from the dirty rectangle dilated by (2dx, 2dy): the cost
+/// depends on the size of the changes, not of the image.
+/// On success, the dirty rectangle of img is cleared.
+/// Requires: dst has the size of img, and is not img.
+/// On failure (out of memory), dst and img are left unchanged and errCause is set.
+void ImageBlurDirty(Image img, Image dst, int dx, int dy) { ///
+  assert (img != NULL && dst != NULL);
+  assert (img != dst);
+  assert (img->width == dst->width && img->height == dst->height);
+  assert (dx >= 0 && dy >= 0);
+  int x, y, w, h;
+  if (!ImageDirtyRect(img, &x, &y, &w, &h)) return;
+  // The pixels to recompute: the dirty rectangle dilated by (dx, dy),
+  // clipped to the image, and the input they need, dilated by (2dx, 2dy)
+  int ox0 = (x - dx > 0) ? x - dx : 0;
+  int oy0 = (y - dy > 0) ? y - dy : 0;
+  int ox1 = (x + w + dx < img->width) ? x + w + dx : img->width;
+  int oy1 = (y + h + dy < img->height) ? y + h + dy : img->height;
+  int ix0 = (ox0 - dx > 0) ? ox0 - dx : 0;
+  int iy0 = (oy0 - dy > 0) ? oy0 - dy : 0;
+  int ix1 = (ox1 + dx < img->width) ? ox1 + dx : img->width;
+  int iy1 = (oy1 + dy < img->height) ? oy1 + dy : img->height;
+  // Windows clipped to the input rectangle are clipped to the image, for
+  // the pixels to recompute: blurring it alone gives the same means
+  Image part = ImageCrop(img, ix0, iy0, ix1 - ix0, iy1 - iy0);
+  if (part == NULL) return;
+  if (blur(part, dx, dy)) {
+    markDirty(dst, ox0, oy0, ox1 - ox0, oy1 - oy0);
+    if (dst->hist != NULL) {
+      histRect(dst->hist, dst, ox0, oy0, ox1 - ox0, oy1 - oy0, -1);
+      histRect(dst->hist, part, ox0 - ix0, oy0 - iy0, ox1 - ox0, oy1 - oy0, 1);
+    }
+    copyRect(dst, ox0, oy0, part, ox0 - ix0, oy0 - iy0, ox1 - ox0, oy1 - oy0);
+    ImageClearDirty(img);
+  }
+  ImageDestroy(&part);
+}
+
+
+/// Morphology
+
+// Erosion and dilation with a (2dx+1)x(2dy+1) rectangle are separable:
+// a running minimum (or maximum) along rows, then along columns.  Each
+// pass uses the van Herk/Gil-Werman algorithm: the line, padded with d
+// identity values (255 for min, 0 for max) on each end, so that windows
+// are clipped to the image, is cut into blocks of k = 2d+1 values; g holds
+// the prefix extrema of each block, and h the suffix extrema.  The window
+// [i, i+2d] always spans one block boundary, so its extremum is
+// OP(h[i], g[i+2d]): three comparisons per value, whatever the window size.
+// The column pass works on strips of MORPHSTRIP columns (strips in
+// parallel), where each step combines whole rows, 16 pixels at a time with
+// SSE2.  The row pass works on groups of 16 rows (groups in parallel),
+// transposed so that each vector holds one column of the group, and then
+// proceeds like the column pass.
+
+#define MORPHSTRIP 256
+
+// Combine rows of n pixels: d[i] = OP(a[i], b[i])
+typedef void (*RowOp)(uint8* d, const uint8* a, const uint8* b, int n);
+
+#define MORPH_KERNELS(NAME, OP, SSEOP, ID)                                    \
+static void NAME##Rows(uint8* d, const uint8* a, const uint8* b, int n) {     \
+  int i = 0;                                                                 \
+  MORPH_SSE2(SSEOP)                                                          \
+  for (; i < n; i++) d[i] = OP(a[i], b[i]);                                  \
+}                                                                            \
+/* Running extremum of n pixels of line p (in place), with radius r. */     \
+/* buf has room for 3*(n+2r) pixels. */                                      \
+static void NAME##Line(uint8* p, int n, int r, uint8* buf) {                 \
+  int k = 2*r + 1, len = n + 2*r;                                            \
+  uint8* q = buf;                                                            \
+  uint8* g = buf + len;                                                      \
+  uint8* h = buf + 2*len;                                                    \
+  memset(q, ID, r);                                                          \
+  memcpy(q + r, p, n);                                                       \
+  memset(q + r + n, ID, r);                                                  \
+  for (int b = 0; b < len; b += k) {                                         \
+    int e = (b + k < len) ? b + k : len;                                     \
+    g[b] = q[b];                                                             \
+    for (int i = b + 1; i < e; i++) g[i] = OP(g[i-1], q[i]);                 \
+    h[e-1] = q[e-1];                                                         \
+    for (int i = e - 2; i >= b; i--) h[i] = OP(h[i+1], q[i]);                \
+  }                                                                          \
+  for (int x = 0; x < n; x++) p[x] = OP(h[x], g[x + 2*r]);                   \
+}                                                                            \
+MORPH_LINES16(NAME, SSEOP, ID)
+
+#define MIN8(a, b) ((a) < (b) ? (a) : (b))
+#define MAX8(a, b) ((a) > (b) ? (a) : (b))
+#ifdef __SSE2__
+#define MORPH_SSE2(SSEOP)                                                     \
+  for (; i + 16 <= n; i += 16) {                                             \
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));                   \
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));                   \
+    _mm_storeu_si128((__m128i*)(d + i), SSEOP(va, vb));                      \
+  }
+
+// Transpose a 16x16 block of pixels from s (row stride ss) to d (row
+// stride ds): four rounds of interleaving rows i and i+8.
+static inline void transpose16(const uint8* s, size_t ss, uint8* d, size_t ds) {
+  __m128i x[16], y[16];
+  for (int i = 0; i < 16; i++) x[i] = _mm_loadu_si128((const __m128i*)(s + i*ss));
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < 8; i++) {
+      y[2*i] = _mm_unpacklo_epi8(x[i], x[i+8]);
+      y[2*i+1] = _mm_unpackhi_epi8(x[i], x[i+8]);
+    }
+    memcpy(x, y, sizeof(x));
+  }
+  for (int i = 0; i < 16; i++) _mm_storeu_si128((__m128i*)(d + i*ds), x[i]);
+}
+
+// Running extremum of 16 rows of n pixels at p (row stride w), in place,
+// with radius r.  buf has room for 48*(n+2r) pixels: the padded, transposed
+// rows q, and g and h, with one 16-pixel vector per column.
+#define MORPH_LINES16(NAME, SSEOP, ID)                                        \
+static void NAME##Lines16(uint8* p, int w, int n, int r, uint8* buf) {       \
+  int k = 2*r + 1, len = n + 2*r;                                            \
+  uint8* q = buf;                                                            \
+  uint8* g = buf + 16*(size_t)len;                                           \
+  uint8* h = buf + 32*(size_t)len;                                           \
+  memset(q, ID, 16*(size_t)r);                                               \
+  memset(q + 16*(size_t)(r + n), ID, 16*(size_t)r);                          \
+  int x = 0;                                                                 \
+  for (; x + 16 <= n; x += 16) transpose16(p + x, w, q + 16*(size_t)(r + x), 16); \
+  for (; x < n; x++)                                                         \
+    for (int j = 0; j < 16; j++) q[16*(size_t)(r + x) + j] = p[(size_t)j*w + x]; \
+  for (int b = 0; b < len; b += k) {                                         \
+    int e = (b + k < len) ? b + k : len;                                     \
+    __m128i v = MORPH_LD(q, b);                                              \
+    MORPH_ST(g, b, v);                                                       \
+    for (int i = b + 1; i < e; i++) {                                        \
+      v = SSEOP(v, MORPH_LD(q, i));                                          \
+      MORPH_ST(g, i, v);                                                     \
+    }                                                                        \
+    v = MORPH_LD(q, e-1);                                                    \
+    MORPH_ST(h, e-1, v);                                                     \
+    for (int i = e - 2; i >= b; i--) {                                       \
+      v = SSEOP(v, MORPH_LD(q, i));                                          \
+      MORPH_ST(h, i, v);                                                     \
+    }                                                                        \
+  }                                                                          \
+  for (x = 0; x < n; x++) MORPH_ST(q, x, SSEOP(MORPH_LD(h, x), MORPH_LD(g, x + 2*r))); \
+  for (x = 0; x + 16 <= n; x += 16) transpose16(q + 16*(size_t)x, 16, p + x, w); \
+  for (; x < n; x++)                                                         \
+    for (int j = 0; j < 16; j++) p[(size_t)j*w + x] = q[16*(size_t)x + j];  \
+}
+#define MORPH_LD(a, i) _mm_loadu_si128((const __m128i*)((a) + 16*(size_t)(i)))
+#define MORPH_ST(a, i, v) _mm_storeu_si128((__m128i*)((a) + 16*(size_t)(i)), (v))
+#else
+#define MORPH_SSE2(SSEOP)
+#define MORPH_LINES16(NAME, SSEOP, ID)
+#endif
+
+MORPH_KERNELS(min, MIN8, _mm_min_epu8, 255)
+MORPH_KERNELS(max, MAX8, _mm_max_epu8, 0)
+
+struct morphArgs {
+  uint8* pixel;         // dense w x h pixels, transformed in place
+  int w, h, r;          // r: radius of the current pass
+  int max;              // dilation (running max) rather than erosion
+  int failed;           // out of memory in some range (under lock)
+  pthread_mutex_t lock;
+};
+
+// Row pass over rows [y0, y1) (a parallelFor range function).
+static void morphRows(void* arg, int y0, int y1) {
+  struct morphArgs* a = (struct morphArgs*)arg;
+  uint8* buf = (uint8*)malloc(48*((size_t)a->w + 2*a->r));
+  if (buf == NULL) {
+    pthread_mutex_lock(&a->lock);
+    a->failed = 1;
+    pthread_mutex_unlock(&a->lock);
+    return;
+  }
+  int y = y0;
+#ifdef __SSE2__
+  for (; y + 16 <= y1; y += 16) {
+    uint8* rows = a->pixel + (size_t)y*a->w;
+    if (a->max) maxLines16(rows, a->w, a->w, a->r, buf); else minLines16(rows, a->w, a->w, a->r, buf);
+  }
+#endif
+  for (; y < y1; y++) {
+    uint8* row = a->pixel + (size_t)y*a->w;
+    if (a->max) maxLine(row, a->w, a->r, buf); else minLine(row, a->w, a->r, buf);
+  }
+  free(buf);
 }
 
+// Column pass over strips [s0, s1) of MORPHSTRIP columns (a parallelFor
+// range function).  The lines are the columns, and the values are rows of
+// the strip, so g and h hold whole rows, combined with RowOp.
+static void morphCols(void* arg, int s0, int s1) {
+  struct morphArgs* a = (struct morphArgs*)arg;
+  int w = a->w, h = a->h, r = a->r, k = 2*r + 1, len = h + 2*r;
+  RowOp op = a->max ? maxRows : minRows;
+  uint8* g = (uint8*)malloc(2*(size_t)len*MORPHSTRIP + MORPHSTRIP);
+  if (g == NULL) {
+    pthread_mutex_lock(&a->lock);
+    a->failed = 1;
+    pthread_mutex_unlock(&a->lock);
+    return;
+  }
+  uint8* hh = g + (size_t)len*MORPHSTRIP;
+  uint8* pad = hh + (size_t)len*MORPHSTRIP;
+  memset(pad, a->max ? 0 : 255, MORPHSTRIP);
+  for (int s = s0; s < s1; s++) {
+    int x0 = s*MORPHSTRIP;
+    int n = (w - x0 < MORPHSTRIP) ? w - x0 : MORPHSTRIP;
+    // Padded row i of the strip
+    #define ROW(i) (((i) < r || (i) >= r + h) ? pad : a->pixel + (size_t)((i) - r)*w + x0)
+    for (int b = 0; b < len; b += k) {
+      int e = (b + k < len) ? b + k : len;
+      memcpy(g + (size_t)b*MORPHSTRIP, ROW(b), n);
+      for (int i = b + 1; i < e; i++) {
+        uint8* gi = g + (size_t)i*MORPHSTRIP;
+        op(gi, gi - MORPHSTRIP, ROW(i), n);
+      }
+      memcpy(hh + (size_t)(e-1)*MORPHSTRIP, ROW(e-1), n);
+      for (int i = e - 2; i >= b; i--) {
+        uint8* hi = hh + (size_t)i*MORPHSTRIP;
+        op(hi, hi + MORPHSTRIP, ROW(i), n);
+      }
+    }
+    #undef ROW
+    for (int y = 0; y < h; y++) {
+      op(a->pixel + (size_t)y*w + x0, hh + (size_t)y*MORPHSTRIP, g + (size_t)(y + 2*r)*MORPHSTRIP, n);
+    }
+  }
+  free(g);
+}
+
+// Erode (max == 0) or dilate (max == 1) img in place with a
+// (2dx+1)x(2dy+1) rectangle.  Returns 0 on failure (out of memory),
+// leaving img unchanged.
+static int morph(Image img, int dx, int dy, int max) {
+  int w = img->width;
+  int h = img->height;
+  imageChanged(img);
+  // Work on a dense copy, that replaces the pixels on success
+  Image work = ImageCrop(img, 0, 0, w, h);
+  if (work == NULL) return 0;
+  struct morphArgs a = { work->pixel, w, h, 0, max, 0, PTHREAD_MUTEX_INITIALIZER };
+  if (dx > 0) {
+    a.r = dx;
+    parallelFor(h, 16, morphRows, &a);
+  }
+  if (dy > 0 && !a.failed) {
+    a.r = dy;
+    parallelFor((w + MORPHSTRIP - 1) / MORPHSTRIP, 1, morphCols, &a);
+  }
+  int success = check( !a.failed, "Allocating morphology buffers" );
+  if (success) {
+    PIXMEM += 2*(unsigned long)w*h*((dx > 0) + (dy > 0));  // count pixel memory accesses
+    if (img->tiles == NULL) {
+      swapPixels(img, work);
+    } else {
+      ImagePaste(img, 0, 0, work);
+    }
+  }
+  ImageDestroy(&work);
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+/// The cost per pixel does not depend on the rectangle size
+/// (van Herk/Gil-Werman algorithm), and rows are processed in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageErode(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 0);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), as in ImageErode.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageDilate(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 1);
+}
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle: erode, then dilate.
+/// This removes bright details smaller than the rectangle.
+/// On failure (out of memory), errCause is set, and the image is left
+/// unchanged or eroded.
+void ImageOpening(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (morph(img, dx, dy, 0)) morph(img, dx, dy, 1);
+}
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle: dilate, then erode.
+/// This removes dark details smaller than the rectangle.
+/// On failure (out of memory), errCause is set, and the image is left
+/// unchanged or dilated.
+void ImageClosing(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (morph(img, dx, dy, 1)) morph(img, dx, dy, 0);
+}
+
+/// Rank filters
+
+// Median and other rank filters use the constant-time algorithm of
+// Perreault and Hebert: a histogram per image column holds the pixels of
+// that column in the current window rows, and the window histogram is kept
+// by adding the column histogram that enters the window and subtracting
+// the one that leaves it, as the window slides along a row.  When moving
+// down a row, each column histogram gains one pixel and loses one.
+// Histograms have RANKBINS 16-bit bins, plus RANKBINS/16 coarse bins (of 16
+// levels each), so that finding the rank takes at most 32 steps.  Only the
+// coarse bins of the window histogram are slid at every pixel; the 16 fine
+// bins of a coarse bin are brought up to date when the rank falls in it,
+// from the column where they were last updated (or from scratch, if too
+// far behind).
+// The image is split in vertical stripes of RANKSTRIP columns, filtered in
+// parallel, each with its own column histograms.
+
+#define RANKBINS 256
+#define RANKCOARSE (RANKBINS/16)
+#define RANKSTRIP 256
+#define RANKHIST (RANKBINS + RANKCOARSE)  // fine bins, then coarse bins
+
+// A group of 16 bins (the coarse bins, or the fine bins of one coarse bin)
+// of the window histogram, kept in two SSE2 registers where available, so
+// that sliding the window does not go through memory at every pixel.
+#ifdef __SSE2__
+typedef struct { __m128i lo, hi; } Bins16;
+
+static inline Bins16 bins16Load(const uint16_t* p) {
+  Bins16 k = { _mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 8)) };
+  return k;
+}
+
+static inline void bins16Store(uint16_t* p, Bins16 k) {
+  _mm_storeu_si128((__m128i*)p, k.lo);
+  _mm_storeu_si128((__m128i*)(p + 8), k.hi);
+}
+
+// k + c (add = 1) or k - c (add = 0)
+static inline Bins16 bins16Update(Bins16 k, const uint16_t* c, int add) {
+  Bins16 v = bins16Load(c);
+  if (add) {
+    k.lo = _mm_add_epi16(k.lo, v.lo);
+    k.hi = _mm_add_epi16(k.hi, v.hi);
+  } else {
+    k.lo = _mm_sub_epi16(k.lo, v.lo);
+    k.hi = _mm_sub_epi16(k.hi, v.hi);
+  }
+  return k;
+}
+
+// Return the index b of the bin of rank *r (from 0), that is, the first b
+// with k[0] + ... + k[b] > *r, and subtract the counts of the bins before
+// it from *r.  Requires: *r < the sum of all bins.
+// The prefix sums are compared with *r all at once, without branches.
+static inline int bins16Rank(Bins16 k, int* r) {
+  __m128i v0 = k.lo, v1 = k.hi;
+  v0 = _mm_add_epi16(v0, _mm_slli_si128(v0, 2));
+  v1 = _mm_add_epi16(v1, _mm_slli_si128(v1, 2));
+  v0 = _mm_add_epi16(v0, _mm_slli_si128(v0, 4));
+  v1 = _mm_add_epi16(v1, _mm_slli_si128(v1, 4));
+  v0 = _mm_add_epi16(v0, _mm_slli_si128(v0, 8));
+  v1 = _mm_add_epi16(v1, _mm_slli_si128(v1, 8));
+  v1 = _mm_add_epi16(v1, _mm_shuffle_epi32(_mm_shufflehi_epi16(v0, 0xFF), 0xFF));
+  // Prefix sums <= *r (saturating subtraction gives 0); as the prefix sums
+  // do not decrease, these are the lowest bits of the mask
+  __m128i rv = _mm_set1_epi16((short)*r);
+  __m128i z = _mm_setzero_si128();
+  __m128i le = _mm_packs_epi16(_mm_cmpeq_epi16(_mm_subs_epu16(v0, rv), z),
+                               _mm_cmpeq_epi16(_mm_subs_epu16(v1, rv), z));
+  int b = __builtin_ctz(~_mm_movemask_epi8(le));
+  if (b > 0) {
+    uint16_t sums[16];
+    _mm_storeu_si128((__m128i*)sums, v0);
+    _mm_storeu_si128((__m128i*)(sums + 8), v1);
+    *r -= sums[b-1];
+  }
+  return b;
+}
+#else
+typedef struct { uint16_t v[16]; } Bins16;
+
+static inline Bins16 bins16Load(const uint16_t* p) {
+  Bins16 k;
+  memcpy(k.v, p, sizeof(k.v));
+  return k;
+}
+
+static inline void bins16Store(uint16_t* p, Bins16 k) {
+  memcpy(p, k.v, sizeof(k.v));
+}
+
+static inline Bins16 bins16Update(Bins16 k, const uint16_t* c, int add) {
+  for (int i = 0; i < 16; i++) k.v[i] = (uint16_t)(add ? k.v[i] + c[i] : k.v[i] - c[i]);
+  return k;
+}
+
+static inline int bins16Rank(Bins16 k, int* r) {
+  int b = 0;
+  while (*r >= k.v[b]) *r -= k.v[b++];
+  return b;
+}
+#endif
+
+struct rankArgs {
+  const uint8* src;     // dense w x h input pixels
+  uint8* dst;           // dense w x h output pixels
+  int w, h, dx, dy;
+  int percent;
+  int failed;           // out of memory in some stripe (under lock)
+  pthread_mutex_t lock;
+};
+
+// Filter the stripes [s0, s1) (a parallelFor range function).
+static void rankStripes(void* arg, int s0, int s1) {
+  struct rankArgs* a = (struct rankArgs*)arg;
+  int w = a->w, h = a->h, dx = a->dx, dy = a->dy;
+  // Column histograms for the widest stripe, and the window histogram
+  uint16_t* hist = (uint16_t*)malloc(((size_t)RANKSTRIP + 2*dx + 1)*RANKHIST*sizeof(uint16_t));
+  if (hist == NULL) {
+    pthread_mutex_lock(&a->lock);
+    a->failed = 1;
+    pthread_mutex_unlock(&a->lock);
+    return;
+  }
+  for (int s = s0; s < s1; s++) {
+    int x0 = s*RANKSTRIP;
+    int x1 = (x0 + RANKSTRIP < w) ? x0 + RANKSTRIP : w;
+    // Columns [c0, c1) may enter the windows of this stripe
+    int c0 = (x0 - dx < 0) ? 0 : x0 - dx;
+    int c1 = (x1 + dx > w) ? w : x1 + dx;
+    uint16_t* win = hist + (size_t)(c1 - c0)*RANKHIST;
+    #define COL(c) (hist + (size_t)((c) - c0)*RANKHIST)
+    memset(hist, 0, (size_t)(c1 - c0)*RANKHIST*sizeof(uint16_t));
+    for (int y = -dy; y < h; y++) {
+      // Slide the column histograms down to rows [y-dy, y+dy]
+      if (y + dy < h) {
+        const uint8* row = a->src + (size_t)(y + dy)*w;
+        for (int c = c0; c < c1; c++) {
+          COL(c)[row[c]]++;
+          COL(c)[RANKBINS + (row[c] >> 4)]++;
+        }
+      }
+      if (y - dy - 1 >= 0) {
+        const uint8* row = a->src + (size_t)(y - dy - 1)*w;
+        for (int c = c0; c < c1; c++) {
+          COL(c)[row[c]]--;
+          COL(c)[RANKBINS + (row[c] >> 4)]--;
+        }
+      }
+      if (y < 0) continue;
+      int rows = ((y + dy < h) ? y + dy : h - 1) - ((y - dy < 0) ? 0 : y - dy) + 1;
+      // The coarse window histogram of (x0, y), then slide along the row
+      static const uint16_t zero[16];
+      Bins16 coarse = bins16Load(zero);
+      int last[RANKCOARSE];     // column where the fine bins were updated
+      for (int c = c0; c <= x0 + dx && c < w; c++) coarse = bins16Update(coarse, COL(c) + RANKBINS, 1);
+      for (int i = 0; i < RANKCOARSE; i++) last[i] = INT_MIN;
+      uint8* out = a->dst + (size_t)y*w;
+      for (int x = x0; x < x1; x++) {
+        if (x > x0) {
+          if (x + dx < w) coarse = bins16Update(coarse, COL(x + dx) + RANKBINS, 1);
+          if (x - dx - 1 >= 0) coarse = bins16Update(coarse, COL(x - dx - 1) + RANKBINS, 0);
+        }
+        int xl = (x - dx < 0) ? 0 : x - dx;
+        int xr = (x + dx < w) ? x + dx : w - 1;
+        // Find the level of rank r (from 0): coarse bins, then fine ones
+        int r = (int)((long)a->percent*(rows*(xr - xl + 1) - 1) / 100);
+        int b = bins16Rank(coarse, &r);
+        Bins16 fine;
+        if (last[b] == INT_MIN || x - last[b] > 2*dx) {
+          fine = bins16Load(zero);
+          for (int c = xl; c <= xr; c++) fine = bins16Update(fine, COL(c) + 16*b, 1);
+        } else {
+          fine = bins16Load(win + 16*b);
+          for (int p = last[b] + 1; p <= x; p++) {
+            if (p + dx < w) fine = bins16Update(fine, COL(p + dx) + 16*b, 1);
+            if (p - dx - 1 >= 0) fine = bins16Update(fine, COL(p - dx - 1) + 16*b, 0);
+          }
+        }
+        bins16Store(win + 16*b, fine);
+        last[b] = x;
+        out[x] = (uint8)(16*b + bins16Rank(fine, &r));
+      }
+    }
+    #undef COL
+  }
+  free(hist);
+}
+
+/// Apply a rank filter to an image.
+/// Each pixel is substituted by the percentile of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), that is,
+/// the level of rank (percent*(n-1))/100 (rounded down), from 0, among the
+/// n pixels in increasing order: percent 0 gives the minimum (as
+/// ImageErode), 50 the median, and 100 the maximum (as ImageDilate).
+/// Requires: 0 <= percent <= 100, and (2dx+1)*(2dy+1) <= 65535.
+/// The image is changed in-place.
+/// The cost per pixel grows slowly with the rectangle size (histograms
+/// are slid along rows and columns), and stripes are filtered in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageRankFilter(Image img, int dx, int dy, int percent) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  assert (0 <= percent && percent <= 100);
+  assert ((long)(2*dx + 1)*(2*dy + 1) <= 65535);
+  int w = img->width;
+  int h = img->height;
+  imageChanged(img);
+  // Filter into a new image, that replaces the pixels on success
+  Image src = (img->tiles == NULL) ? img : ImageCrop(img, 0, 0, w, h);
+  Image dst = (src != NULL) ? ImageCreate(w, h, img->maxval) : NULL;
+  if (dst == NULL) {
+    if (src != img) ImageDestroy(&src);
+    return;
+  }
+  struct rankArgs a = { src->pixel, dst->pixel, w, h, dx, dy, percent, 0, PTHREAD_MUTEX_INITIALIZER };
+  parallelFor((w + RANKSTRIP - 1) / RANKSTRIP, 1, rankStripes, &a);
+  if (check( !a.failed, "Allocating histograms" )) {
+    PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses
+    if (img->tiles == NULL) {
+      swapPixels(img, dst);
+    } else {
+      ImagePaste(img, 0, 0, dst);
+    }
+  }
+  ImageDestroy(&dst);
+  if (src != img) ImageDestroy(&src);
+}
+
+/// Apply a median filter to an image: ImageRankFilter with percent 50.
+/// (For an even number of pixels in the rectangle, the lower median.)
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageMedian(Image img, int dx, int dy) { ///
+  ImageRankFilter(img, dx, dy, 50);
+}
+
+/// Connected components
+
+// Components are found on runs: maximal horizontal sequences of foreground
+// (non-zero) pixels in a row.  The runs of all rows are listed, in two
+// passes (count, then store), and runs that touch runs in the row above are
+// joined in a union-find forest over run indices, with path halving.
+// Roots are always linked to the smaller root, so parent[i] <= i and the
+// root of a component is its first run in raster order.
+// Stripes of CCSTRIP rows are listed and joined in parallel (each only
+// touches its own runs); then the runs across stripe boundaries are joined.
+
+#define CCSTRIP 64
+
+struct ccRun {
+  int x0, x1;           // columns [x0, x1)
+};
+
+struct ccArgs {
+  const uint8* pix;     // dense w x h pixels
+  int w, h;
+  int diag;             // 1 for 8-connectivity, 0 for 4-connectivity
+  int* rowStart;        // the runs of row y are [rowStart[y], rowStart[y+1])
+  struct ccRun* run;
+  int* parent;          // union-find forest over runs
+};
+
+// Index of the first foreground (fg = 1) or background (fg = 0) pixel in
+// p[x, w), or w if there is none.
+static inline int ccScan(const uint8* p, int x, int w, int fg) {
+#ifdef __SSE2__
+  const __m128i z = _mm_setzero_si128();
+  for (; x + 16 <= w; x += 16) {
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + x)), z));
+    if (fg) m = ~m & 0xFFFF;
+    if (m != 0) return x + __builtin_ctz(m);
+  }
+#endif
+  while (x < w && (p[x] != 0) != fg) x++;
+  return x;
+}
+
+// Store the runs of row p (of width w) in run, unless it is NULL.
+// Returns the number of runs.
+static int ccRowRuns(const uint8* p, int w, struct ccRun* run) {
+  int n = 0;
+  int x = ccScan(p, 0, w, 1);
+  while (x < w) {
+    int e = ccScan(p, x, w, 0);
+    if (run != NULL) {
+      run[n].x0 = x;
+      run[n].x1 = e;
+    }
+    n++;
+    x = ccScan(p, e, w, 1);
+  }
+  return n;
+}
+
+static int ccFind(int* parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void ccUnion(int* parent, int i, int j) {
+  i = ccFind(parent, i);
+  j = ccFind(parent, j);
+  if (i < j) parent[j] = i;
+  else if (j < i) parent[i] = j;
+}
+
+// Join the runs of row y with the runs they touch in row y-1.
+static void ccJoinRows(struct ccArgs* a, int y) {
+  int i = a->rowStart[y-1], ie = a->rowStart[y];
+  int j = a->rowStart[y], je = a->rowStart[y+1];
+  while (i < ie && j < je) {
+    const struct ccRun* r = &a->run[i];
+    const struct ccRun* s = &a->run[j];
+    if (r->x0 < s->x1 + a->diag && s->x0 < r->x1 + a->diag) ccUnion(a->parent, i, j);
+    // The run that ends first cannot touch the next runs of the other row
+    if (r->x1 < s->x1) i++; else j++;
+  }
+}
+
+// Count the runs of rows [begin, end) (a parallelFor range function).
+static void ccCountRows(void* arg, int begin, int end) {
+  struct ccArgs* a = (struct ccArgs*)arg;
+  for (int y = begin; y < end; y++)
+    a->rowStart[y+1] = ccRowRuns(a->pix + (size_t)y*a->w, a->w, NULL);
+}
+
+// List and join the runs of stripes [s0, s1) (a parallelFor range function).
+static void ccJoinStripes(void* arg, int s0, int s1) {
+  struct ccArgs* a = (struct ccArgs*)arg;
+  for (int y = s0*CCSTRIP; y < s1*CCSTRIP && y < a->h; y++) {
+    ccRowRuns(a->pix + (size_t)y*a->w, a->w, a->run + a->rowStart[y]);
+    for (int i = a->rowStart[y]; i < a->rowStart[y+1]; i++) a->parent[i] = i;
+    if (y % CCSTRIP != 0) ccJoinRows(a, y);
+  }
+}
+
+// List and join the runs of a->pix, allocating a->rowStart, a->run and
+// a->parent.  Returns the number of runs, or -1 on failure (with errCause
+// set); the arrays allocated so far are left for the caller to free.
+static int ccLabel(struct ccArgs* a) {
+  int h = a->h;
+  a->rowStart = (int*)malloc(((size_t)h + 1)*sizeof(int));
+  if (!check( a->rowStart != NULL, "Allocating runs" )) return -1;
+  a->rowStart[0] = 0;
+  parallelFor(h, CCSTRIP, ccCountRows, a);
+  long total = 0;
+  for (int y = 0; y < h; y++) {
+    total += a->rowStart[y+1];
+    if (!check( total <= INT_MAX, "Too many runs" )) return -1;
+    a->rowStart[y+1] = (int)total;
+  }
+  a->run = (struct ccRun*)malloc((total > 0 ? total : 1)*sizeof(struct ccRun));
+  a->parent = (int*)malloc((total > 0 ? total : 1)*sizeof(int));
+  if (!check( a->run != NULL && a->parent != NULL, "Allocating runs" )) return -1;
+  parallelFor((h + CCSTRIP - 1) / CCSTRIP, 1, ccJoinStripes, a);
+  for (int y = CCSTRIP; y < h; y += CCSTRIP) ccJoinRows(a, y);
+  return (int)total;
+}
+
+// Add up the runs of each component into a new array of blobs, *blobs.
+// Returns the number of blobs, or -1 on failure (out of memory).
+static int ccCollect(struct ccArgs* a, int nruns, ImageBlob** blobs) {
+  // Point every run to its root, and count the roots
+  int nroots = 0;
+  for (int i = 0; i < nruns; i++) {
+    a->parent[i] = a->parent[a->parent[i]];
+    nroots += (a->parent[i] == i);
+  }
+  ImageBlob* b = (ImageBlob*)malloc((nroots > 0 ? nroots : 1)*sizeof(ImageBlob));
+  if (!check( b != NULL, "Allocating blobs" )) return -1;
+  // Number the roots in order (stored as -1-label in parent)
+  int n = 0;
+  for (int y = 0; y < a->h; y++) {
+    for (int i = a->rowStart[y]; i < a->rowStart[y+1]; i++) {
+      int x0 = a->run[i].x0, x1 = a->run[i].x1;
+      int r = a->parent[i];
+      ImageBlob* c;
+      if (r == i) {
+        a->parent[i] = -1 - n;
+        c = &b[n++];
+        c->area = 0;
+        c->x = x0;  c->w = x1;    // w and h hold the right and bottom ends, here
+        c->y = y;   c->h = y + 1;
+        c->cx = c->cy = 0.0;
+      } else {
+        c = &b[-1 - a->parent[r]];
+        if (x0 < c->x) c->x = x0;
+        if (x1 > c->w) c->w = x1;
+        c->h = y + 1;
+      }
+      c->area += x1 - x0;
+      c->cx += 0.5*(x0 + x1 - 1)*(x1 - x0);
+      c->cy += (double)y*(x1 - x0);
+    }
+  }
+  for (int k = 0; k < n; k++) {
+    b[k].w -= b[k].x;
+    b[k].h -= b[k].y;
+    b[k].cx /= b[k].area;
+    b[k].cy /= b[k].area;
+  }
+  *blobs = b;
+  return n;
+}
+
+/// Find the connected components (blobs) of the foreground of an image:
+/// the pixels with a non-zero level, as left by ImageThreshold.
+/// connectivity is 4 (pixels touch their horizontal and vertical neighbors)
+/// or 8 (diagonal neighbors too).
+/// The area, bounding box and centroid of each blob are stored in a new
+/// array, pointed to by *blobs, in the raster order of their first pixels.
+/// (The caller is responsible for freeing the array!)
+/// Rows are scanned and labeled in parallel.
+/// On success, returns the number of blobs (possibly 0).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageBlobs(Image img, int connectivity, ImageBlob** blobs) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  assert (blobs != NULL);
+  int w = img->width;
+  int h = img->height;
+  Image src = (img->tiles == NULL) ? img : ImageCrop(img, 0, 0, w, h);
+  if (src == NULL) return -1;
+  struct ccArgs a = { src->pixel, w, h, connectivity == 8, NULL, NULL, NULL };
+  int nruns = ccLabel(&a);
+  int n = (nruns >= 0) ? ccCollect(&a, nruns, blobs) : -1;
+  PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses (2 passes)
+  free(a.parent);
+  free(a.run);
+  free(a.rowStart);
+  if (src != img) ImageDestroy(&src);
+  return n;
+}
+
+/// Resampling
+
+// Fixed-point precision of the bilinear weights (weights sum to 1<<RSBITS)
+#define RSBITS 7
+#define RSONE (1 << RSBITS)
+
+// Arguments for the resize kernels
+struct resizeArgs {
+  Image src;             // dense source image
+  Image dst;
+  int* xofs;             // first source column for each destination column
+  int* xw;               // weight of column xofs+1 (bilinear), or end column (area)
+  int* yofs;             // same, for rows
+  int* yw;
+  unsigned long* sat;    // summed-area table of src (area mode)
+  int16_t* hrows;        // horizontally interpolated src rows (bilinear mode)
+  char* used;            // which src rows are used (bilinear mode)
+};
+
+// Nearest: each destination pixel copies the source pixel whose center is
+// nearest to its own.
+static void resizeNearestRows(void* arg, int begin, int end) {
+  struct resizeArgs* a = (struct resizeArgs*)arg;
+  int w = a->dst->width;
+  for (int y = begin; y < end; y++) {
+    const uint8* s = a->src->pixel + (size_t)a->yofs[y]*a->src->width;
+    uint8* d = a->dst->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) d[x] = s[a->xofs[x]];
+  }
+}
+
+// Bilinear, horizontal pass: interpolate the source rows used by some
+// destination row (with 7-bit weights, into 15-bit values).
+static void resizeBilinearH(void* arg, int begin, int end) {
+  struct resizeArgs* a = (struct resizeArgs*)arg;
+  int w = a->dst->width;
+  int sw = a->src->width;
+  for (int sy = begin; sy < end; sy++) {
+    if (!a->used[sy]) continue;
+    const uint8* s = a->src->pixel + (size_t)sy*sw;
+    int16_t* r = a->hrows + (size_t)sy*w;
+    for (int x = 0; x < w; x++) {
+      int x0 = a->xofs[x];
+      int x1 = x0 + 1 < sw ? x0 + 1 : x0;
+      r[x] = (int16_t)(s[x0]*(RSONE - a->xw[x]) + s[x1]*a->xw[x]);
+    }
+  }
+}
+
+// Bilinear, vertical pass: blend the two interpolated rows around each
+// destination row.
+static void resizeBilinearV(void* arg, int begin, int end) {
+  struct resizeArgs* a = (struct resizeArgs*)arg;
+  int w = a->dst->width;
+  for (int y = begin; y < end; y++) {
+    int sy = a->yofs[y];
+    const int16_t* r0 = a->hrows + (size_t)sy*w;
+    const int16_t* r1 = (sy + 1 < a->src->height) ? r0 + w : r0;
+    uint8* d = a->dst->pixel + (size_t)y*w;
+    int fy = a->yw[y];
+    int x = 0;
+#ifdef __SSE2__
+    // 8 pixels per iteration: interleave the two rows and multiply-add
+    // them with the interleaved weights.
+    const __m128i wts = _mm_set1_epi32((fy << 16) | (RSONE - fy));
+    const __m128i rnd = _mm_set1_epi32(1 << (2*RSBITS - 1));
+    for (; x + 8 <= w; x += 8) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)(r0 + x));
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(r1 + x));
+      __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(v0, v1), wts);
+      __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(v0, v1), wts);
+      lo = _mm_srai_epi32(_mm_add_epi32(lo, rnd), 2*RSBITS);
+      hi = _mm_srai_epi32(_mm_add_epi32(hi, rnd), 2*RSBITS);
+      __m128i v = _mm_packs_epi32(lo, hi);
+      _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; x < w; x++) {
+      d[x] = (uint8)((r0[x]*(RSONE - fy) + r1[x]*fy + (1 << (2*RSBITS - 1))) >> 2*RSBITS);
+    }
+  }
+}
+
+// Area: each destination pixel is the rounded mean of the source pixels
+// in its footprint [xofs, xw) x [yofs, yw), obtained from the summed-area table.
+static void resizeAreaRows(void* arg, int begin, int end) {
+  struct resizeArgs* a = (struct resizeArgs*)arg;
+  int w = a->dst->width;
+  int sw = a->src->width;
+  const unsigned long* t = a->sat;
+  for (int y = begin; y < end; y++) {
+    int y0 = a->yofs[y];
+    int y1 = a->yw[y] - 1;
+    uint8* d = a->dst->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      int x0 = a->xofs[x];
+      int x1 = a->xw[x] - 1;
+      unsigned long sum = t[(size_t)y1*sw + x1];
+      if (x0 > 0) sum -= t[(size_t)y1*sw + x0-1];
+      if (y0 > 0) sum -= t[(size_t)(y0-1)*sw + x1];
+      if (x0 > 0 && y0 > 0) sum += t[(size_t)(y0-1)*sw + x0-1];
+      unsigned long area = (unsigned long)(x1 - x0 + 1)*(y1 - y0 + 1);
+      d[x] = (uint8)((sum + area/2) / area);
+    }
+  }
+}
+
+// Fill the sampling tables for one axis, from n source to m destination
+// pixels.
+static void resizeTable(int mode, int n, int m, int* ofs, int* wt) {
+  for (int i = 0; i < m; i++) {
+    switch (mode) {
+    case RESIZE_NEAREST:
+      ofs[i] = (int)(((2*(long)i + 1)*n) / (2*(long)m));
+      break;
+    case RESIZE_BILINEAR: {
+      // Source position of the destination pixel center, in 1/RSONE units
+      long p = ((2*(long)i + 1)*n*RSONE) / (2*(long)m) - RSONE/2;
+      if (p < 0) p = 0;
+      ofs[i] = (int)(p >> RSBITS);
+      wt[i] = (int)(p & (RSONE - 1));
+      if (ofs[i] >= n - 1) { ofs[i] = n - 1; wt[i] = 0; }
+      break; }
+    case RESIZE_AREA:
+      ofs[i] = (int)((long)i*n / m);
+      wt[i] = (int)(((long)i + 1)*n / m);
+      if (wt[i] <= ofs[i]) wt[i] = ofs[i] + 1;  // upscaling: at least one pixel
+      break;
+    }
+  }
+}
+
+/// Resize an image to width x height pixels.
+/// mode selects the resampling method:
+///   RESIZE_NEAREST: each pixel copies the nearest source pixel;
+///   RESIZE_BILINEAR: bilinear interpolation of the 4 nearest source pixels;
+///   RESIZE_AREA: mean of the source pixels covered by each pixel (best for
+///     downscaling).
+/// Rows are computed in parallel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int width, int height, int mode) { ///
+  assert (img != NULL);
+  assert (width >= 0 && height >= 0);
+  assert (mode == RESIZE_NEAREST || mode == RESIZE_BILINEAR || mode == RESIZE_AREA);
+  Image dst = ImageCreate(width, height, img->maxval);
+  if (dst == NULL) return NULL;
+  if (img->width == 0 || img->height == 0 || width == 0 || height == 0) return dst;
+
+  struct resizeArgs a = { img, dst, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+  int ok = 1;
+  if (img->tiles != NULL) {
+    // The tile cache is not thread-safe: work on a dense copy
+    a.src = ImageCrop(img, 0, 0, img->width, img->height);
+    ok = (a.src != NULL);
+  }
+  if (ok) {
+    a.xofs = (int*)malloc(width*sizeof(int));
+    a.xw = (int*)malloc(width*sizeof(int));
+    a.yofs = (int*)malloc(height*sizeof(int));
+    a.yw = (int*)malloc(height*sizeof(int));
+    ok = check(a.xofs != NULL && a.xw != NULL && a.yofs != NULL && a.yw != NULL, "Allocating resize tables");
+  }
+  if (ok && mode == RESIZE_AREA) {
+    a.sat = build_summed_area_table(a.src);
+    ok = (a.sat != NULL);
+  }
+  if (ok && mode == RESIZE_BILINEAR) {
+    a.hrows = (int16_t*)malloc((size_t)img->height*width*sizeof(int16_t));
+    a.used = (char*)calloc(img->height, 1);
+    ok = check(a.hrows != NULL && a.used != NULL, "Allocating resize buffers");
+  }
+  if (ok) {
+    resizeTable(mode, img->width, width, a.xofs, a.xw);
+    resizeTable(mode, img->height, height, a.yofs, a.yw);
+    switch (mode) {
+    case RESIZE_NEAREST:
+      parallelFor(height, 16, resizeNearestRows, &a);
+      PIXMEM += 2*(unsigned long)width*height;
+      break;
+    case RESIZE_BILINEAR:
+      for (int y = 0; y < height; y++) {
+        a.used[a.yofs[y]] = 1;
+        if (a.yofs[y] + 1 < img->height) a.used[a.yofs[y] + 1] = 1;
+      }
+      parallelFor(img->height, 16, resizeBilinearH, &a);
+      parallelFor(height, 16, resizeBilinearV, &a);
+      PIXMEM += 5*(unsigned long)width*height;
+      break;
+    case RESIZE_AREA:
+      parallelFor(height, 16, resizeAreaRows, &a);
+      PIXMEM += (unsigned long)width*height;  // writes (SAT reads are counted apart)
+      break;
+    }
+  }
+  errsave = errno;
+  free(a.xofs);
+  free(a.xw);
+  free(a.yofs);
+  free(a.yw);
+  free(a.sat);
+  free(a.hrows);
+  free(a.used);
+  if (a.src != img) ImageDestroy(&a.src);
+  errno = errsave;
+  if (!ok) ImageDestroy(&dst);
+  return dst;
+}
+
+// Affine warps
+//
+// Each destination pixel samples the source at the point mapped to its
+// center by the inverse transform, with bilinear interpolation (RSBITS-bit
+// weights, as in ImageResize).  Along a destination row, source coordinates
+// change by a constant step, so they are kept in 32.32 fixed point and
+// stepped incrementally; only the start of each row is computed in floating
+// point.  Source coordinates are in pixel units, with pixel centers at
+// integers, so the image covers [-0.5, w-0.5) x [-0.5, h-0.5): points
+// outside it get the fill level, and points beyond the centers of the
+// border pixels take their levels, as in ImageResize.
+
+// Largest source coordinate accepted (so that 32.32 values do not overflow)
+#define WARPMAXCOORD (double)(1 << 30)
+
+struct warpArgs {
+  Image src;             // dense source image
+  Image dst;
+  double m[6];           // inverse transform: u = m0 x + m1 y + m2, v = m3 x + m4 y + m5
+  uint8 fill;
+};
+
+// The 4 source pixels around (u, v) (32.32 fixed point) and the weights of
+// the right and bottom ones, or the fill level (with any weights) if (u, v)
+// is outside the source image.  Within half a pixel of the edges, the taps
+// beyond the border pixels repeat them (so any weights give the same).
+static inline void warpTaps(const struct warpArgs* a, int64_t u, int64_t v,
+                            int* p, int* fx, int* fy) {
+  int sw = a->src->width;
+  int sh = a->src->height;
+  const int64_t half = (int64_t)1 << 31;
+  if (u < -half || v < -half || u >= ((int64_t)sw << 32) - half || v >= ((int64_t)sh << 32) - half) {
+    p[0] = p[1] = p[2] = p[3] = a->fill;
+    *fx = *fy = 0;
+    return;
+  }
+  int xi = (u < 0) ? 0 : (int)(u >> 32);
+  int yi = (v < 0) ? 0 : (int)(v >> 32);
+  int x1 = xi + (u >= 0 && xi < sw - 1);
+  const uint8* r0 = a->src->pixel + (size_t)yi*sw;
+  const uint8* r1 = (v >= 0 && yi < sh - 1) ? r0 + sw : r0;
+  p[0] = r0[xi];
+  p[1] = r0[x1];
+  p[2] = r1[xi];
+  p[3] = r1[x1];
+  *fx = (int)(u >> (32 - RSBITS)) & (RSONE - 1);
+  *fy = (int)(v >> (32 - RSBITS)) & (RSONE - 1);
+}
+
+// Warp destination rows [begin, end) (a parallelFor range function).
+static void warpRows(void* arg, int begin, int end) {
+  struct warpArgs* a = (struct warpArgs*)arg;
+  const double* m = a->m;
+  const double one = 4294967296.0;   // 1 in 32.32 fixed point
+  int w = a->dst->width;
+  int64_t du = llround(m[0]*one);
+  int64_t dv = llround(m[3]*one);
+  for (int y = begin; y < end; y++) {
+    int64_t u = llround((m[0]*0.5 + m[1]*(y + 0.5) + m[2] - 0.5)*one);
+    int64_t v = llround((m[3]*0.5 + m[4]*(y + 0.5) + m[5] - 0.5)*one);
+    uint8* d = a->dst->pixel + (size_t)y*w;
+    int x = 0;
+#ifdef __SSE2__
+    // Gather the taps of 8 pixels, then interpolate them together:
+    // horizontally in 16 bits, vertically with multiply-adds in 32 bits.
+    const __m128i one16 = _mm_set1_epi16(RSONE);
+    const __m128i rnd = _mm_set1_epi32(1 << (2*RSBITS - 1));
+    const int sw = a->src->width;
+    const int64_t umax = (int64_t)(sw - 1) << 32;
+    const int64_t vmax = (int64_t)(a->src->height - 1) << 32;
+    // The weights are the top RSBITS of the fractional parts of u and v,
+    // which are stepped (modulo 2^32) in 32-bit lanes
+    const __m128i step = _mm_setr_epi32(0, (int)du, (int)(2*du), (int)(3*du));
+    const __m128i step4 = _mm_set1_epi32((int)(4*du));
+    const __m128i vstep = _mm_setr_epi32(0, (int)dv, (int)(2*dv), (int)(3*dv));
+    const __m128i vstep4 = _mm_set1_epi32((int)(4*dv));
+    const __m128i lobyte = _mm_set1_epi16(0xff);
+    for (; x + 8 <= w; x += 8) {
+      __m128i u0 = _mm_add_epi32(_mm_set1_epi32((int)u), step);
+      __m128i v0 = _mm_add_epi32(_mm_set1_epi32((int)v), vstep);
+      __m128i fx = _mm_packs_epi32(_mm_srli_epi32(u0, 32 - RSBITS),
+                                   _mm_srli_epi32(_mm_add_epi32(u0, step4), 32 - RSBITS));
+      __m128i fy = _mm_packs_epi32(_mm_srli_epi32(v0, 32 - RSBITS),
+                                   _mm_srli_epi32(_mm_add_epi32(v0, vstep4), 32 - RSBITS));
+      __m128i t0, t1, b0, b1;
+      // Coordinates are linear along the row: if the first and last samples
+      // are strictly inside (away from the last row and column), all are.
+      int64_t ul = u + 7*du, vl = v + 7*dv;
+      if (u >= 0 && v >= 0 && ul >= 0 && vl >= 0 &&
+          u < umax && v < vmax && ul < umax && vl < vmax) {
+        // Gather the pairs of horizontal neighbors, in the 16-bit lanes of
+        // the top and bottom vectors
+        __m128i top = _mm_setzero_si128(), bot = _mm_setzero_si128();
+        uint16_t pair;
+#define WARP_GATHER(i) do { \
+          const uint8* r0 = a->src->pixel + (size_t)(v >> 32)*sw + (u >> 32); \
+          memcpy(&pair, r0, 2); \
+          top = _mm_insert_epi16(top, pair, i); \
+          memcpy(&pair, r0 + sw, 2); \
+          bot = _mm_insert_epi16(bot, pair, i); \
+          u += du; \
+          v += dv; \
+        } while (0)
+        WARP_GATHER(0); WARP_GATHER(1); WARP_GATHER(2); WARP_GATHER(3);
+        WARP_GATHER(4); WARP_GATHER(5); WARP_GATHER(6); WARP_GATHER(7);
+#undef WARP_GATHER
+        t0 = _mm_and_si128(top, lobyte);
+        t1 = _mm_srli_epi16(top, 8);
+        b0 = _mm_and_si128(bot, lobyte);
+        b1 = _mm_srli_epi16(bot, 8);
+      } else {
+        int16_t tap[4][8];
+        for (int i = 0; i < 8; i++) {
+          int p[4], ignx, igny;
+          warpTaps(a, u, v, p, &ignx, &igny);
+          for (int j = 0; j < 4; j++) tap[j][i] = (int16_t)p[j];
+          u += du;
+          v += dv;
+        }
+        t0 = _mm_loadu_si128((const __m128i*)tap[0]);
+        t1 = _mm_loadu_si128((const __m128i*)tap[1]);
+        b0 = _mm_loadu_si128((const __m128i*)tap[2]);
+        b1 = _mm_loadu_si128((const __m128i*)tap[3]);
+      }
+      __m128i gx = _mm_sub_epi16(one16, fx);
+      __m128i gy = _mm_sub_epi16(one16, fy);
+      __m128i top = _mm_add_epi16(_mm_mullo_epi16(t0, gx), _mm_mullo_epi16(t1, fx));
+      __m128i bot = _mm_add_epi16(_mm_mullo_epi16(b0, gx), _mm_mullo_epi16(b1, fx));
+      __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(top, bot), _mm_unpacklo_epi16(gy, fy));
+      __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(top, bot), _mm_unpackhi_epi16(gy, fy));
+      lo = _mm_srai_epi32(_mm_add_epi32(lo, rnd), 2*RSBITS);
+      hi = _mm_srai_epi32(_mm_add_epi32(hi, rnd), 2*RSBITS);
+      __m128i r = _mm_packs_epi32(lo, hi);
+      _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(r, r));
+    }
+#endif
+    for (; x < w; x++) {
+      int p[4], fx, fy;
+      warpTaps(a, u, v, p, &fx, &fy);
+      int top = p[0]*(RSONE - fx) + p[1]*fx;
+      int bot = p[2]*(RSONE - fx) + p[3]*fx;
+      d[x] = (uint8)((top*(RSONE - fy) + bot*fy + (1 << (2*RSBITS - 1))) >> (2*RSBITS));
+      u += du;
+      v += dv;
+    }
+  }
+}
+
+/// Apply an affine transform to an image.
+/// The transform maps each point (x, y) of img to the point
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of the result, which has the same size as img.  Coordinates are
+/// continuous, with (0, 0) at the top-left corner of the image (so the
+/// center of pixel (x, y) is at (x+0.5, y+0.5)).
+/// Each pixel of the result is interpolated (bilinearly) from the pixels of
+/// img around the point that maps to its center; pixels that come from
+/// outside img get level fill.  Rows are computed in parallel.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a transform that is not invertible, or maps the
+/// image too far away), returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double m[6], uint8 fill) { ///
+  assert (img != NULL);
+  assert (m != NULL);
+  int w = img->width;
+  int h = img->height;
+  double det = m[0]*m[4] - m[1]*m[3];
+  if (!check( fabs(det) > 1e-9, "Singular transform" )) return NULL;
+  struct warpArgs a = { img, NULL, { 0 }, fill };
+  a.m[0] = m[4]/det;
+  a.m[1] = -m[1]/det;
+  a.m[3] = -m[3]/det;
+  a.m[4] = m[0]/det;
+  a.m[2] = -(a.m[0]*m[2] + a.m[1]*m[5]);
+  a.m[5] = -(a.m[3]*m[2] + a.m[4]*m[5]);
+  // The source coordinates of the corners bound those of all pixels
+  for (int k = 0; k < 4; k++) {
+    double x = (k & 1) ? w : 0, y = (k & 2) ? h : 0;
+    double u = a.m[0]*x + a.m[1]*y + a.m[2];
+    double v = a.m[3]*x + a.m[4]*y + a.m[5];
+    if (!check( fabs(u) < WARPMAXCOORD && fabs(v) < WARPMAXCOORD, "Transform out of range" )) return NULL;
+  }
+  Image dst = ImageCreate(w, h, img->maxval);
+  if (dst == NULL) return NULL;
+  a.dst = dst;
+  if (img->tiles != NULL) {
+    // The tile cache is not thread-safe: work on a dense copy
+    a.src = ImageCrop(img, 0, 0, w, h);
+    if (a.src == NULL) {
+      ImageDestroy(&dst);
+      return NULL;
+    }
+  }
+  parallelFor(h, 16, warpRows, &a);
+  PIXMEM += 5*(unsigned long)w*h;  // 4 reads + 1 write
+  if (a.src != img) ImageDestroy(&a.src);
+  return dst;
+}
+
+/// Rotate an image by an arbitrary angle, in degrees, counter-clockwise
+/// (as ImageRotate, for 90), about the center of the image.
+/// The result has the same size as img: corners that leave the image are
+/// cut, and uncovered pixels get level fill.  See ImageAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, uint8 fill) { ///
+  assert (img != NULL);
+  double t = degrees*(M_PI/180.0);
+  double c = cos(t), s = sin(t);
+  double cx = img->width/2.0, cy = img->height/2.0;
+  // (x, y) -> center + R*((x, y) - center), with y pointing down
+  double m[6] = { c, s, cx - c*cx - s*cy,
+                  -s, c, cy + s*cx - c*cy };
+  return ImageAffine(img, m, fill);
+}
+
+
+/// 16-bit images
+
+// An Image16 has the same layout as an Image, with 16-bit pixels
+// (maxval up to 65535).  Its operations share the depth-generic kernels
+// with the 8-bit ones.  16-bit images are always dense (never tiled).
+struct image16 {
+  int width;
+  int height;
+  int maxval;        // maximum gray value (pixels cannot exceed this)
+  uint16_t* pixel;   // pixel data (a raster scan)
+};
+
+/// Create a new black 16-bit image.
+/// Requires: width and height must be non-negative, 0 < maxval <= 65535.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Create(int width, int height, int maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= 65535);
+  Image16 img = (Image16)malloc(sizeof(struct image16));
+  uint16_t* pixel = (uint16_t*)calloc((size_t)width*height, sizeof(uint16_t));
+  if (!check(img != NULL && pixel != NULL, "Allocating image")) {
+    free(img);
+    free(pixel);
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->pixel = pixel;
+  return img;
+}
+
+/// Destroy the 16-bit image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void Image16Destroy(Image16* imgp) { ///
+  assert (imgp != NULL);
+  if (*imgp == NULL) return;
+  free((*imgp)->pixel);
+  free(*imgp);
+  *imgp = NULL;
+}
+
+/// Load a raw PGM file into a 16-bit image.
+/// Any maxval up to 65535 is accepted: with maxval > 255, each pixel takes
+/// two bytes, most significant first (as specified by the PGM format).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Load(const char* filename) { ///
+  int w, h;
+  int maxval;
+  int fmt;
+  int rows;
+  struct pnmReader* r = NULL;
+  Image16 img = NULL;
+  size_t n = 0;
+
+  int success =
+  check( (r = (struct pnmReader*)malloc(sizeof(struct pnmReader))) != NULL, "Allocating read buffer" ) &&
+  check( (r->fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0, "Open failed" );
+  if (success) {
+    r->pos = r->len = 0;
+    success =
+    // Parse header, as in ImageLoad (but any maxval)
+    pnmHeader(r, 65535, &fmt, &w, &h, &maxval, &rows) &&
+    check( fmt == '5' , "Invalid file format (not raw PGM)" ) &&
+    // Allocate image
+    (img = Image16Create(w, h, maxval)) != NULL;
+  }
+  if (success) {
+    n = (size_t)w*h;
+    if (maxval > 255) {
+      // Read big-endian samples in place, then swap to host order
+      uint8* bytes = (uint8*)img->pixel;
+      success = check( pnmRead(r, bytes, 2*n) , "Reading pixels" );
+      for (size_t i = 0; success && i < n; i++) {
+        img->pixel[i] = (uint16_t)(bytes[2*i] << 8 | bytes[2*i+1]);
+      }
+    } else {
+      // One byte per sample: read into the upper half, then widen
+      uint8* bytes = (uint8*)img->pixel + n;
+      success = check( pnmRead(r, bytes, n) , "Reading pixels" );
+      for (size_t i = 0; success && i < n; i++) {
+        img->pixel[i] = bytes[i];
+      }
+    }
+  }
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    Image16Destroy(&img);
+    errno = errsave;
+  }
+  if (r != NULL && r->fd >= 0) close(r->fd);
+  free(r);
+  return img;
+}
+
+/// Save a 16-bit image to a PGM file.
+/// With maxval > 255, each pixel takes two bytes, most significant first;
+/// otherwise, one byte (the same file ImageSave would write).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int Image16Save(Image16 img, const char* filename) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  int bps = img->maxval > 255 ? 2 : 1;   // bytes per sample
+  FILE* f = NULL;
+  uint8* row = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( (row = (uint8*)malloc((size_t)w*bps + 1)) != NULL, "Allocating row buffer" ) &&
+  check( fprintf(f, "P5\n%d %d\n%d\n", w, h, img->maxval) > 0, "Writing header failed" );
+  for (int y = 0; success && y < h; y++) {
+    const uint16_t* p = img->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      if (bps == 2) {
+        row[2*x] = (uint8)(p[x] >> 8);
+        row[2*x+1] = (uint8)p[x];
+      } else {
+        row[x] = (uint8)p[x];
+      }
+    }
+    success = check( fwrite(row, bps, w, f) == (size_t)w, "Writing pixels failed" );
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  free(row);
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+/// Convert an 8-bit image to a 16-bit image, with the same pixel values
+/// and maxval.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 ImageTo16(Image img) { ///
+  assert (img != NULL);
+  Image16 img16 = Image16Create(img->width, img->height, img->maxval);
+  if (img16 == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, n; x < img->width; x += n) {
+      const uint8* span = pixelSpan(img, x, y, &n, 0);
+      uint16_t* d = img16->pixel + (size_t)y*img->width + x;
+      for (int i = 0; i < n; i++) d[i] = span[i];
+    }
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+  return img16;
+}
+
+/// Convert a 16-bit image to an 8-bit image.
+/// If maxval <= 255, pixel values and maxval are kept.  Otherwise, pixels
+/// are scaled (with rounding) to maxval 255.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image Image16To8(Image16 img) { ///
+  assert (img != NULL);
+  int maxval = img->maxval > 255 ? 255 : img->maxval;
+  Image img8 = ImageCreate(img->width, img->height, (uint8)maxval);
+  if (img8 == NULL) return NULL;
+  size_t n = (size_t)img->width*img->height;
+  uint32_t m = (uint32_t)img->maxval;
+  for (size_t i = 0; i < n; i++) {
+    img8->pixel[i] = (uint8)(maxval == img->maxval ? img->pixel[i] : (img->pixel[i]*255u + m/2) / m);
+  }
+  PIXMEM += 2*(unsigned long)n;  // count pixel memory accesses
+  return img8;
+}
+
+/// Get 16-bit image width
+int Image16Width(Image16 img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get 16-bit image height
+int Image16Height(Image16 img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get 16-bit image maximum gray level
+int Image16Maxval(Image16 img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Find the minimum and maximum gray levels in a 16-bit image.
+/// (Both are 0 for an empty image.)
+void Image16Stats(Image16 img, uint16_t* min, uint16_t* max) { ///
+  assert (img != NULL);
+  unsigned amin = 65535, amax = 0;
+  size_t n = (size_t)img->width*img->height;
+  if (n == 0) amin = 0;
+  for (int y = 0; y < img->height; y++) {
+    minmaxSpan16(img->pixel + (size_t)y*img->width, img->width, &amin, &amax);
+  }
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
+  *min = (uint16_t)amin;
+  *max = (uint16_t)amax;
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside a 16-bit img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  return (0 <= x && 0 <= y && 0 <= w && 0 <= h) && (x+w <= img->width) && (y+h <= img->height);
+}
+
+/// Get the pixel (level) at position (x,y) of a 16-bit image.
+uint16_t Image16GetPixel(Image16 img, int x, int y) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM += 1;  // count one pixel access (read)
+  PIXRD++;
+  return img->pixel[(size_t)y*img->width + x];
+}
+
+/// Set the pixel at position (x,y) of a 16-bit image to new level.
+void Image16SetPixel(Image16 img, int x, int y, uint16_t level) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM += 1;  // count one pixel access (store)
+  PIXWR++;
+  img->pixel[(size_t)y*img->width + x] = level;
+}
+
+/// Transform a 16-bit image to its negative (in-place).
+void Image16Negative(Image16 img) { ///
+  assert (img != NULL);
+  for (int y = 0; y < img->height; y++) {
+    negSpan16(img->pixel + (size_t)y*img->width, img->width, img->maxval);
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+}
+
+/// Apply threshold to a 16-bit image (in-place), as in ImageThreshold.
+void Image16Threshold(Image16 img, uint16_t thr) { ///
+  assert (img != NULL);
+  for (int y = 0; y < img->height; y++) {
+    thrSpan16(img->pixel + (size_t)y*img->width, img->width, thr, img->maxval);
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+}
+
+/// Brighten a 16-bit image by a factor (in-place), as in ImageBrighten.
+void Image16Brighten(Image16 img, double factor) { ///
+  assert (img != NULL);
+  assert (factor >= 0.0);
+  for (int y = 0; y < img->height; y++) {
+    briSpan16(img->pixel + (size_t)y*img->width, img->width, factor, img->maxval);
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+}
+
+/// Rotate a 16-bit image, as in ImageRotate.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Rotate(Image16 img) { ///
+  assert (img != NULL);
+  Image16 r = Image16Create(img->height, img->width, img->maxval);
+  if (r == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    rotSpan16(r->pixel, img->height, img->pixel + (size_t)y*img->width, img->width, 0, y, img->width);
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+  return r;
+}
+
+/// Mirror a 16-bit image (flip left-right), as in ImageMirror.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Mirror(Image16 img) { ///
+  assert (img != NULL);
+  Image16 r = Image16Create(img->width, img->height, img->maxval);
+  if (r == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    revSpan16(r->pixel + (size_t)y*img->width, img->pixel + (size_t)y*img->width, img->width);
+  }
+  PIXMEM += 2*(unsigned long)img->width*img->height;  // count pixel memory accesses
+  return r;
+}
+
+/// Crop a rectangular subimage from a 16-bit image, as in ImageCrop.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (Image16ValidRect(img, x, y, w, h));
+  Image16 r = Image16Create(w, h, img->maxval);
+  if (r == NULL) return NULL;
+  for (int i = 0; i < h; i++) {
+    memcpy(r->pixel + (size_t)i*w, img->pixel + (size_t)(y + i)*img->width + x, (size_t)w*sizeof(uint16_t));
+  }
+  PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses
+  return r;
+}
+
+/// Paste 16-bit img2 into position (x, y) of img1 (in-place).
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (Image16ValidRect(img1, x, y, img2->width, img2->height));
+  for (int i = 0; i < img2->height; i++) {
+    memcpy(img1->pixel + (size_t)(y + i)*img1->width + x, img2->pixel + (size_t)i*img2->width,
+           (size_t)img2->width*sizeof(uint16_t));
+  }
+  PIXMEM += 2*(unsigned long)img2->width*img2->height;  // count pixel memory accesses
+}
+
+/// Blend 16-bit img2 into position (x, y) of img1 (in-place), as in ImageBlend.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (Image16ValidRect(img1, x, y, img2->width, img2->height));
+  for (int i = 0; i < img2->height; i++) {
+    blendSpan16(img1->pixel + (size_t)(y + i)*img1->width + x, img2->pixel + (size_t)i*img2->width,
+                img2->width, alpha, img1->maxval);
+  }
+  PIXMEM += 3*(unsigned long)img2->width*img2->height;  // count pixel memory accesses
+}
+
+/// Compare a 16-bit image to a subimage of a larger one, as in ImageMatchSubImage.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  if (!Image16ValidRect(img1, x, y, img2->width, img2->height)) return 0;
+  for (int i = 0; i < img2->height; i++) {
+    PIXMEM += 2*(unsigned long)img2->width;
+    if (memcmp(img1->pixel + (size_t)(y + i)*img1->width + x, img2->pixel + (size_t)i*img2->width,
+               (size_t)img2->width*sizeof(uint16_t)) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/// Locate a subimage inside a larger 16-bit image, as in ImageLocateSubImage.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  for (int y = 0; y <= img1->height - img2->height; y++) {
+    for (int x = 0; x <= img1->width - img2->width; x++) {
+      if (Image16MatchSubImage(img1, x, y, img2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Blur a 16-bit image by a applying a (2dx+1)x(2dy+1) mean filter
+/// (in-place), as in ImageBlur.  The mean of the pixels inside the image
+/// is rounded to nearest.  Sums are accumulated in 64 bits.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void Image16Blur(Image16 img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  int w = img->width;
+  int h = img->height;
+  uint64_t* sat = (uint64_t*)malloc((size_t)w*h*sizeof(uint64_t));
+  if (!check(sat != NULL, "Allocating summed-area table")) return;
+  for (int y = 0; y < h; y++) satRow16(sat, img->pixel, w, y);
+  boxRows16(img->pixel, sat, w, h, 0, h, dx, dy);
+  PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses
+  free(sat);
+}
+
+/// Run-length encoded images
+
+// An RLEImage holds each row as a sequence of runs of pixels with the same
+// level: a run starts at column x and extends to the start of the next run
+// in the row (or to the end of the row).  Rows are canonical: the first run
+// starts at column 0 and consecutive runs have different levels.  The runs
+// of all rows are kept in one array, row after row.
+// Operations work on runs, so their cost grows with the number of level
+// changes (edges), rather than the area, as for thresholded images.
+struct rleRun {
+  int x;             // first column
+  uint8 level;
+};
+
+struct rleimage {
+  int width;
+  int height;
+  uint8 maxval;
+  size_t* rowStart;  // the runs of row y are run[rowStart[y] .. rowStart[y+1])
+  struct rleRun* run;
+};
+
+// Runs are built row after row: rleBegin, then rleRow at the start of each
+// row, followed by rleAdd for its runs, in increasing columns, then rleEnd.
+// A run with the level of the previous run in the row is merged into it.
+struct rleBuilder {
+  size_t* rowStart;
+  struct rleRun* run;
+  size_t n, cap;     // runs used and allocated
+  size_t rowBegin;   // first run of the current row
+  int height;
+  int failed;        // out of memory while adding runs
+};
+
+static int rleBegin(struct rleBuilder* b, int height) {
+  memset(b, 0, sizeof(*b));
+  b->height = height;
+  b->rowStart = (size_t*)malloc(((size_t)height + 1)*sizeof(size_t));
+  return check( b->rowStart != NULL, "Allocating runs" );
+}
+
+static inline void rleRow(struct rleBuilder* b, int y) {
+  b->rowStart[y] = b->rowBegin = b->n;
+}
+
+static inline void rleAdd(struct rleBuilder* b, int x, uint8 level) {
+  if (b->n > b->rowBegin && b->run[b->n - 1].level == level) return;
+  if (b->n == b->cap) {
+    size_t cap = (b->cap > 0) ? 2*b->cap : 256;
+    struct rleRun* run = (struct rleRun*)realloc(b->run, cap*sizeof(struct rleRun));
+    if (run == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->run = run;
+    b->cap = cap;
+  }
+  b->run[b->n].x = x;
+  b->run[b->n].level = level;
+  b->n++;
+}
+
+// Finish building: on success, the runs replace those of img.
+// On failure (out of memory), img is left unchanged and errCause is set.
+static int rleEnd(struct rleBuilder* b, RLEImage img) {
+  if (!check( !b->failed, "Allocating runs" )) {
+    free(b->rowStart);
+    free(b->run);
+    return 0;
+  }
+  b->rowStart[b->height] = b->n;
+  // Release the spare capacity (keeping the array if that fails)
+  struct rleRun* run = (struct rleRun*)realloc(b->run, (b->n > 0 ? b->n : 1)*sizeof(struct rleRun));
+  if (run != NULL) b->run = run;
+  free(img->rowStart);
+  free(img->run);
+  img->rowStart = b->rowStart;
+  img->run = b->run;
+  return 1;
+}
+
+// Create an RLE image with no rows built.
+static RLEImage rleCreate(int width, int height, uint8 maxval) {
+  RLEImage img = (RLEImage)malloc(sizeof(struct rleimage));
+  if (!check( img != NULL, "Allocating image" )) return NULL;
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->rowStart = NULL;
+  img->run = NULL;
+  return img;
+}
+
+// Index of the run of row y of img that contains column x.
+// Requires: 0 <= x < img->width.
+static size_t rleFind(RLEImage img, int y, int x) {
+  size_t lo = img->rowStart[y];
+  size_t hi = img->rowStart[y+1] - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1)/2;
+    if (img->run[mid].x <= x) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+// End column (exclusive) of run i of row y of img.
+static inline int rleRunEnd(RLEImage img, int y, size_t i) {
+  return (i + 1 < img->rowStart[y+1]) ? img->run[i+1].x : img->width;
+}
+
+// Add the runs of columns [x0, x1) of row y of src, moved to column to.
+static void rleAddSpan(struct rleBuilder* b, RLEImage src, int y, int x0, int x1, int to) {
+  if (x0 >= x1) return;
+  size_t e = src->rowStart[y+1];
+  for (size_t i = rleFind(src, y, x0); i < e && src->run[i].x < x1; i++) {
+    int x = (src->run[i].x > x0) ? src->run[i].x : x0;
+    rleAdd(b, x - x0 + to, src->run[i].level);
+  }
+}
+
+// Index of the first pixel in p[x, n) with a level other than level, or n.
+static inline int rleScan(const uint8* p, int x, int n, uint8 level) {
+#ifdef __SSE2__
+  const __m128i v = _mm_set1_epi8((char)level);
+  for (; x + 16 <= n; x += 16) {
+    int m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + x)), v)) & 0xFFFF;
+    if (m != 0) return x + __builtin_ctz(m);
+  }
+#endif
+  while (x < n && p[x] == level) x++;
+  return x;
+}
+
+/// Convert an image to run-length encoded form.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageFromImage(Image img) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  RLEImage r = rleCreate(w, h, img->maxval);
+  struct rleBuilder b;
+  if (r == NULL || !rleBegin(&b, h)) {
+    RLEImageDestroy(&r);
+    return NULL;
+  }
+  for (int y = 0; y < h; y++) {
+    rleRow(&b, y);
+    for (int x = 0, n; x < w; x += n) {
+      const uint8* span = pixelSpan(img, x, y, &n, 0);
+      for (int i = 0; i < n; i = rleScan(span, i, n, span[i])) {
+        rleAdd(&b, x + i, span[i]);  // merged, if the previous span ended with this level
+      }
+    }
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+  if (!rleEnd(&b, r)) RLEImageDestroy(&r);
+  return r;
+}
+
+/// Convert a run-length encoded image to a (dense) image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image RLEImageToImage(RLEImage img) { ///
+  assert (img != NULL);
+  Image r = ImageCreate(img->width, img->height, img->maxval);
+  if (r == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    uint8* row = r->pixel + (size_t)y*img->width;
+    for (size_t i = img->rowStart[y]; i < img->rowStart[y+1]; i++) {
+      int x = img->run[i].x;
+      memset(row + x, img->run[i].level, rleRunEnd(img, y, i) - x);
+    }
+  }
+  PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+  return r;
+}
+
+/// Destroy the RLE image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void RLEImageDestroy(RLEImage* imgp) { ///
+  assert (imgp != NULL);
+  if (*imgp == NULL) return;
+  free((*imgp)->rowStart);
+  free((*imgp)->run);
+  free(*imgp);
+  *imgp = NULL;
+}
+
+int RLEImageWidth(RLEImage img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+int RLEImageHeight(RLEImage img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+int RLEImageMaxval(RLEImage img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Number of runs in an RLE image (its memory use is proportional).
+size_t RLEImageRuns(RLEImage img) { ///
+  assert (img != NULL);
+  return img->rowStart[img->height];
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside an RLE img.
+int RLEImageValidRect(RLEImage img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  return (0 <= x && 0 <= y && 0 <= w && 0 <= h) && (x+w <= img->width) && (y+h <= img->height);
+}
+
+/// Get the pixel (level) at position (x,y) of an RLE image.
+/// (The run is found by binary search in the row.)
+uint8 RLEImageGetPixel(RLEImage img, int x, int y) { ///
+  assert (img != NULL);
+  assert (RLEImageValidRect(img, x, y, 1, 1));
+  return img->run[rleFind(img, y, x)].level;
+}
+
+/// Find the minimum and maximum gray levels in an RLE image, as in
+/// ImageStats.
+void RLEImageStats(RLEImage img, uint8* min, uint8* max) { ///
+  assert (img != NULL);
+  size_t n = img->rowStart[img->height];
+  if (n == 0) {
+    *min = *max = 0;
+    return;
+  }
+  unsigned amin = PixMax, amax = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (img->run[i].level < amin) amin = img->run[i].level;
+    if (img->run[i].level > amax) amax = img->run[i].level;
+  }
+  *min = (uint8)amin;
+  *max = (uint8)amax;
+}
+
+/// Transform an RLE image to its photographic negative, as in ImageNegative.
+void RLEImageNegative(RLEImage img) { ///
+  assert (img != NULL);
+  size_t n = img->rowStart[img->height];
+  for (size_t i = 0; i < n; i++) img->run[i].level = img->maxval - img->run[i].level;
+}
+
+/// Mirror an RLE image = flip left<->right, as in ImageMirror.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageMirror(RLEImage img) { ///
+  assert (img != NULL);
+  RLEImage r = rleCreate(img->width, img->height, img->maxval);
+  struct rleBuilder b;
+  if (r == NULL || !rleBegin(&b, img->height)) {
+    RLEImageDestroy(&r);
+    return NULL;
+  }
+  for (int y = 0; y < img->height; y++) {
+    rleRow(&b, y);
+    for (size_t i = img->rowStart[y+1]; i-- > img->rowStart[y]; ) {
+      rleAdd(&b, img->width - rleRunEnd(img, y, i), img->run[i].level);
+    }
+  }
+  if (!rleEnd(&b, r)) RLEImageDestroy(&r);
+  return r;
+}
+
+/// Crop a rectangular subimage from an RLE image, as in ImageCrop.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageCrop(RLEImage img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (RLEImageValidRect(img, x, y, w, h));
+  RLEImage r = rleCreate(w, h, img->maxval);
+  struct rleBuilder b;
+  if (r == NULL || !rleBegin(&b, h)) {
+    RLEImageDestroy(&r);
+    return NULL;
+  }
+  for (int i = 0; i < h; i++) {
+    rleRow(&b, i);
+    rleAddSpan(&b, img, y + i, x, x + w, 0);
+  }
+  if (!rleEnd(&b, r)) RLEImageDestroy(&r);
+  return r;
+}
+
+/// Paste RLE img2 into position (x, y) of RLE img1, as in ImagePaste.
+/// The runs of img1 are rebuilt.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// On failure (out of memory), img1 is left unchanged and errCause is set.
+void RLEImagePaste(RLEImage img1, int x, int y, RLEImage img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (RLEImageValidRect(img1, x, y, img2->width, img2->height));
+  int w1 = img1->width;
+  int w2 = img2->width;
+  struct rleBuilder b;
+  if (!rleBegin(&b, img1->height)) return;
+  for (int j = 0; j < img1->height; j++) {
+    rleRow(&b, j);
+    if (j < y || j >= y + img2->height) {
+      rleAddSpan(&b, img1, j, 0, w1, 0);
+    } else {
+      rleAddSpan(&b, img1, j, 0, x, 0);
+      rleAddSpan(&b, img2, j - y, 0, w2, x);
+      rleAddSpan(&b, img1, j, x + w2, w1, x + w2);
+    }
+  }
+  rleEnd(&b, img1);
+}
+
+/// Compare an RLE image to a subimage of a larger one, as in
+/// ImageMatchSubImage.  Rows are compared run by run.
+int RLEImageMatchSubImage(RLEImage img1, int x, int y, RLEImage img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (RLEImageValidRect(img1, x, y, img2->width, img2->height));
+  int w2 = img2->width;
+  for (int j = 0; j < img2->height; j++) {
+    if (w2 == 0) break;
+    size_t i1 = rleFind(img1, y + j, x);
+    size_t i2 = img2->rowStart[j];
+    // Compare the pieces where both images have a single run
+    for (int p = 0; p < w2; ) {
+      if (img1->run[i1].level != img2->run[i2].level) return 0;
+      int e1 = rleRunEnd(img1, y + j, i1) - x;
+      int e2 = rleRunEnd(img2, j, i2);
+      p = (e1 < e2) ? e1 : e2;
+      if (e1 == p) i1++;
+      if (e2 == p) i2++;
+    }
+  }
+  return 1;
+}
+
+/// Binary images
+
+// A BitImage packs a thresholded image into one bit per pixel: pixel x of a
+// row is bit x%64 of word x/64 of the row, 1 for foreground (white).  Rows
+// are padded to whole 64-bit words, with the padding bits always 0, so that
+// rows can be compared a word at a time, with XOR and popcount.
+struct bitimage {
+  int width;
+  int height;
+  uint8 maxval;      // level of foreground pixels, when unpacked
+  int stride;        // words per row
+  uint64_t* bits;
+};
+
+// Number of bits set in v
+static inline int popcount64(uint64_t v) {
+#ifdef __POPCNT__
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Mask of the bits of word k of a row of width w that hold pixels
+static inline uint64_t bitMask(int w, int k) {
+  int n = w - 64*k;
+  return (n >= 64) ? ~0ULL : (1ULL << n) - 1;
+}
+
+// The 64 bits starting at bit pos of a row of nwords words
+// (bits beyond the row are 0).
+static inline uint64_t bitsAt(const uint64_t* row, int nwords, int pos) {
+  int i = pos >> 6;
+  int s = pos & 63;
+  uint64_t v = row[i] >> s;
+  if (s != 0 && i + 1 < nwords) v |= row[i+1] << (64 - s);
+  return v;
+}
+
+static BitImage bitCreate(int width, int height, uint8 maxval) {
+  BitImage img = (BitImage)malloc(sizeof(struct bitimage));
+  int stride = (width + 63) / 64;
+  uint64_t* bits = (uint64_t*)calloc((size_t)stride*height + 1, sizeof(uint64_t));
+  if (!check( img != NULL && bits != NULL, "Allocating image" )) {
+    free(img);
+    free(bits);
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->stride = stride;
+  img->bits = bits;
+  return img;
+}
+
+// Pack n pixels of p into words dst, with bits for levels >= thr.
+// The bits after the last pixel, up to the end of its word, are 0.
+static void bitPackSpan(uint64_t* dst, const uint8* p, int n, uint8 thr) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i t = _mm_set1_epi8((char)thr);
+  for (; i + 64 <= n; i += 64) {
+    uint64_t m = 0;
+    for (int j = 0; j < 4; j++) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + i + 16*j));
+      // v >= thr (unsigned) where max(v, thr) == v
+      m |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v)) << (16*j);
+    }
+    dst[i >> 6] = m;
+  }
+#endif
+  for (; i < n; i += 64) {
+    uint64_t m = 0;
+    for (int j = 0; j < 64 && i + j < n; j++) m |= (uint64_t)(p[i + j] >= thr) << j;
+    dst[i >> 6] = m;
+  }
+}
+
+// Unpack n pixels from words src into p, as 0 or level.
+static void bitUnpackSpan(uint8* p, const uint64_t* src, int n, uint8 level) {
+  int i = 0;
+#ifdef __SSE2__
+  // Spread each byte of bits over 8 bytes, and select one bit in each
+  const __m128i sel = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+  const __m128i lv = _mm_set1_epi8((char)level);
+  for (; i + 16 <= n; i += 16) {
+    unsigned m = (unsigned)(src[i >> 6] >> (i & 63)) & 0xFFFF;
+    __m128i v = _mm_set_epi64x((long long)((m >> 8)*0x0101010101010101ULL),
+                               (long long)((m & 0xFF)*0x0101010101010101ULL));
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(v, lv));
+  }
+#endif
+  for (; i < n; i++) p[i] = ((src[i >> 6] >> (i & 63)) & 1) ? level : 0;
+}
+
+/// Threshold an image into a new binary image, with one bit per pixel.
+/// Pixels with level>=thr are foreground (white), the others background,
+/// as in ImageThreshold.  Pixels are packed 64 at a time.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageFromImage(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  BitImage r = bitCreate(img->width, img->height, img->maxval);
+  if (r == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    uint64_t* row = r->bits + (size_t)y*r->stride;
+    // Spans of tiled images start at multiples of TILE, a multiple of 64
+    for (int x = 0, n; x < img->width; x += n) {
+      const uint8* span = pixelSpan(img, x, y, &n, 0);
+      bitPackSpan(row + x/64, span, n, thr);
+    }
+  }
+  PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+  return r;
+}
+
+/// Unpack a binary image into a new image, with levels 0 (background) and
+/// maxval (foreground), where maxval is that of the thresholded image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage img) { ///
+  assert (img != NULL);
+  Image r = ImageCreate(img->width, img->height, img->maxval);
+  if (r == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    bitUnpackSpan(r->pixel + (size_t)y*img->width, img->bits + (size_t)y*img->stride,
+                  img->width, img->maxval);
+  }
+  PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+  return r;
+}
+
+/// Destroy the binary image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void BitImageDestroy(BitImage* imgp) { ///
+  assert (imgp != NULL);
+  if (*imgp == NULL) return;
+  free((*imgp)->bits);
+  free(*imgp);
+  *imgp = NULL;
+}
+
+int BitImageWidth(BitImage img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+int BitImageHeight(BitImage img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside a binary img.
+int BitImageValidRect(BitImage img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  return (0 <= x && 0 <= y && 0 <= w && 0 <= h) && (x+w <= img->width) && (y+h <= img->height);
+}
+
+/// Get the pixel at position (x,y) of a binary image: 1 for foreground,
+/// 0 for background.
+int BitImageGetPixel(BitImage img, int x, int y) { ///
+  assert (img != NULL);
+  assert (BitImageValidRect(img, x, y, 1, 1));
+  return (int)((img->bits[(size_t)y*img->stride + x/64] >> (x & 63)) & 1);
+}
+
+/// Crop a rectangular subimage from a binary image, as in ImageCrop.
+/// Rows are copied a word at a time.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCrop(BitImage img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (BitImageValidRect(img, x, y, w, h));
+  BitImage r = bitCreate(w, h, img->maxval);
+  if (r == NULL) return NULL;
+  for (int j = 0; j < h; j++) {
+    const uint64_t* src = img->bits + (size_t)(y + j)*img->stride;
+    uint64_t* dst = r->bits + (size_t)j*r->stride;
+    for (int k = 0; k < r->stride; k++) {
+      dst[k] = bitsAt(src, img->stride, x + 64*k) & bitMask(w, k);
+    }
+  }
+  return r;
+}
+
+/// Paste binary img2 into position (x, y) of binary img1, as in ImagePaste.
+/// Rows are copied a word at a time.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (BitImageValidRect(img1, x, y, img2->width, img2->height));
+  int s = x & 63;
+  for (int j = 0; j < img2->height; j++) {
+    const uint64_t* src = img2->bits + (size_t)j*img2->stride;
+    uint64_t* dst = img1->bits + (size_t)(y + j)*img1->stride + x/64;
+    for (int k = 0; k < img2->stride; k++) {
+      uint64_t m = bitMask(img2->width, k);
+      uint64_t v = src[k];
+      dst[k] = (dst[k] & ~(m << s)) | (v << s);
+      if (s != 0 && (m >> (64 - s)) != 0) {
+        dst[k+1] = (dst[k+1] & ~(m >> (64 - s))) | (v >> (64 - s));
+      }
+    }
+  }
+}
+
+// Is the Hamming distance between img2 and the subimage of img1 at (x, y)
+// at most maxdiff?  Stops as soon as it is exceeded.
+static inline int bitMatch(BitImage img1, int x, int y, BitImage img2, int maxdiff) {
+  int diff = 0;
+  for (int j = 0; j < img2->height; j++) {
+    const uint64_t* r1 = img1->bits + (size_t)(y + j)*img1->stride;
+    const uint64_t* r2 = img2->bits + (size_t)j*img2->stride;
+    for (int k = 0; k < img2->stride; k++) {
+      uint64_t d = (bitsAt(r1, img1->stride, x + 64*k) ^ r2[k]) & bitMask(img2->width, k);
+      diff += popcount64(d);
+      if (diff > maxdiff) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Compare a binary image to a subimage of a larger one, allowing some
+/// differences: returns 1 (true) if img2 and the subimage of img1 at
+/// position (x, y) differ in at most maxdiff pixels (their Hamming
+/// distance), or 0 otherwise.  maxdiff = 0 gives ImageMatchSubImage.
+/// Rows are compared 64 pixels at a time, with XOR and popcount, and the
+/// comparison stops as soon as there are too many differences.
+/// Requires: img2 must fit inside img1 at position (x, y), maxdiff >= 0.
+int BitImageMatchSubImage(BitImage img1, int x, int y, BitImage img2, int maxdiff) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (BitImageValidRect(img1, x, y, img2->width, img2->height));
+  assert (maxdiff >= 0);
+  return bitMatch(img1, x, y, img2, maxdiff);
+}
+
+/// Locate a subimage inside a larger binary image, allowing some
+/// differences (see BitImageMatchSubImage).
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 (true) and the position of the first
+/// match (in raster order) is stored in *px and *py.
+/// If no match is found, returns 0 (false) and *px, *py are left untouched.
+/// Requires: maxdiff >= 0.
+int BitImageLocateSubImage(BitImage img1, int* px, int* py, BitImage img2, int maxdiff) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (maxdiff >= 0);
+  if (img2->width == 0 || img2->height == 0) {
+    if (!BitImageValidRect(img1, 0, 0, img2->width, img2->height)) return 0;
+    *px = *py = 0;
+    return 1;
+  }
+  // Most positions are rejected by the first word of the first row:
+  // test it before calling bitMatch
+  uint64_t m0 = bitMask(img2->width, 0);
+  uint64_t w0 = img2->bits[0];
+  for (int y = 0; y <= img1->height - img2->height; y++) {
+    const uint64_t* r1 = img1->bits + (size_t)y*img1->stride;
+    for (int x = 0; x <= img1->width - img2->width; x++) {
+      if (popcount64((bitsAt(r1, img1->stride, x) ^ w0) & m0) <= maxdiff &&
+          bitMatch(img1, x, y, img2, maxdiff)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/// Image sequences
+
+// An ImageSeq reads raw PGM (P5) frames of the same size, concatenated in
+// one file or stream (as written by video tools to a pipe), into a fixed
+// ring of frame buffers: after the first frame, reading a frame allocates
+// nothing, and the last nframes frames stay available for differencing.
+struct imageseq {
+  struct pnmReader* r;
+  int ownfd;         // close r->fd when done (not for standard input)
+  int nframes;       // size of the ring
+  Image* ring;       // frame i is ring[i % nframes]; NULL before the first
+  long count;        // frames read so far
+  int state;         // 0 while reading, 1 at the end, -1 after a failure
+};
+
+/// Open a sequence of frames for reading.
+///   filename: the file (or FIFO) holding the frames, or "-" for standard
+///     input.
+///   nframes: the number of frames kept in the ring (at least 1).
+/// No frame is read until ImageSeqNext.
+/// On success, a new sequence is returned.
+/// (The caller is responsible for closing the returned sequence!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageSeq ImageSeqOpen(const char* filename, int nframes) { ///
+  assert (filename != NULL);
+  assert (nframes >= 1);
+  ImageSeq seq = NULL;
+  int stdinput = (strcmp(filename, "-") == 0);
+  int success =
+    check( (seq = (ImageSeq)calloc(1, sizeof(struct imageseq))) != NULL, "Allocating sequence" ) &&
+    check( (seq->ring = (Image*)calloc(nframes, sizeof(Image))) != NULL, "Allocating frame ring" ) &&
+    check( (seq->r = (struct pnmReader*)malloc(sizeof(struct pnmReader))) != NULL, "Allocating read buffer" ) &&
+    check( (seq->r->fd = stdinput ? STDIN_FILENO : open(filename, O_RDONLY | O_CLOEXEC)) >= 0, "Open failed" );
+  if (!success) {
+    errsave = errno;
+    if (seq != NULL) {
+      free(seq->ring);
+      free(seq->r);
+      free(seq);
+    }
+    errno = errsave;
+    return NULL;
+  }
+  seq->r->pos = seq->r->len = 0;
+  seq->ownfd = !stdinput;
+  seq->nframes = nframes;
+  return seq;
+}
+
+/// Close the sequence pointed to by (*seqp), destroying its frames.
+/// If (*seqp)==NULL, no operation is performed.
+/// Ensures: (*seqp)==NULL.
+void ImageSeqClose(ImageSeq* seqp) { ///
+  assert (seqp != NULL);
+  ImageSeq seq = *seqp;
+  if (seq == NULL) return;
+  for (int i = 0; i < seq->nframes; i++) ImageDestroy(&seq->ring[i]);
+  if (seq->ownfd) close(seq->r->fd);
+  free(seq->ring);
+  free(seq->r);
+  free(seq);
+  *seqp = NULL;
+}
+
+/// Read the next frame of the sequence into the ring.
+/// All frames must have the same size (that of the first one).
+/// On success, returns the frame, which is owned by the sequence: it may
+/// be read or modified, but not destroyed, and it is overwritten by the
+/// nframes-th next call.
+/// At the end of the sequence, returns NULL, with errno = 0 and errCause
+/// "End of sequence".
+/// On failure, returns NULL and errno/errCause are set accordingly; the
+/// rest of the sequence cannot be read.
+Image ImageSeqNext(ImageSeq seq) { ///
+  assert (seq != NULL);
+  struct pnmReader* r = seq->r;
+  if (!check( seq->state == 0, seq->state > 0 ? "End of sequence" : "Sequence failed" )) {
+    errno = 0;
+    return NULL;
+  }
+  // Frames may be separated by whitespace
+  int c;
+  do c = pnmGetc(r); while (c != EOF && isspace(c));
+  if (c == EOF) {
+    seq->state = 1;
+    errno = 0;
+    errCause = "End of sequence";
+    return NULL;
+  }
+  int w, h, maxval;
+  Image frame = NULL;
+  int success =
+    check( c == 'P' && pnmGetc(r) == '5', "Invalid frame format (not raw PGM)" ) &&
+    check( (w = pnmInt(r, INT_MAX)) >= 0 , "Invalid width" ) &&
+    check( (h = pnmInt(r, INT_MAX)) >= 0 , "Invalid height" ) &&
+    check( (maxval = pnmInt(r, PixMax)) > 0 , "Invalid maxval" ) &&
+    check( isspace(pnmGetc(r)) , "Whitespace expected" );
+  // The ring is allocated with the first frame, whose size it takes
+  for (int i = 0; success && seq->count == 0 && i < seq->nframes; i++) {
+    if (seq->ring[i] == NULL) success = (seq->ring[i] = ImageCreate(w, h, (uint8)maxval)) != NULL;
+  }
+  if (success) {
+    frame = seq->ring[seq->count % seq->nframes];
+    success = check( w == frame->width && h == frame->height , "Frame size differs" );
+  }
+  if (success) {
+    imageChanged(frame);
+    frame->maxval = (uint8)maxval;
+    success = check( pnmRead(r, frame->pixel, (size_t)w*h) , "Reading pixels" );
+    PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+  }
+  if (!success) {
+    seq->state = -1;
+    return NULL;
+  }
+  seq->count++;
+  return frame;
+}
+
+/// Get a frame read before: back = 0 is the last frame returned by
+/// ImageSeqNext, 1 the one before it, and so on.
+/// Requires: 0 <= back < nframes, and back < ImageSeqCount(seq).
+Image ImageSeqFrame(ImageSeq seq, int back) { ///
+  assert (seq != NULL);
+  assert (0 <= back && back < seq->nframes && back < seq->count);
+  return seq->ring[(seq->count - 1 - back) % seq->nframes];
+}
+
+/// Get the number of frames read from the sequence so far.
+long ImageSeqCount(ImageSeq seq) { ///
+  assert (seq != NULL);
+  return seq->count;
+}
+
+/// Returns 1 (true) once ImageSeqNext has reached the end of the sequence,
+/// or 0 (false) before that or after a failure.
+int ImageSeqEnded(ImageSeq seq) { ///
+  assert (seq != NULL);
+  return seq->state > 0;
+}
+
+// Kernels for frame differencing, 16 pixels at a time where SSE2 is
+// available.  |a - b| is the OR of the two saturated differences.
+
+// d = |a - b|
+static void absDiffSpan(uint8* d, const uint8* a, const uint8* b, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(d + i), _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)));
+  }
+#endif
+  for (; i < n; i++) d[i] = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+}
+
+// d = (d*(256 - w) + s*w + 128) >> 8, for 0 <= w <= 256 (fits 16 bits)
+static void accumSpan(uint8* d, const uint8* s, int n, unsigned w) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wd = _mm_set1_epi16((short)(256 - w));
+  const __m128i ws = _mm_set1_epi16((short)w);
+  const __m128i half = _mm_set1_epi16(128);
+  for (; i + 16 <= n; i += 16) {
+    __m128i vd = _mm_loadu_si128((const __m128i*)(d + i));
+    __m128i vs = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(vd, zero), wd),
+                                             _mm_mullo_epi16(_mm_unpacklo_epi8(vs, zero), ws)), half);
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(vd, zero), wd),
+                                             _mm_mullo_epi16(_mm_unpackhi_epi8(vs, zero), ws)), half);
+    _mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for (; i < n; i++) d[i] = (uint8)((d[i]*(256 - w) + s[i]*w + 128) >> 8);
+}
+
+// d = (|a - b| > thr) ? level : 0.  Returns the number of pixels set.
+static long motionSpan(uint8* d, const uint8* a, const uint8* b, int n, uint8 thr, uint8 level) {
+  int i = 0;
+  long count = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i t = _mm_set1_epi8((char)thr);
+  const __m128i l = _mm_set1_epi8((char)level);
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i sum = zero;
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    // still: diff <= thr, exactly where diff - thr saturates to 0
+    __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(diff, t), zero);
+    _mm_storeu_si128((__m128i*)(d + i), _mm_andnot_si128(still, l));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_andnot_si128(still, one), zero));
+  }
+  count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+#endif
+  for (; i < n; i++) {
+    int moving = (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]) > thr;
+    d[i] = moving ? level : 0;
+    count += moving;
+  }
+  return count;
+}
+
+/// Absolute difference: set each pixel of dst to |img1 - img2|.
+/// dst may be img1 or img2.  dst keeps its maxval.
+/// This modifies dst in-place: no allocation involved.
+/// Requires: the three images have the same size.
+void ImageAbsDiff(Image dst, Image img1, Image img2) { ///
+  assert (dst != NULL && img1 != NULL && img2 != NULL);
+  assert (img1->width == dst->width && img1->height == dst->height);
+  assert (img2->width == dst->width && img2->height == dst->height);
+  imageChanged(dst);
+  for (int y = 0; y < dst->height; y++) {
+    int n1, n2, n3;
+    for (int x = 0, n; x < dst->width; x += n) {
+      uint8* d = pixelSpan(dst, x, y, &n1, 1);
+      const uint8* a = pixelSpan(img1, x, y, &n2, 0);
+      const uint8* b = pixelSpan(img2, x, y, &n3, 0);
+      n = n1 < n2 ? n1 : n2;
+      if (n > n3) n = n3;
+      absDiffSpan(d, a, b, n);
+    }
+  }
+  PIXMEM += 3*(unsigned long)dst->width*dst->height;  // count pixel memory accesses
+}
+
+/// Running average: move each pixel of bg towards the same pixel of img,
+/// by a fraction alpha of their difference: bg = (1-alpha)*bg + alpha*img.
+/// Applied to each frame of a sequence, this keeps in bg an exponentially
+/// weighted average of the frames: the background, where moving objects
+/// fade out.  alpha is rounded to a multiple of 1/256, and the result to
+/// the nearest level, so differences below 128/(256*alpha) levels do not
+/// move the background.
+/// This modifies bg in-place: no allocation involved.
+/// Requires: bg and img have the same size, 0.0 <= alpha <= 1.0.
+void ImageAccumulate(Image bg, Image img, double alpha) { ///
+  assert (bg != NULL && img != NULL);
+  assert (img->width == bg->width && img->height == bg->height);
+  assert (0.0 <= alpha && alpha <= 1.0);
+  unsigned w = (unsigned)(alpha*256 + 0.5);
+  imageChanged(bg);
+  for (int y = 0; y < bg->height; y++) {
+    int n1, n2;
+    for (int x = 0, n; x < bg->width; x += n) {
+      uint8* d = pixelSpan(bg, x, y, &n1, 1);
+      const uint8* s = pixelSpan(img, x, y, &n2, 0);
+      n = n1 < n2 ? n1 : n2;
+      accumSpan(d, s, n, w);
+    }
+  }
+  PIXMEM += 3*(unsigned long)bg->width*bg->height;  // count pixel memory accesses
+}
+
+/// Motion mask: set each pixel of mask to its maxval where img and bg
+/// differ by more than thr, and to 0 elsewhere.
+/// mask may be img or bg.
+/// Returns the number of moving pixels (those set to maxval).
+/// This modifies mask in-place: no allocation involved.
+/// Requires: the three images have the same size.
+long ImageMotion(Image mask, Image img, Image bg, uint8 thr) { ///
+  assert (mask != NULL && img != NULL && bg != NULL);
+  assert (img->width == mask->width && img->height == mask->height);
+  assert (bg->width == mask->width && bg->height == mask->height);
+  imageChanged(mask);
+  long count = 0;
+  for (int y = 0; y < mask->height; y++) {
+    int n1, n2, n3;
+    for (int x = 0, n; x < mask->width; x += n) {
+      uint8* d = pixelSpan(mask, x, y, &n1, 1);
+      const uint8* a = pixelSpan(img, x, y, &n2, 0);
+      const uint8* b = pixelSpan(bg, x, y, &n3, 0);
+      n = n1 < n2 ? n1 : n2;
+      if (n > n3) n = n3;
+      count += motionSpan(d, a, b, n, thr, mask->maxval);
+    }
+  }
+  PIXMEM += 3*(unsigned long)mask->width*mask->height;  // count pixel memory accesses
+  return count;
+}
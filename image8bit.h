@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,21 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type Image16 is a pointer to 16-bit image objects
+typedef struct image16 *Image16;
+
+// Type Pyramid is a pointer to image pyramid objects
+typedef struct pyramid *Pyramid;
+
+// Type RLEImage is a pointer to run-length encoded image objects
+typedef struct rleimage *RLEImage;
+
+// Type BitImage is a pointer to binary (1 bit per pixel) image objects
+typedef struct bitimage *BitImage;
+
+// Type ImageSeq is a pointer to image sequence (video) reader objects
+typedef struct imageseq *ImageSeq;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,9 +52,23 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters, and start the pool of
+/// threads for parallel operations, with the default size (see
+/// ImageInitThreads).
 void ImageInit(void) ;
 
+/// Init Image library, with nthreads threads for parallel operations
+/// (nthreads = 0 means the default: IMAGE8BIT_THREADS, or the number of
+/// online processors).  (Call once, before any other function!)
+/// The threads form a pool shared by all operations, in all threads of
+/// the program: programs that run several operations concurrently may
+/// ask for fewer threads, so as not to oversubscribe the processors.
+/// On NUMA machines, IMAGE8BIT_NUMA=interleave (or partition) spreads the
+/// threads over the memory nodes, and the pixels of large images over the
+/// nodes (page by page, or in one band of rows per node).
+/// IMAGE8BIT_NUMA_NODES=N pretends there are N nodes, for testing.
+void ImageInitThreads(int nthreads) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -60,19 +90,68 @@ void ImageDestroy(Image* imgp) ;
 
 /// PGM file operations
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file (or another Netpbm file, converted to gray).
+/// The format is detected from the magic number:
+///   P5 (raw PGM) and P2 (plain PGM): up to maxval 255
+///     (see Image16Load for deeper ones);
+///   P4 (raw PBM) and P1 (plain PBM): black pixels become 0 and white
+///     pixels PixMax;
+///   P6 (raw PPM) and P3 (plain PPM): pixels become the rounded luma
+///     (0.299R + 0.587G + 0.114B), so gray PPM files keep their levels;
+///   PZ: compressed images (see ImageSaveCompressed), decompressed in parallel.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
 /// Save image to PGM file.
+/// The header and pixels are written with a single writev call.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Save image to a plain (ASCII, P2) PGM file.
+/// Pixels are written as decimal numbers, in lines of at most 70 characters.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveAscii(Image img, const char* filename) ;
+
+/// Save image to a compressed file.
+/// The format (magic number PZ) is specific to this module: rows are
+/// transformed by PNG-style predictors and entropy coded, in independent
+/// stripes of rows that are compressed in parallel.  ImageLoad reads it.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename) ;
+
+/// Tiled images
+
+/// Open a raw PGM file as a tiled image.
+/// The pixels are not loaded: they are read on demand in tiles of 256x256,
+/// through a cache that holds at most cacheTiles tiles (at least 4), so
+/// memory scales with the working set, not the file size.
+/// If writable is true, the file is opened for update, and changes to
+/// the image are written back to it (on tile eviction, ImageFlush, or
+/// ImageDestroy).  Otherwise, the file is never modified: changed tiles
+/// evicted from the cache are kept in a private scratch file.
+/// Tiled images may be used with all other functions.  ImageGetPixel,
+/// ImageSetPixel, ImageCrop, ImagePaste, ImageMatchSubImage and
+/// ImageLocateSubImage access whole tile rows at a time.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageOpenTiled(const char* filename, int cacheTiles, int writable) ;
+
+/// Write back the modified pixels of a tiled image to its file.
+/// For images that are not tiled, does nothing and succeeds.
+/// On success, returns nonzero.
+/// On failure (including previous failed tile reads or writes),
+/// returns 0 and errno/errCause are set appropriately.
+int ImageFlush(Image img) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -91,6 +170,9 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// The histogram of the image is built by the first call, and kept up to
+/// date by ImageSetPixel, ImagePaste and ImageBlend (at the cost of the
+/// pixels they change), so that later calls take constant time.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
 /// Check if pixel position (x,y) is inside img.
@@ -99,6 +181,18 @@ int ImageValidPos(Image img, int x, int y) ;
 /// Check if rectangular area (x,y,w,h) is completely inside img.
 int ImageValidRect(Image img, int x, int y, int w, int h) ;
 
+/// Change tracking
+
+/// Get the rectangle of the pixels of img changed since the last call to
+/// ImageClearDirty (or since img was created): its bounding box is stored
+/// in *x, *y, *w, *h, and 1 (true) is returned.  If no pixels changed,
+/// returns 0 (false) and *x, *y, *w, *h are set to 0.
+/// (The rectangle may include pixels that did not change.)
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) ;
+
+/// Mark all pixels of img as unchanged (see ImageDirtyRect).
+void ImageClearDirty(Image img) ;
+
 /// Pixel get & set operations
 
 /// These are the primitive operations to access and modify a single pixel
@@ -147,7 +241,7 @@ void ImageBrighten(Image img, double factor) ;
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counter-clockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -205,12 +299,505 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Image pyramids
+
+/// Build a pyramid of successively halved versions of img.
+/// Level 0 is img itself and level l+1 is obtained from level l by 2x2
+/// box downsampling (each pixel is the rounded mean of a 2x2 block).
+/// At most levels levels (and no more than 16) are built, stopping before
+/// any dimension would become 0.  The pyramid refers to img as level 0, so img must not be
+/// modified or destroyed while the pyramid is in use.
+/// Requires: levels >= 1.
+/// On success, a new pyramid is returned.
+/// (The caller is responsible for destroying it with ImageDestroyPyramid!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Pyramid ImageBuildPyramid(Image img, int levels) ;
+
+/// Number of levels of a pyramid (at least 1).
+int ImagePyramidLevels(Pyramid p) ;
+
+/// Image at a given level of a pyramid (level 0 is the original image).
+/// The image belongs to the pyramid: it must not be destroyed by the caller.
+/// Requires: 0 <= level < ImagePyramidLevels(p).
+Image ImagePyramidLevel(Pyramid p, int level) ;
+
+/// Destroy the pyramid pointed to by (*pp), except for level 0.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImageDestroyPyramid(Pyramid* pp) ;
+
+/// Locate a subimage inside another image, using a pyramid of the larger
+/// image for a coarse-to-fine search.
+/// Searches for img2 inside level 0 of pyr (the image it was built from),
+/// with the same result as ImageLocateSubImage(level0, px, py, img2).
+/// The search starts at the coarsest level where img2 still covers at least
+/// 4x4 pixels, where only positions whose downsampled pixels match exactly
+/// are refined at each finer level, down to an exact verification at level 0.
+/// Coarse rows are searched in parallel.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateSubImagePyramid(Pyramid pyr, int* px, int* py, Image img2) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), rounded to nearest.
 /// The image is changed in-place.
+/// Common small windows (3x3, 5x5, 7x7, 3x1 and 1x3) use kernels
+/// specialized for their size; others use a summed-area table.
+/// Rows are blurred in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Bring up to date a blurred copy of an image, after changes to a part
+/// of it.  dst must hold img blurred as by ImageBlur(dx, dy) when the dirty
+/// rectangle of img was last cleared (see ImageDirtyRect); for instance, a
+/// new black image, as all pixels of a new img are dirty.
+/// Only the pixels of dst whose windows meet the dirty rectangle are
+/// recomputed, from the dirty rectangle dilated by (2dx, 2dy): the cost
+/// depends on the size of the changes, not of the image.
+/// On success, the dirty rectangle of img is cleared.
+/// Requires: dst has the size of img, and is not img.
+/// On failure (out of memory), dst and img are left unchanged and errCause is set.
+void ImageBlurDirty(Image img, Image dst, int dx, int dy) ;
+
+/// Morphology
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+/// The cost per pixel does not depend on the rectangle size
+/// (van Herk/Gil-Werman algorithm), and rows are processed in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), as in ImageErode.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle: erode, then dilate.
+/// This removes bright details smaller than the rectangle.
+/// On failure (out of memory), errCause is set, and the image is left
+/// unchanged or eroded.
+void ImageOpening(Image img, int dx, int dy) ;
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle: dilate, then erode.
+/// This removes dark details smaller than the rectangle.
+/// On failure (out of memory), errCause is set, and the image is left
+/// unchanged or dilated.
+void ImageClosing(Image img, int dx, int dy) ;
+
+/// Rank filters
+
+/// Apply a rank filter to an image.
+/// Each pixel is substituted by the percentile of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image), that is,
+/// the level of rank (percent*(n-1))/100 (rounded down), from 0, among the
+/// n pixels in increasing order: percent 0 gives the minimum (as
+/// ImageErode), 50 the median, and 100 the maximum (as ImageDilate).
+/// Requires: 0 <= percent <= 100, and (2dx+1)*(2dy+1) <= 65535.
+/// The image is changed in-place.
+/// The cost per pixel grows slowly with the rectangle size (histograms
+/// are slid along rows and columns), and stripes are filtered in parallel.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageRankFilter(Image img, int dx, int dy, int percent) ;
+
+/// Apply a median filter to an image: ImageRankFilter with percent 50.
+/// (For an even number of pixels in the rectangle, the lower median.)
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void ImageMedian(Image img, int dx, int dy) ;
+
+/// Connected components
+
+// A connected component of the foreground of an image (see ImageBlobs)
+typedef struct {
+  int area;             // number of pixels
+  int x, y, w, h;       // bounding box
+  double cx, cy;        // centroid (mean coordinates of the pixels)
+} ImageBlob;
+
+/// Find the connected components (blobs) of the foreground of an image:
+/// the pixels with a non-zero level, as left by ImageThreshold.
+/// connectivity is 4 (pixels touch their horizontal and vertical neighbors)
+/// or 8 (diagonal neighbors too).
+/// The area, bounding box and centroid of each blob are stored in a new
+/// array, pointed to by *blobs, in the raster order of their first pixels.
+/// (The caller is responsible for freeing the array!)
+/// Rows are scanned and labeled in parallel.
+/// On success, returns the number of blobs (possibly 0).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageBlobs(Image img, int connectivity, ImageBlob** blobs) ;
+
+/// Resampling
+
+// Resampling modes for ImageResize
+enum { RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_AREA };
+
+/// Resize an image to width x height pixels.
+/// mode selects the resampling method:
+///   RESIZE_NEAREST: each pixel copies the nearest source pixel;
+///   RESIZE_BILINEAR: bilinear interpolation of the 4 nearest source pixels;
+///   RESIZE_AREA: mean of the source pixels covered by each pixel (best for
+///     downscaling).
+/// Rows are computed in parallel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int width, int height, int mode) ;
+
+/// Apply an affine transform to an image.
+/// The transform maps each point (x, y) of img to the point
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of the result, which has the same size as img.  Coordinates are
+/// continuous, with (0, 0) at the top-left corner of the image (so the
+/// center of pixel (x, y) is at (x+0.5, y+0.5)).
+/// Each pixel of the result is interpolated (bilinearly) from the pixels of
+/// img around the point that maps to its center; pixels that come from
+/// outside img get level fill.  Rows are computed in parallel.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a transform that is not invertible, or maps the
+/// image too far away), returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double m[6], uint8 fill) ;
+
+/// Rotate an image by an arbitrary angle, in degrees, counter-clockwise
+/// (as ImageRotate, for 90), about the center of the image.
+/// The result has the same size as img: corners that leave the image are
+/// cut, and uncovered pixels get level fill.  See ImageAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, uint8 fill) ;
+
+/// 16-bit images
+
+/// Image16 holds images with maxval up to 65535, as produced by scanners
+/// and cameras.  They support the same operations as 8-bit images (with
+/// the same semantics), but are always dense (never tiled).
+
+/// Create a new black 16-bit image.
+/// Requires: width and height must be non-negative, 0 < maxval <= 65535.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Create(int width, int height, int maxval) ;
+
+/// Destroy the 16-bit image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void Image16Destroy(Image16* imgp) ;
+
+/// Load a raw PGM file into a 16-bit image.
+/// Any maxval up to 65535 is accepted: with maxval > 255, each pixel takes
+/// two bytes, most significant first (as specified by the PGM format).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Load(const char* filename) ;
+
+/// Save a 16-bit image to a PGM file.
+/// With maxval > 255, each pixel takes two bytes, most significant first;
+/// otherwise, one byte (the same file ImageSave would write).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int Image16Save(Image16 img, const char* filename) ;
+
+/// Convert an 8-bit image to a 16-bit image, with the same pixel values
+/// and maxval.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 ImageTo16(Image img) ;
+
+/// Convert a 16-bit image to an 8-bit image.
+/// If maxval <= 255, pixel values and maxval are kept.  Otherwise, pixels
+/// are scaled (with rounding) to maxval 255.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image Image16To8(Image16 img) ;
+
+/// Get 16-bit image width
+int Image16Width(Image16 img) ;
+
+/// Get 16-bit image height
+int Image16Height(Image16 img) ;
+
+/// Get 16-bit image maximum gray level
+int Image16Maxval(Image16 img) ;
+
+/// Find the minimum and maximum gray levels in a 16-bit image.
+/// (Both are 0 for an empty image.)
+void Image16Stats(Image16 img, uint16_t* min, uint16_t* max) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside a 16-bit img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) ;
+
+/// Get the pixel (level) at position (x,y) of a 16-bit image.
+uint16_t Image16GetPixel(Image16 img, int x, int y) ;
+
+/// Set the pixel at position (x,y) of a 16-bit image to new level.
+void Image16SetPixel(Image16 img, int x, int y, uint16_t level) ;
+
+/// Transform a 16-bit image to its negative (in-place).
+void Image16Negative(Image16 img) ;
+
+/// Apply threshold to a 16-bit image (in-place), as in ImageThreshold.
+void Image16Threshold(Image16 img, uint16_t thr) ;
+
+/// Brighten a 16-bit image by a factor (in-place), as in ImageBrighten.
+void Image16Brighten(Image16 img, double factor) ;
+
+/// Rotate a 16-bit image, as in ImageRotate.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Rotate(Image16 img) ;
+
+/// Mirror a 16-bit image (flip left-right), as in ImageMirror.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Mirror(Image16 img) ;
+
+/// Crop a rectangular subimage from a 16-bit image, as in ImageCrop.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) ;
+
+/// Paste 16-bit img2 into position (x, y) of img1 (in-place).
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Blend 16-bit img2 into position (x, y) of img1 (in-place), as in ImageBlend.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) ;
+
+/// Compare a 16-bit image to a subimage of a larger one, as in ImageMatchSubImage.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Locate a subimage inside a larger 16-bit image, as in ImageLocateSubImage.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) ;
+
+/// Blur a 16-bit image by a applying a (2dx+1)x(2dy+1) mean filter
+/// (in-place), as in ImageBlur.  The mean of the pixels inside the image
+/// is rounded to nearest.  Sums are accumulated in 64 bits.
+/// On failure (out of memory), the image is left unchanged and errCause is set.
+void Image16Blur(Image16 img, int dx, int dy) ;
+
+/// Run-length encoded images
+///
+/// An RLEImage stores each row as runs of pixels with the same level, so
+/// its memory and the cost of its operations grow with the number of level
+/// changes in the rows, rather than with the area.  This suits thresholded
+/// (0/maxval) and other sparse images.
+
+/// Convert an image to run-length encoded form.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageFromImage(Image img) ;
+
+/// Convert a run-length encoded image to a (dense) image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image RLEImageToImage(RLEImage img) ;
+
+/// Destroy the RLE image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void RLEImageDestroy(RLEImage* imgp) ;
+
+int RLEImageWidth(RLEImage img) ;
+int RLEImageHeight(RLEImage img) ;
+int RLEImageMaxval(RLEImage img) ;
+
+/// Number of runs in an RLE image (its memory use is proportional).
+size_t RLEImageRuns(RLEImage img) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside an RLE img.
+int RLEImageValidRect(RLEImage img, int x, int y, int w, int h) ;
+
+/// Get the pixel (level) at position (x,y) of an RLE image.
+/// (The run is found by binary search in the row.)
+uint8 RLEImageGetPixel(RLEImage img, int x, int y) ;
+
+/// Find the minimum and maximum gray levels in an RLE image, as in
+/// ImageStats.
+void RLEImageStats(RLEImage img, uint8* min, uint8* max) ;
+
+/// Transform an RLE image to its photographic negative, as in ImageNegative.
+void RLEImageNegative(RLEImage img) ;
+
+/// Mirror an RLE image = flip left<->right, as in ImageMirror.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageMirror(RLEImage img) ;
+
+/// Crop a rectangular subimage from an RLE image, as in ImageCrop.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageCrop(RLEImage img, int x, int y, int w, int h) ;
+
+/// Paste RLE img2 into position (x, y) of RLE img1, as in ImagePaste.
+/// The runs of img1 are rebuilt.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// On failure (out of memory), img1 is left unchanged and errCause is set.
+void RLEImagePaste(RLEImage img1, int x, int y, RLEImage img2) ;
+
+/// Compare an RLE image to a subimage of a larger one, as in
+/// ImageMatchSubImage.  Rows are compared run by run.
+int RLEImageMatchSubImage(RLEImage img1, int x, int y, RLEImage img2) ;
+
+/// Binary images
+///
+/// A BitImage holds a thresholded image with one bit per pixel (8 times
+/// less memory than an Image), and compares rows 64 pixels at a time.
+
+/// Threshold an image into a new binary image, with one bit per pixel.
+/// Pixels with level>=thr are foreground (white), the others background,
+/// as in ImageThreshold.  Pixels are packed 64 at a time.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageFromImage(Image img, uint8 thr) ;
+
+/// Unpack a binary image into a new image, with levels 0 (background) and
+/// maxval (foreground), where maxval is that of the thresholded image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage img) ;
+
+/// Destroy the binary image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void BitImageDestroy(BitImage* imgp) ;
+
+int BitImageWidth(BitImage img) ;
+int BitImageHeight(BitImage img) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside a binary img.
+int BitImageValidRect(BitImage img, int x, int y, int w, int h) ;
+
+/// Get the pixel at position (x,y) of a binary image: 1 for foreground,
+/// 0 for background.
+int BitImageGetPixel(BitImage img, int x, int y) ;
+
+/// Crop a rectangular subimage from a binary image, as in ImageCrop.
+/// Rows are copied a word at a time.
+/// Requires: The rectangle must be inside the original image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCrop(BitImage img, int x, int y, int w, int h) ;
+
+/// Paste binary img2 into position (x, y) of binary img1, as in ImagePaste.
+/// Rows are copied a word at a time.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) ;
+
+/// Compare a binary image to a subimage of a larger one, allowing some
+/// differences: returns 1 (true) if img2 and the subimage of img1 at
+/// position (x, y) differ in at most maxdiff pixels (their Hamming
+/// distance), or 0 otherwise.  maxdiff = 0 gives ImageMatchSubImage.
+/// Rows are compared 64 pixels at a time, with XOR and popcount, and the
+/// comparison stops as soon as there are too many differences.
+/// Requires: img2 must fit inside img1 at position (x, y), maxdiff >= 0.
+int BitImageMatchSubImage(BitImage img1, int x, int y, BitImage img2, int maxdiff) ;
+
+/// Locate a subimage inside a larger binary image, allowing some
+/// differences (see BitImageMatchSubImage).
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 (true) and the position of the first
+/// match (in raster order) is stored in *px and *py.
+/// If no match is found, returns 0 (false) and *px, *py are left untouched.
+/// Requires: maxdiff >= 0.
+int BitImageLocateSubImage(BitImage img1, int* px, int* py, BitImage img2, int maxdiff) ;
+
+/// Image sequences
+
+/// An ImageSeq reads raw PGM (P5) frames of the same size, concatenated in
+/// one file or stream, into a fixed ring of frame buffers: after the first
+/// frame, reading a frame allocates nothing, and the last nframes frames
+/// stay available for differencing.
+
+/// Open a sequence of frames for reading.
+///   filename: the file (or FIFO) holding the frames, or "-" for standard
+///     input.
+///   nframes: the number of frames kept in the ring (at least 1).
+/// No frame is read until ImageSeqNext.
+/// On success, a new sequence is returned.
+/// (The caller is responsible for closing the returned sequence!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageSeq ImageSeqOpen(const char* filename, int nframes) ;
+
+/// Close the sequence pointed to by (*seqp), destroying its frames.
+/// If (*seqp)==NULL, no operation is performed.
+/// Ensures: (*seqp)==NULL.
+void ImageSeqClose(ImageSeq* seqp) ;
+
+/// Read the next frame of the sequence into the ring.
+/// All frames must have the same size (that of the first one).
+/// On success, returns the frame, which is owned by the sequence: it may
+/// be read or modified, but not destroyed, and it is overwritten by the
+/// nframes-th next call.
+/// At the end of the sequence, returns NULL, with errno = 0 and errCause
+/// "End of sequence".
+/// On failure, returns NULL and errno/errCause are set accordingly; the
+/// rest of the sequence cannot be read.
+Image ImageSeqNext(ImageSeq seq) ;
+
+/// Get a frame read before: back = 0 is the last frame returned by
+/// ImageSeqNext, 1 the one before it, and so on.
+/// Requires: 0 <= back < nframes, and back < ImageSeqCount(seq).
+Image ImageSeqFrame(ImageSeq seq, int back) ;
+
+/// Get the number of frames read from the sequence so far.
+long ImageSeqCount(ImageSeq seq) ;
+
+/// Returns 1 (true) once ImageSeqNext has reached the end of the sequence,
+/// or 0 (false) before that or after a failure.
+int ImageSeqEnded(ImageSeq seq) ;
+
+/// Absolute difference: set each pixel of dst to |img1 - img2|.
+/// dst may be img1 or img2.  dst keeps its maxval.
+/// This modifies dst in-place: no allocation involved.
+/// Requires: the three images have the same size.
+void ImageAbsDiff(Image dst, Image img1, Image img2) ;
+
+/// Running average: move each pixel of bg towards the same pixel of img,
+/// by a fraction alpha of their difference: bg = (1-alpha)*bg + alpha*img.
+/// Applied to each frame of a sequence, this keeps in bg an exponentially
+/// weighted average of the frames: the background, where moving objects
+/// fade out.  alpha is rounded to a multiple of 1/256, and the result to
+/// the nearest level, so differences below 128/(256*alpha) levels do not
+/// move the background.
+/// This modifies bg in-place: no allocation involved.
+/// Requires: bg and img have the same size, 0.0 <= alpha <= 1.0.
+void ImageAccumulate(Image bg, Image img, double alpha) ;
+
+/// Motion mask: set each pixel of mask to its maxval where img and bg
+/// differ by more than thr, and to 0 elsewhere.
+/// mask may be img or bg.
+/// Returns the number of moving pixels (those set to maxval).
+/// This modifies mask in-place: no allocation involved.
+/// Requires: the three images have the same size.
+long ImageMotion(Image mask, Image img, Image bg, uint8 thr) ;
+
 #endif
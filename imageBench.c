@@ -0,0 +1,459 @@
+// imageBench - Microbenchmarks for the image8bit module.
+//
+// This program times every public image8bit operation on synthetic
+// images of several sizes and reports, for each (operation, size) pair,
+// the median time over a number of repetitions, together with the
+// corresponding throughput in pixels/second and bytes/second.
+// Results may also be written in JSON, for regression tracking.
+//
+// It also works as a performance regression gate: the raw samples of a run
+// may be saved to a baseline file (-b), and a later run may be compared
+// against it (-c).  The gate fails when the throughput of any operation
+// drops by more than a given percentage AND a one-sided Mann-Whitney U test
+// over the repetitions says that the slowdown is statistically significant.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+#include <math.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-r REPS] [-s WxH]... [-f FILTER] [-o FILE] [-t TMPFILE]\n"
+    "                  [-b BASELINE | -c BASELINE [-p PCT] [-a ALPHA]]\n"
+    "  Time image8bit operations on synthetic images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -r REPS     Repetitions per measurement (default 5); the median is reported\n"
+    "  -s WxH      Add an image size (default: 256x256 1024x1024 3840x2160)\n"
+    "  -f FILTER   Only run operations whose name starts with FILTER\n"
+    "  -o FILE     Also write results to FILE in JSON format (- for stdout)\n"
+    "  -t TMPFILE  Scratch file for load/save (default /tmp/imageBench.pgm)\n"
+    "\n"
+    "REGRESSION GATE:\n"
+    "  -b FILE     Save the samples of this run as a baseline in FILE\n"
+    "  -c FILE     Compare this run against the baseline in FILE;\n"
+    "              exit with status 4 if any operation regressed\n"
+    "  -p PCT      Maximum tolerated throughput drop, in percent (default 10)\n"
+    "  -a ALPHA    Significance level of the Mann-Whitney test (default 0.05)\n"
+    "\n"
+    ;
+
+// Maximum number of image sizes and repetitions accepted
+#define MAXSIZES 16
+#define MAXREPS 1000
+
+// Benchmark context: the images and parameters shared by all operations
+// for one image size.
+typedef struct {
+  Image src;            // synthetic input image, never modified
+  Image work;           // scratch copy of src, for in-place operations
+  Image patch;          // bottom-right corner of src, for paste/blend/locate
+  const char* tmpfile;  // scratch file for load/save
+  int dx, dy;           // blur window
+} BenchCtx;
+
+// An operation to benchmark.
+// run() performs the timed work and may return a new image, which is
+// destroyed outside the timed region.
+// pixfactor and bytefactor give the number of pixels processed and bytes
+// moved, relative to the area of src (the patch has 1/16 of that area).
+typedef struct {
+  const char* name;
+  Image (*run)(BenchCtx* c);
+  int inplace;          // reset work from src before each repetition
+  double pixfactor;
+  double bytefactor;
+  int dx, dy;           // blur window, if relevant
+} BenchOp;
+
+static Image runLoad(BenchCtx* c) {
+  Image img = ImageLoad(c->tmpfile);
+  if (img == NULL) error(3, errno, "Loading %s: %s", c->tmpfile, ImageErrMsg());
+  return img;
+}
+
+static Image runSave(BenchCtx* c) {
+  if (ImageSave(c->src, c->tmpfile) == 0)
+    error(3, errno, "Saving %s: %s", c->tmpfile, ImageErrMsg());
+  return NULL;
+}
+
+static Image runNeg(BenchCtx* c) { ImageNegative(c->work); return NULL; }
+static Image runThr(BenchCtx* c) { ImageThreshold(c->work, 128); return NULL; }
+static Image runBri(BenchCtx* c) { ImageBrighten(c->work, 1.3); return NULL; }
+static Image runRotate(BenchCtx* c) { return ImageRotate(c->src); }
+static Image runMirror(BenchCtx* c) { return ImageMirror(c->src); }
+static Image runRotate30(BenchCtx* c) { return ImageRotateAngle(c->src, 30.0, 0); }
+
+static Image runCrop(BenchCtx* c) {
+  int w = ImageWidth(c->src);
+  int h = ImageHeight(c->src);
+  return ImageCrop(c->src, w/4, h/4, w/2, h/2);
+}
+
+static Image runPaste(BenchCtx* c) {
+  ImagePaste(c->work, 0, 0, c->patch);
+  return NULL;
+}
+
+static Image runBlend(BenchCtx* c) {
+  ImageBlend(c->work, 0, 0, c->patch, 0.33);
+  return NULL;
+}
+
+static Image runLocate(BenchCtx* c) {
+  int x, y;
+  if (!ImageLocateSubImage(c->src, &x, &y, c->patch))
+    error(3, 0, "locate: patch not found");
+  return NULL;
+}
+
+static Image runBlur(BenchCtx* c) { ImageBlur(c->work, c->dx, c->dy); return NULL; }
+static Image runErode(BenchCtx* c) { ImageErode(c->work, c->dx, c->dy); return NULL; }
+static Image runMedian(BenchCtx* c) { ImageMedian(c->work, c->dx, c->dy); return NULL; }
+
+static Image runBlobs(BenchCtx* c) {
+  ImageBlob* blobs;
+  if (ImageBlobs(c->src, 8, &blobs) < 0) error(3, errno, "blobs: %s", ImageErrMsg());
+  free(blobs);
+  return NULL;
+}
+
+static const BenchOp OPS[] = {
+  // name       run        inplace pix   bytes  dx  dy
+  {"save",      runSave,      0, 1.0,   1.0,    0,  0},
+  {"load",      runLoad,      0, 1.0,   1.0,    0,  0},
+  {"neg",       runNeg,       1, 1.0,   2.0,    0,  0},
+  {"thr",       runThr,       1, 1.0,   2.0,    0,  0},
+  {"bri",       runBri,       1, 1.0,   2.0,    0,  0},
+  {"rotate",    runRotate,    0, 1.0,   2.0,    0,  0},
+  {"mirror",    runMirror,    0, 1.0,   2.0,    0,  0},
+  {"rotate30",  runRotate30,  0, 1.0,   2.0,    0,  0},
+  {"crop",      runCrop,      0, 0.25,  0.5,    0,  0},
+  {"paste",     runPaste,     1, 0.0625, 0.125, 0,  0},
+  {"blend",     runBlend,     1, 0.0625, 0.1875, 0, 0},
+  {"locate",    runLocate,    0, 1.0,   1.0,    0,  0},
+  {"blur1x1",   runBlur,      1, 1.0,   2.0,    1,  1},
+  {"blur3x3",   runBlur,      1, 1.0,   2.0,    3,  3},
+  {"blur7x7",   runBlur,      1, 1.0,   2.0,    7,  7},
+  {"blur15x15", runBlur,      1, 1.0,   2.0,   15, 15},
+  {"blur31x0",  runBlur,      1, 1.0,   2.0,   31,  0},
+  {"blur0x31",  runBlur,      1, 1.0,   2.0,    0, 31},
+  {"erode1x1",  runErode,     1, 1.0,   2.0,    1,  1},
+  {"erode15x15", runErode,    1, 1.0,   2.0,   15, 15},
+  {"median1x1", runMedian,    1, 1.0,   2.0,    1,  1},
+  {"median15x15", runMedian,  1, 1.0,   2.0,   15, 15},
+  {"blobs",     runBlobs,     0, 1.0,   1.0,    0,  0},
+};
+#define NUMOPS (int)(sizeof(OPS)/sizeof(OPS[0]))
+
+// Fill img with a deterministic pattern: a diagonal gradient plus noise.
+// The noise makes mismatches in locate happen early, as in real images.
+static void fillSynthetic(Image img) {
+  unsigned int s = 2463534242u;  // xorshift32 state
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+      ImageSetPixel(img, x, y, (uint8)((x + y + (s & 63)) & 0xFF));
+    }
+  }
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double da = *(const double*)a;
+  double db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+// Median of n sorted samples
+static double median(const double* v, int n) {
+  return (n % 2) ? v[n/2] : 0.5*(v[n/2 - 1] + v[n/2]);
+}
+
+/// Baseline files
+
+// A baseline file has the same layout as the InstrPrint output:
+// a header line starting with '#', followed by one line per measurement
+// with tab-separated fields: op, width, height, reps, and the time samples.
+
+// One baseline measurement
+typedef struct {
+  char op[32];
+  int width, height;
+  int reps;
+  double samples[MAXREPS];
+} Baseline;
+
+// Write the header of a baseline file
+static void baselineHeader(FILE* f) {
+  fprintf(f, "#%14.15s\t%7s\t%7s\t%5s\t%s\n", "op", "width", "height", "reps", "samples(s)");
+}
+
+// Append one measurement to a baseline file
+static void baselineWrite(FILE* f, const char* op, int w, int h,
+                          const double* samples, int reps) {
+  fprintf(f, "%15.15s\t%7d\t%7d\t%5d", op, w, h, reps);
+  for (int r = 0; r < reps; r++)
+    fprintf(f, "\t%.9f", samples[r]);
+  fputc('\n', f);
+}
+
+// Read all measurements from a baseline file.
+// Returns the number of entries read into a new array (*bp), or -1 on error.
+static int baselineRead(const char* filename, Baseline** bp) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) return -1;
+  int n = 0, cap = 0;
+  Baseline* b = NULL;
+  int ok = 1;
+  int c;
+  while (ok && (c = fgetc(f)) != EOF) {
+    if (c == '#' || c == '\n') {  // skip header or empty line
+      while (c != '\n' && c != EOF) c = fgetc(f);
+      continue;
+    }
+    ungetc(c, f);
+    if (n == cap) {
+      cap = cap ? 2*cap : 32;
+      Baseline* nb = (Baseline*)realloc(b, cap*sizeof(Baseline));
+      if (nb == NULL) { ok = 0; break; }
+      b = nb;
+    }
+    Baseline* e = &b[n];
+    ok = fscanf(f, "%31s %d %d %d", e->op, &e->width, &e->height, &e->reps) == 4 &&
+         0 < e->reps && e->reps <= MAXREPS;
+    for (int r = 0; ok && r < e->reps; r++)
+      ok = fscanf(f, "%lf", &e->samples[r]) == 1;
+    while (ok && (c = fgetc(f)) != '\n' && c != EOF) ;  // rest of line
+    n += ok;
+  }
+  fclose(f);
+  if (!ok) {
+    free(b);
+    errno = EINVAL;
+    return -1;
+  }
+  *bp = b;
+  return n;
+}
+
+// Find the baseline measurement for (op, w, h), or NULL
+static const Baseline* baselineFind(const Baseline* b, int n, const char* op, int w, int h) {
+  for (int i = 0; i < n; i++)
+    if (b[i].width == w && b[i].height == h && strcmp(b[i].op, op) == 0)
+      return &b[i];
+  return NULL;
+}
+
+/// Statistics
+
+// One-sided Mann-Whitney U test.
+// Tests whether the samples in cur tend to be LARGER (slower) than those in
+// base, and returns the p-value of that hypothesis, using the normal
+// approximation with continuity and tie corrections.
+// Both arrays must be sorted.
+static double mannWhitneyGreater(const double* cur, int n1, const double* base, int n2) {
+  // U counts the pairs (i,j) with cur[i] > base[j], ties counting 1/2
+  double u = 0.0;
+  for (int i = 0; i < n1; i++)
+    for (int j = 0; j < n2; j++)
+      u += (cur[i] > base[j]) ? 1.0 : (cur[i] == base[j]) ? 0.5 : 0.0;
+
+  // Tie correction: sum of (t^3 - t) over groups of t equal values
+  // in the pooled (sorted) sample.
+  int n = n1 + n2;
+  double ties = 0.0;
+  int i = 0, j = 0;
+  while (i < n1 || j < n2) {
+    double v = (j >= n2 || (i < n1 && cur[i] <= base[j])) ? cur[i] : base[j];
+    int t = 0;
+    while (i < n1 && cur[i] == v) { i++; t++; }
+    while (j < n2 && base[j] == v) { j++; t++; }
+    ties += (double)t*t*t - t;
+  }
+
+  double mean = 0.5*n1*n2;
+  double var = n1*n2/12.0 * ((n + 1) - ties/((double)n*(n - 1)));
+  if (var <= 0.0) return (u > mean) ? 0.0 : 1.0;
+  double z = (u - mean - 0.5) / sqrt(var);
+  return 0.5*erfc(z/sqrt(2.0));
+}
+
+int main(int ac, char* av[]) {
+  int reps = 5;
+  int nsizes = 0;
+  int sizes[MAXSIZES][2];
+  const char* filter = "";
+  const char* jsonfile = NULL;
+  const char* tmpfile = "/tmp/imageBench.pgm";
+  const char* savefile = NULL;
+  const char* checkfile = NULL;
+  double maxdrop = 10.0;
+  double alpha = 0.05;
+
+  for (int k = 1; k < ac; k++) {
+    if (strcmp(av[k], "-r") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%d", &reps) != 1 || reps < 1 || reps > MAXREPS)
+        error(1, 0, "Invalid repetitions: %s", av[k]);
+    } else if (strcmp(av[k], "-s") == 0 && k+1 < ac) {
+      if (nsizes >= MAXSIZES) error(1, 0, "Too many sizes");
+      int* sz = sizes[nsizes];
+      if (sscanf(av[++k], "%dx%d", &sz[0], &sz[1]) != 2 || sz[0] < 16 || sz[1] < 16)
+        error(1, 0, "Invalid size (minimum 16x16): %s", av[k]);
+      nsizes++;
+    } else if (strcmp(av[k], "-f") == 0 && k+1 < ac) {
+      filter = av[++k];
+    } else if (strcmp(av[k], "-o") == 0 && k+1 < ac) {
+      jsonfile = av[++k];
+    } else if (strcmp(av[k], "-t") == 0 && k+1 < ac) {
+      tmpfile = av[++k];
+    } else if (strcmp(av[k], "-b") == 0 && k+1 < ac) {
+      savefile = av[++k];
+    } else if (strcmp(av[k], "-c") == 0 && k+1 < ac) {
+      checkfile = av[++k];
+    } else if (strcmp(av[k], "-p") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%lf", &maxdrop) != 1 || maxdrop < 0.0)
+        error(1, 0, "Invalid percentage: %s", av[k]);
+    } else if (strcmp(av[k], "-a") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%lf", &alpha) != 1 || alpha <= 0.0 || alpha >= 1.0)
+        error(1, 0, "Invalid significance level: %s", av[k]);
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (nsizes == 0) {
+    const int defaults[][2] = { {256, 256}, {1024, 1024}, {3840, 2160} };
+    for (nsizes = 0; nsizes < 3; nsizes++) {
+      sizes[nsizes][0] = defaults[nsizes][0];
+      sizes[nsizes][1] = defaults[nsizes][1];
+    }
+  }
+
+  if (savefile != NULL && checkfile != NULL)
+    error(1, 0, "Options -b and -c are mutually exclusive");
+
+  Baseline* baseline = NULL;
+  int nbaseline = 0;
+  if (checkfile != NULL) {
+    nbaseline = baselineRead(checkfile, &baseline);
+    if (nbaseline < 0) error(2, errno, "Reading baseline %s", checkfile);
+  }
+  FILE* save = NULL;
+  if (savefile != NULL) {
+    save = fopen(savefile, "w");
+    if (save == NULL) error(2, errno, "%s", savefile);
+    baselineHeader(save);
+  }
+
+  ImageInit();
+
+  FILE* json = NULL;
+  if (jsonfile != NULL) {
+    json = strcmp(jsonfile, "-") == 0 ? stdout : fopen(jsonfile, "w");
+    if (json == NULL) error(2, errno, "%s", jsonfile);
+    fprintf(json, "{\n  \"bench\": \"image8bit\",\n  \"reps\": %d,\n  \"results\": [", reps);
+  }
+  FILE* report = (json == stdout) ? stderr : stdout;
+
+  fprintf(report, "# %-10s %11s %12s %12s %12s%s\n",
+          "op", "size", "median(s)", "Mpixel/s", "MB/s",
+          checkfile != NULL ? "      change    p-value" : "");
+  int nresults = 0;
+  int nregressions = 0;
+  double samples[MAXREPS];
+  for (int s = 0; s < nsizes; s++) {
+    int w = sizes[s][0];
+    int h = sizes[s][1];
+    BenchCtx c = { NULL, NULL, NULL, tmpfile, 0, 0 };
+    c.src = ImageCreate(w, h, PixMax);
+    c.work = ImageCreate(w, h, PixMax);
+    if (c.src == NULL || c.work == NULL)
+      error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+    fillSynthetic(c.src);
+    c.patch = ImageCrop(c.src, w - w/4, h - h/4, w/4, h/4);
+    if (c.patch == NULL) error(2, errno, "Creating patch: %s", ImageErrMsg());
+    runSave(&c);  // so that load has something to read, even if save is filtered out
+
+    double area = (double)w * h;
+    for (int i = 0; i < NUMOPS; i++) {
+      const BenchOp* op = &OPS[i];
+      if (strncmp(op->name, filter, strlen(filter)) != 0) continue;
+      c.dx = op->dx;
+      c.dy = op->dy;
+      for (int r = 0; r < reps; r++) {
+        if (op->inplace) ImagePaste(c.work, 0, 0, c.src);
+        double t0 = wall_time();
+        Image out = op->run(&c);
+        samples[r] = wall_time() - t0;
+        if (out == NULL && !op->inplace && op->run != runSave && op->run != runLocate &&
+            op->run != runBlobs)
+          error(3, errno, "%s: %s", op->name, ImageErrMsg());
+        ImageDestroy(&out);
+      }
+      qsort(samples, reps, sizeof(double), cmpDouble);
+      double med = median(samples, reps);
+      double pixels = op->pixfactor * area;
+      double bytes = op->bytefactor * area;
+      // Guard against timer resolution on tiny images
+      double t = med > 1e-9 ? med : 1e-9;
+      fprintf(report, "%-12s %5dx%-5d %12.6f %12.2f %12.2f",
+              op->name, w, h, med, pixels/t*1e-6, bytes/t*1e-6);
+      if (checkfile != NULL) {
+        const Baseline* b = baselineFind(baseline, nbaseline, op->name, w, h);
+        if (b == NULL) {
+          fprintf(report, "  (no baseline)");
+        } else {
+          // Throughput change, relative to the baseline median
+          double bmedian = median(b->samples, b->reps);
+          double change = 100.0*(bmedian/t - 1.0);
+          double p = mannWhitneyGreater(samples, reps, b->samples, b->reps);
+          int regressed = (-change > maxdrop) && (p < alpha);
+          fprintf(report, "  %+9.1f%%  %9.4f%s", change, p, regressed ? "  REGRESSION" : "");
+          nregressions += regressed;
+        }
+      }
+      fputc('\n', report);
+      if (save != NULL) baselineWrite(save, op->name, w, h, samples, reps);
+      if (json != NULL) {
+        fprintf(json, "%s\n    {\"op\": \"%s\", \"width\": %d, \"height\": %d, "
+                "\"pixels\": %.0f, \"bytes\": %.0f, \"median_s\": %.9f, "
+                "\"pixels_per_s\": %.1f, \"bytes_per_s\": %.1f, \"samples_s\": [",
+                nresults > 0 ? "," : "", op->name, w, h,
+                pixels, bytes, med, pixels/t, bytes/t);
+        for (int r = 0; r < reps; r++)
+          fprintf(json, "%s%.9f", r > 0 ? ", " : "", samples[r]);
+        fprintf(json, "]}");
+      }
+      nresults++;
+    }
+    ImageDestroy(&c.src);
+    ImageDestroy(&c.work);
+    ImageDestroy(&c.patch);
+  }
+  remove(tmpfile);
+
+  if (json != NULL) {
+    fprintf(json, "\n  ]\n}\n");
+    if (json != stdout) fclose(json);
+  }
+  if (save != NULL) fclose(save);
+  free(baseline);
+
+  if (nregressions > 0) {
+    fprintf(report, "# %d regression(s) beyond %.1f%% (alpha=%.3f)\n",
+            nregressions, maxdrop, alpha);
+    return 4;
+  }
+  return 0;
+}
@@ -0,0 +1,1550 @@
+// imageCheck - Self-contained tests for the image8bit module.
+//
+// This program runs named checks on synthetic images.  Each check compares
+// the results of some operations with straightforward reference code, or
+// with other operations that must give the same results, and reports any
+// difference.  It also writes synthetic images, which the tests of
+// imageTool in the Makefile use as inputs (so no download is needed).
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "image8bit.h"
+
+static const char* USAGE =
+    "USAGE: imageCheck CHECK...\n"
+    "       imageCheck -g FILE W H SEED\n"
+    "  Run the named checks of the image8bit module (all: every check),\n"
+    "  and exit with status 1 if any failed.\n"
+    "  With -g, write a synthetic WxH PGM image to FILE instead.\n"
+    "\n"
+    "CHECKS:\n"
+    ;
+
+// Number of failed conditions in the current check
+static int failures = 0;
+
+// Report a failure (at most a few per check) if cond is false.
+#define CHECK(cond, ...) \
+  do { \
+    if (!(cond)) { \
+      if (failures++ < 10) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+      } \
+    } \
+  } while (0)
+
+// Abort the program if img is NULL (as after an allocation failure).
+static Image need(Image img, const char* what) {
+  if (img == NULL) error(2, errno, "%s: %s", what, ImageErrMsg());
+  return img;
+}
+
+// A synthetic image: a diagonal ramp with some noise, and a grid of flat
+// blocks, so that smooth areas, edges and plateaus are all present.
+// The same arguments always give the same image.
+static Image synth(int w, int h, unsigned seed) {
+  Image img = need(ImageCreate(w, h, PixMax), "Creating image");
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      seed = seed*1103515245u + 12345u;
+      int level = (x*3 + y*5) % 192 + (int)((seed >> 16) & 63);
+      if ((x/24 + y/16) % 3 == 0) level = 40 + 60*((x/24) % 3);
+      ImageSetPixel(img, x, y, (uint8)level);
+    }
+  }
+  return img;
+}
+
+// Count the pixels of a and b that differ (or -1 if their sizes differ).
+static long diffPixels(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b))
+    return -1;
+  long n = 0;
+  for (int y = 0; y < ImageHeight(a); y++)
+    for (int x = 0; x < ImageWidth(a); x++)
+      n += ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y);
+  return n;
+}
+
+// A copy of img.
+static Image copy(Image img) {
+  return need(ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img)), "Copying");
+}
+
+// The name of a scratch file, unique to this process, ending in suffix.
+// (Returns a static buffer.)
+static const char* scratch(const char* suffix) {
+  static char name[256];
+  const char* dir = getenv("TMPDIR");
+  snprintf(name, sizeof name, "%s/imageCheck-%d%s", dir ? dir : "/tmp", (int)getpid(), suffix);
+  return name;
+}
+
+// Basic operations, on odd sizes, against reference loops.
+static void checkBasic(void) {
+  const int w = 37, h = 23;
+  Image img = synth(w, h, 1);
+
+  Image blk = need(ImageCreate(w, h, PixMax), "Creating image");
+  uint8 min, max;
+  ImageStats(blk, &min, &max);
+  CHECK(min == 0 && max == 0, "new image is not black: [%d, %d]", min, max);
+
+  CHECK(ImageValidRect(img, 0, 0, w, h), "whole image is not a valid rect");
+  CHECK(!ImageValidRect(img, -1, 0, 2, 2), "negative x accepted");
+  CHECK(!ImageValidRect(img, 0, -1, 2, 2), "negative y accepted");
+  CHECK(!ImageValidRect(img, 1, 0, w, h), "rect past the right accepted");
+
+  Image rot = need(ImageRotate(img), "Rotating");
+  CHECK(ImageWidth(rot) == h && ImageHeight(rot) == w, "rotate size");
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      CHECK(ImageGetPixel(rot, y, w-1-x) == ImageGetPixel(img, x, y),
+            "rotate (%d,%d)", x, y);
+
+  Image mir = need(ImageMirror(img), "Mirroring");
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      CHECK(ImageGetPixel(mir, w-1-x, y) == ImageGetPixel(img, x, y),
+            "mirror (%d,%d)", x, y);
+
+  Image crop = need(ImageCrop(img, 25, 3, 11, 7), "Cropping");
+  CHECK(ImageWidth(crop) == 11 && ImageHeight(crop) == 7, "crop size");
+  for (int y = 0; y < 7; y++)
+    for (int x = 0; x < 11; x++)
+      CHECK(ImageGetPixel(crop, x, y) == ImageGetPixel(img, 25+x, 3+y),
+            "crop (%d,%d)", x, y);
+
+  int px = -1, py = -1;
+  CHECK(ImageMatchSubImage(img, 25, 3, crop), "crop does not match");
+  CHECK(!ImageMatchSubImage(img, 24, 3, crop), "crop matches elsewhere");
+  CHECK(ImageLocateSubImage(img, &px, &py, crop) && px == 25 && py == 3,
+        "locate crop: (%d,%d)", px, py);
+
+  ImagePaste(blk, 20, 10, crop);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int in = 20 <= x && x < 31 && 10 <= y && y < 17;
+      CHECK(ImageGetPixel(blk, x, y) == (in ? ImageGetPixel(crop, x-20, y-10) : 0),
+            "paste (%d,%d)", x, y);
+    }
+
+  Image bl = copy(img);
+  ImageBlend(bl, 20, 10, crop, 0.25);
+  for (int y = 0; y < 7; y++)
+    for (int x = 0; x < 11; x++) {
+      int ref = (int)(0.75*ImageGetPixel(img, 20+x, 10+y) + 0.25*ImageGetPixel(crop, x, y) + 0.5);
+      CHECK(ImageGetPixel(bl, 20+x, 10+y) == ref, "blend (%d,%d)", x, y);
+    }
+
+  Image br = copy(img);
+  ImageBrighten(br, 3.0);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int ref = 3*ImageGetPixel(img, x, y);
+      CHECK(ImageGetPixel(br, x, y) == (ref > PixMax ? PixMax : ref),
+            "brighten (%d,%d)", x, y);
+    }
+
+  Image neg = copy(img);
+  ImageNegative(neg);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      CHECK(ImageGetPixel(neg, x, y) == PixMax - ImageGetPixel(img, x, y),
+            "negative (%d,%d)", x, y);
+
+  ImageDestroy(&img);
+  ImageDestroy(&blk);
+  ImageDestroy(&rot);
+  ImageDestroy(&mir);
+  ImageDestroy(&crop);
+  ImageDestroy(&bl);
+  ImageDestroy(&br);
+  ImageDestroy(&neg);
+  CHECK(img == NULL, "ImageDestroy did not clear the pointer");
+  ImageDestroy(&img);  // no-op
+}
+
+// Tiled images, with a cache smaller than the image, against in-memory ones.
+static void checkTiled(void) {
+  const int w = 700, h = 530;   // 3x3 tiles, partial ones on the edges
+  Image img = synth(w, h, 3);
+  const char* name = scratch(".pgm");
+  if (!ImageSave(img, name)) error(2, errno, "%s: %s", name, ImageErrMsg());
+
+  Image t = need(ImageOpenTiled(name, 4, 0), "Opening tiled");
+  CHECK(diffPixels(t, img) == 0, "tiled pixels differ");
+  Image patch = need(ImageCrop(img, 400, 300, 90, 70), "Cropping");
+  Image tpatch = need(ImageCrop(t, 400, 300, 90, 70), "Cropping tiled");
+  CHECK(diffPixels(tpatch, patch) == 0, "tiled crop differs");
+  int px = -1, py = -1;
+  CHECK(ImageLocateSubImage(t, &px, &py, patch) && px == 400 && py == 300,
+        "tiled locate: (%d,%d)", px, py);
+  Image mem = copy(img);
+  ImageBlur(t, 2, 3);
+  ImageBlur(mem, 2, 3);
+  CHECK(diffPixels(t, mem) == 0, "tiled blur differs");
+  ImageDestroy(&t);
+  ImageDestroy(&mem);
+
+  // Changes to writable tiled images are written back
+  t = need(ImageOpenTiled(name, 4, 1), "Opening tiled");
+  mem = copy(img);
+  ImagePaste(t, 250, 10, patch);
+  ImagePaste(mem, 250, 10, patch);
+  ImageNegative(t);
+  ImageNegative(mem);
+  CHECK(ImageFlush(t), "flush failed");
+  ImageDestroy(&t);
+  Image back = need(ImageLoad(name), "Loading");
+  CHECK(diffPixels(back, mem) == 0, "written back tiles differ");
+  ImageDestroy(&back);
+
+  // Headers are parsed as by ImageLoad, and only raw PGM is accepted
+  FILE* f = fopen(name, "w");
+  fprintf(f, "P5\n# comment\n2 # w\n2\n255\n");
+  fwrite("\001\002\003\004", 1, 4, f);
+  fclose(f);
+  t = ImageOpenTiled(name, 4, 0);
+  CHECK(t != NULL && ImageWidth(t) == 2 && ImageGetPixel(t, 1, 1) == 4,
+        "header with comments: %s", t ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&t);
+  f = fopen(name, "w");
+  fprintf(f, "P2 2 2 255\n1 2 3 4\n");
+  fclose(f);
+  t = ImageOpenTiled(name, 4, 0);
+  CHECK(t == NULL, "plain PGM opened as tiled");
+  ImageDestroy(&t);
+  f = fopen(name, "w");
+  fprintf(f, "P5 2 2 255\n\001\002\003");
+  fclose(f);
+  t = ImageOpenTiled(name, 4, 0);
+  CHECK(t == NULL, "short file opened as tiled");
+  ImageDestroy(&t);
+
+  unlink(name);
+  ImageDestroy(&img);
+  ImageDestroy(&patch);
+  ImageDestroy(&tpatch);
+  ImageDestroy(&mem);
+}
+
+// Pyramid levels against 2x2 means, and the pyramid search against
+// ImageLocateSubImage, for patches at all alignments, repeated or absent.
+static void checkPyramid(void) {
+  Image img = synth(301, 203, 4);
+  Pyramid pyr = ImageBuildPyramid(img, 8);
+  if (pyr == NULL) error(2, errno, "Building pyramid: %s", ImageErrMsg());
+  CHECK(ImagePyramidLevels(pyr) == 8, "levels: %d", ImagePyramidLevels(pyr));
+  CHECK(ImagePyramidLevel(pyr, 0) == img, "level 0 is not the image");
+  for (int l = 1; l < ImagePyramidLevels(pyr); l++) {
+    Image a = ImagePyramidLevel(pyr, l-1);
+    Image b = ImagePyramidLevel(pyr, l);
+    CHECK(ImageWidth(b) == ImageWidth(a)/2 && ImageHeight(b) == ImageHeight(a)/2,
+          "level %d size", l);
+    for (int y = 0; y < ImageHeight(b); y++)
+      for (int x = 0; x < ImageWidth(b); x++) {
+        int sum = ImageGetPixel(a, 2*x, 2*y) + ImageGetPixel(a, 2*x+1, 2*y) +
+                  ImageGetPixel(a, 2*x, 2*y+1) + ImageGetPixel(a, 2*x+1, 2*y+1);
+        CHECK(ImageGetPixel(b, x, y) == (sum + 2) / 4, "level %d (%d,%d)", l, x, y);
+      }
+  }
+  ImageDestroyPyramid(&pyr);
+
+  // A patch pasted twice: both searches must find the same (first) one
+  Image patch = need(ImageCrop(img, 33, 60, 40, 21), "Cropping");
+  ImagePaste(img, 250, 170, patch);
+  pyr = ImageBuildPyramid(img, 8);
+  if (pyr == NULL) error(2, errno, "Building pyramid: %s", ImageErrMsg());
+  const int pos[][2] = { {33, 60}, {34, 61}, {250, 170}, {0, 0}, {261, 182}, {100, 7} };
+  for (int i = 0; i < 6; i++) {
+    Image sub = need(ImageCrop(img, pos[i][0], pos[i][1], 40, 21), "Cropping");
+    int x1 = -1, y1 = -1, x2 = -1, y2 = -1;
+    int f1 = ImageLocateSubImage(img, &x1, &y1, sub);
+    int f2 = ImageLocateSubImagePyramid(pyr, &x2, &y2, sub);
+    CHECK(f1 && f2 && x1 == x2 && y1 == y2, "patch at (%d,%d): (%d,%d) vs pyramid (%d,%d)",
+          pos[i][0], pos[i][1], x1, y1, x2, y2);
+    ImageDestroy(&sub);
+  }
+  Image absent = copy(patch);
+  ImageNegative(absent);
+  int x = -1, y = -1;
+  CHECK(!ImageLocateSubImagePyramid(pyr, &x, &y, absent) && x == -1 && y == -1,
+        "absent patch found at (%d,%d)", x, y);
+  ImageDestroyPyramid(&pyr);
+  CHECK(pyr == NULL, "ImageDestroyPyramid did not clear the pointer");
+
+  ImageDestroy(&img);
+  ImageDestroy(&patch);
+  ImageDestroy(&absent);
+}
+
+// Bilinear sample of img at continuous point (x, y), pixel centers at
+// integer + 0.5, clamped to the borders.  Positions are truncated to 1/128
+// of a pixel, the precision of ImageResize.
+static double bilinear(Image img, double x, double y) {
+  x = floor((x - 0.5)*128) / 128;
+  y = floor((y - 0.5)*128) / 128;
+  int w = ImageWidth(img), h = ImageHeight(img);
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x > w - 1) x = w - 1;
+  if (y > h - 1) y = h - 1;
+  int x0 = (int)x, y0 = (int)y;
+  int x1 = x0 + 1 < w ? x0 + 1 : x0, y1 = y0 + 1 < h ? y0 + 1 : y0;
+  double fx = x - x0, fy = y - y0;
+  return (1-fy)*((1-fx)*ImageGetPixel(img, x0, y0) + fx*ImageGetPixel(img, x1, y0)) +
+         fy*((1-fx)*ImageGetPixel(img, x0, y1) + fx*ImageGetPixel(img, x1, y1));
+}
+
+// Resizing in each mode, against reference samplings.
+static void checkResize(void) {
+  Image img = synth(93, 60, 5);
+  const int modes[] = { RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_AREA };
+  for (int m = 0; m < 3; m++) {
+    Image same = need(ImageResize(img, 93, 60, modes[m]), "Resizing");
+    CHECK(diffPixels(same, img) == 0, "mode %d: same size is not a copy", modes[m]);
+    ImageDestroy(&same);
+  }
+
+  // Nearest: 2x up repeats pixels; area: 2x down of that gives them back
+  Image up = need(ImageResize(img, 186, 120, RESIZE_NEAREST), "Resizing");
+  for (int y = 0; y < 120; y++)
+    for (int x = 0; x < 186; x++)
+      CHECK(ImageGetPixel(up, x, y) == ImageGetPixel(img, x/2, y/2), "nearest (%d,%d)", x, y);
+  Image down = need(ImageResize(up, 93, 60, RESIZE_AREA), "Resizing");
+  CHECK(diffPixels(down, img) == 0, "area 2x down of nearest 2x up is not the original");
+  ImageDestroy(&up);
+  ImageDestroy(&down);
+
+  // Area: 3x down is the rounded mean of 3x3 blocks
+  down = need(ImageResize(img, 31, 20, RESIZE_AREA), "Resizing");
+  for (int y = 0; y < 20; y++)
+    for (int x = 0; x < 31; x++) {
+      int sum = 0;
+      for (int j = 0; j < 3; j++)
+        for (int i = 0; i < 3; i++) sum += ImageGetPixel(img, 3*x+i, 3*y+j);
+      CHECK(ImageGetPixel(down, x, y) == (sum + 4)/9, "area (%d,%d)", x, y);
+    }
+  ImageDestroy(&down);
+
+  // Bilinear, up and down by odd factors, within rounding
+  const int size[][2] = { {157, 100}, {50, 33} };
+  for (int k = 0; k < 2; k++) {
+    int w = size[k][0], h = size[k][1];
+    Image r = need(ImageResize(img, w, h, RESIZE_BILINEAR), "Resizing");
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) {
+        double ref = bilinear(img, (x + 0.5)*93/w, (y + 0.5)*60/h);
+        CHECK(fabs(ImageGetPixel(r, x, y) - ref) <= 1.0, "bilinear %dx%d (%d,%d): %d vs %.2f",
+              w, h, x, y, ImageGetPixel(r, x, y), ref);
+      }
+    ImageDestroy(&r);
+  }
+  ImageDestroy(&img);
+}
+
+// Count the pixels of a 16-bit image and an 8-bit one that differ (or -1 if
+// their sizes or maxvals differ).
+static long diff16(Image16 a, Image b) {
+  if (Image16Width(a) != ImageWidth(b) || Image16Height(a) != ImageHeight(b) ||
+      Image16Maxval(a) != ImageMaxval(b))
+    return -1;
+  long n = 0;
+  for (int y = 0; y < ImageHeight(b); y++)
+    for (int x = 0; x < ImageWidth(b); x++)
+      n += Image16GetPixel(a, x, y) != ImageGetPixel(b, x, y);
+  return n;
+}
+
+// Abort the program if img is NULL (as after an allocation failure).
+static Image16 need16(Image16 img, const char* what) {
+  if (img == NULL) error(2, errno, "%s: %s", what, ImageErrMsg());
+  return img;
+}
+
+// 16-bit images: with maxval 255, every operation must give the same
+// result as on 8-bit images; deeper images are checked against references.
+static void check16(void) {
+  const int w = 67, h = 45;
+  Image img = synth(w, h, 6);
+  Image16 a = need16(ImageTo16(img), "Converting");
+  CHECK(diff16(a, img) == 0, "ImageTo16 differs");
+  Image b = need(Image16To8(a), "Converting");
+  CHECK(diffPixels(b, img) == 0, "Image16To8 at maxval 255 differs");
+  ImageDestroy(&b);
+
+  Image16 r16 = need16(Image16Rotate(a), "Rotating");
+  Image r8 = need(ImageRotate(img), "Rotating");
+  CHECK(diff16(r16, r8) == 0, "rotate differs");
+  Image16Destroy(&r16);
+  ImageDestroy(&r8);
+  r16 = need16(Image16Mirror(a), "Mirroring");
+  r8 = need(ImageMirror(img), "Mirroring");
+  CHECK(diff16(r16, r8) == 0, "mirror differs");
+  Image16Destroy(&r16);
+  ImageDestroy(&r8);
+  Image16 p16 = need16(Image16Crop(a, 30, 20, 25, 17), "Cropping");
+  Image p8 = need(ImageCrop(img, 30, 20, 25, 17), "Cropping");
+  CHECK(diff16(p16, p8) == 0, "crop differs");
+  int x = -1, y = -1;
+  CHECK(Image16LocateSubImage(a, &x, &y, p16) && x == 30 && y == 20, "locate: (%d,%d)", x, y);
+  CHECK(Image16MatchSubImage(a, 30, 20, p16) && !Image16MatchSubImage(a, 31, 20, p16), "match");
+
+  // In-place operations, applied in turn to both images
+  Image16Paste(a, 2, 3, p16);
+  ImagePaste(img, 2, 3, p8);
+  CHECK(diff16(a, img) == 0, "paste differs");
+  Image16Blend(a, 40, 25, p16, 0.3);
+  ImageBlend(img, 40, 25, p8, 0.3);
+  CHECK(diff16(a, img) == 0, "blend differs");
+  Image16Blur(a, 2, 1);
+  ImageBlur(img, 2, 1);
+  CHECK(diff16(a, img) == 0, "blur differs");
+  Image16Brighten(a, 1.7);
+  ImageBrighten(img, 1.7);
+  CHECK(diff16(a, img) == 0, "brighten differs");
+  Image16Negative(a);
+  ImageNegative(img);
+  CHECK(diff16(a, img) == 0, "negative differs");
+  Image16Threshold(a, 100);
+  ImageThreshold(img, 100);
+  CHECK(diff16(a, img) == 0, "threshold differs");
+  Image16Destroy(&a);
+  Image16Destroy(&p16);
+  ImageDestroy(&p8);
+
+  // A deep image: save/load round trip (big-endian samples), blur against
+  // rounded means, and scaling to 8 bits
+  const int maxval = 65535;
+  Image16 d = need16(Image16Create(w, h, maxval), "Creating image");
+  unsigned seed = 7;
+  for (int j = 0; j < h; j++)
+    for (int i = 0; i < w; i++) {
+      seed = seed*1103515245u + 12345u;
+      Image16SetPixel(d, i, j, (uint16_t)(seed >> 16));
+    }
+  const char* name = scratch(".pgm");
+  CHECK(Image16Save(d, name), "save failed: %s", ImageErrMsg());
+  FILE* f = fopen(name, "rb");
+  char magic[3] = "";
+  int fw = 0, fh = 0, fmax = 0;
+  CHECK(fscanf(f, "%2s %d %d %d", magic, &fw, &fh, &fmax) == 4 && fgetc(f) == '\n' &&
+        strcmp(magic, "P5") == 0 && fw == w && fh == h && fmax == maxval, "deep header");
+  int hi = fgetc(f), lo = fgetc(f);
+  CHECK((hi << 8 | lo) == Image16GetPixel(d, 0, 0), "first sample is not big-endian");
+  fclose(f);
+  Image16 back = need16(Image16Load(name), "Loading");
+  long ndiff = 0;
+  for (int j = 0; j < h; j++)
+    for (int i = 0; i < w; i++) ndiff += Image16GetPixel(back, i, j) != Image16GetPixel(d, i, j);
+  CHECK(Image16Maxval(back) == maxval && ndiff == 0, "deep round trip: %ld pixels differ", ndiff);
+  Image16Destroy(&back);
+
+  b = need(Image16To8(d), "Converting");
+  CHECK(ImageMaxval(b) == PixMax, "Image16To8 maxval");
+  for (int j = 0; j < h; j++)
+    for (int i = 0; i < w; i++) {
+      int ref = (int)((Image16GetPixel(d, i, j)*255L + maxval/2) / maxval);
+      CHECK(ImageGetPixel(b, i, j) == ref, "Image16To8 (%d,%d)", i, j);
+    }
+  ImageDestroy(&b);
+
+  Image16 bl = need16(Image16Crop(d, 0, 0, w, h), "Copying");
+  Image16Blur(bl, 3, 2);
+  for (int j = 0; j < h; j++)
+    for (int i = 0; i < w; i++) {
+      long sum = 0, n = 0;
+      for (int v = j-2; v <= j+2; v++)
+        for (int u = i-3; u <= i+3; u++)
+          if (0 <= u && u < w && 0 <= v && v < h) {
+            sum += Image16GetPixel(d, u, v);
+            n++;
+          }
+      CHECK(Image16GetPixel(bl, i, j) == (sum + n/2) / n, "deep blur (%d,%d)", i, j);
+    }
+  Image16Destroy(&bl);
+
+  // 8-bit files load as 16-bit images too, with a header parsed as usual
+  f = fopen(name, "wb");
+  fprintf(f, "P5\n# comment\n2 2\n# another\n200\n");
+  fwrite("\001\002\003\310", 1, 4, f);
+  fclose(f);
+  back = Image16Load(name);
+  CHECK(back != NULL && Image16Maxval(back) == 200 && Image16GetPixel(back, 1, 1) == 200,
+        "8-bit file with comments: %s", back ? "wrong pixels" : ImageErrMsg());
+  Image16Destroy(&back);
+
+  unlink(name);
+  Image16Destroy(&d);
+  ImageDestroy(&img);
+}
+
+// Write len bytes to a scratch file and load it (NULL if it does not load).
+static Image loadBytes(const char* bytes, size_t len) {
+  const char* name = scratch(".pnm");
+  FILE* f = fopen(name, "wb");
+  fwrite(bytes, 1, len, f);
+  fclose(f);
+  Image img = ImageLoad(name);
+  unlink(name);
+  return img;
+}
+
+// Check that img has size w x h, maxval maxval and the given pixels.
+static int samePixels(Image img, int w, int h, int maxval, const uint8* pixels) {
+  if (img == NULL || ImageWidth(img) != w || ImageHeight(img) != h || ImageMaxval(img) != maxval)
+    return 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      if (ImageGetPixel(img, x, y) != pixels[y*w + x]) return 0;
+  return 1;
+}
+
+#define LOAD(s) loadBytes(s, sizeof(s) - 1)
+
+// Netpbm formats: plain and raw PGM, PBM and PPM files must load to the
+// same pixels, and plain PGM files must round trip.
+static void checkNetpbm(void) {
+  static const uint8 gray[] = { 0, 7, 100, 15, 3, 0 };
+  Image img = LOAD("P2\n# plain\n3 2 15\n0 7\n# mid-raster comment\n100 15\t3\n0");
+  CHECK(img == NULL, "P2 sample above maxval accepted");
+  ImageDestroy(&img);
+  static const uint8 gray15[] = { 0, 7, 10, 15, 3, 0 };
+  img = LOAD("P2\n# plain\n3 2 15\n0 7\n10 15\t3\n0");
+  CHECK(samePixels(img, 3, 2, 15, gray15), "P2: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  img = LOAD("P5 3 2 100\n\000\007\144\017\003\000");
+  CHECK(samePixels(img, 3, 2, 100, gray), "P5: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+
+  // Gray PPM files keep their levels; colors become rounded luma
+  img = LOAD("P3 3 2 100 0 0 0 7 7 7 100 100 100 15 15 15 3 3 3 0 0 0");
+  CHECK(samePixels(img, 3, 2, 100, gray), "gray P3: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  img = LOAD("P6 3 2 100\n\000\000\000\007\007\007\144\144\144\017\017\017\003\003\003\000\000\000");
+  CHECK(samePixels(img, 3, 2, 100, gray), "gray P6: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  static const uint8 luma[] = { 76, 150, 29, 128 };
+  img = LOAD("P3 2 2 255 255 0 0 0 255 0 0 0 255 128 128 128");
+  CHECK(samePixels(img, 2, 2, 255, luma), "color P3: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  img = LOAD("P6 2 2 255\n\377\000\000\000\377\000\000\000\377\200\200\200");
+  CHECK(samePixels(img, 2, 2, 255, luma), "color P6: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+
+  // PBM: 1 is black (0), 0 is white (PixMax); raw rows are padded to bytes
+  uint8 bits[2*10];
+  for (int i = 0; i < 20; i++) bits[i] = ((i*7 + i/10) % 3 == 0) ? 0 : PixMax;
+  char plain[64] = "P1\n10 2\n", raw[32] = "P4\n10 2\n";
+  size_t np = strlen(plain), nr = strlen(raw);
+  for (int i = 0; i < 20; i++) {
+    plain[np++] = bits[i] ? '0' : '1';
+    if (i == 9) plain[np++] = '\n';
+  }
+  for (int y = 0; y < 2; y++) {
+    unsigned v = 0;
+    for (int x = 0; x < 10; x++) v |= (bits[10*y + x] ? 0u : 1u) << (15 - x);
+    raw[nr++] = (char)(v >> 8);
+    raw[nr++] = (char)(v | 0x3f);  // padding bits are ignored
+  }
+  img = loadBytes(plain, np);
+  CHECK(samePixels(img, 10, 2, PixMax, bits), "P1: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  img = loadBytes(raw, nr);
+  CHECK(samePixels(img, 10, 2, PixMax, bits), "P4: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+
+  img = LOAD("P2 3 2 15 0 7 10 15 3");
+  CHECK(img == NULL, "truncated P2 accepted");
+  ImageDestroy(&img);
+  img = LOAD("P1 2 1 02");
+  CHECK(img == NULL, "bad P1 digit accepted");
+  ImageDestroy(&img);
+  img = LOAD("P7 3 2 15\n");
+  CHECK(img == NULL, "P7 accepted");
+  ImageDestroy(&img);
+
+  // Plain PGM round trip
+  Image orig = synth(97, 41, 8);
+  const char* name = scratch(".pgm");
+  CHECK(ImageSaveAscii(orig, name), "ImageSaveAscii failed: %s", ImageErrMsg());
+  img = ImageLoad(name);
+  CHECK(img != NULL && ImageMaxval(img) == ImageMaxval(orig) && diffPixels(img, orig) == 0,
+        "P2 round trip: %s", img ? "wrong pixels" : ImageErrMsg());
+  unlink(name);
+  ImageDestroy(&img);
+  ImageDestroy(&orig);
+}
+
+// Replace the stripe height in the header of the compressed file name by
+// rows, and cut the file to len bytes (if len >= 0).
+static void pzEdit(const char* name, const char* rows, long len) {
+  FILE* f = fopen(name, "rb");
+  static char buf[1 << 20];
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  char* p = buf;
+  for (int k = 0; k < 3; k++) p = strchr(p, '\n') + 1;   // the rows line
+  char* q = strchr(p, '\n');
+  f = fopen(name, "wb");
+  fwrite(buf, 1, p - buf, f);
+  fputs(rows, f);
+  if (len < 0) len = (long)n;
+  fwrite(q, 1, len - (q - buf), f);
+  fclose(f);
+}
+
+// Compressed files: round trips in every size, and corrupt headers or
+// data, which must be rejected rather than load as wrong pixels.
+static void checkCompressed(void) {
+  const char* name = scratch(".pz");
+  static const int sizes[][2] = { { 1, 1 }, { 37, 10 }, { 64, 64 }, { 300, 65 }, { 211, 200 }, { 5, 0 } };
+  for (int k = 0; k < (int)(sizeof(sizes)/sizeof(sizes[0])); k++) {
+    Image img = synth(sizes[k][0], sizes[k][1], 9 + k);
+    CHECK(ImageSaveCompressed(img, name), "save %dx%d: %s", sizes[k][0], sizes[k][1], ImageErrMsg());
+    Image back = ImageLoad(name);
+    CHECK(back != NULL && diffPixels(back, img) == 0, "round trip %dx%d: %s",
+          sizes[k][0], sizes[k][1], back ? "wrong pixels" : ImageErrMsg());
+    ImageDestroy(&back);
+    ImageDestroy(&img);
+  }
+
+  // Flat and noisy images (raw and coded stripes)
+  Image img = synth(150, 130, 3);
+  Image flat = need(ImageCreate(150, 130, PixMax), "Creating image");
+  ImagePaste(img, 0, 0, flat);
+  ImageDestroy(&flat);
+  Image noise = synth(150, 60, 4);
+  for (int y = 0; y < 60; y++)
+    for (int x = 0; x < 150; x++) ImageSetPixel(noise, x, y, (uint8)(x*x*31 + y*17 + x*y));
+  ImagePaste(img, 0, 70, noise);
+  ImageDestroy(&noise);
+  CHECK(ImageSaveCompressed(img, name), "save: %s", ImageErrMsg());
+  Image back = ImageLoad(name);
+  CHECK(back != NULL && diffPixels(back, img) == 0, "flat and noisy round trip");
+  ImageDestroy(&back);
+
+  // Stripe heights from the file: taller than the image is one stripe,
+  // which does not match this file; zero or too big are invalid
+  static const char* bad[] = { "2147483647", "130", "0", "2147483648", "-64", "63" };
+  for (int k = 0; k < (int)(sizeof(bad)/sizeof(bad[0])); k++) {
+    CHECK(ImageSaveCompressed(img, name), "save: %s", ImageErrMsg());
+    pzEdit(name, bad[k], -1);
+    back = ImageLoad(name);
+    CHECK(back == NULL, "stripe height %s accepted", bad[k]);
+    ImageDestroy(&back);
+  }
+  Image small = synth(40, 10, 5);
+  CHECK(ImageSaveCompressed(small, name), "save: %s", ImageErrMsg());
+  pzEdit(name, "2147483647", -1);
+  back = ImageLoad(name);
+  CHECK(back != NULL && diffPixels(back, small) == 0, "one stripe, taller than the image: %s",
+        back ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&back);
+  ImageDestroy(&small);
+
+  // Truncated files
+  CHECK(ImageSaveCompressed(img, name), "save: %s", ImageErrMsg());
+  struct stat st;
+  stat(name, &st);
+  for (long len = 12; len < st.st_size; len += st.st_size/7) {
+    pzEdit(name, "64", len);
+    back = ImageLoad(name);
+    CHECK(back == NULL, "file cut to %ld bytes accepted", len);
+    ImageDestroy(&back);
+    CHECK(ImageSaveCompressed(img, name), "save: %s", ImageErrMsg());
+  }
+  pzEdit(name, "64", st.st_size - 1);
+  back = ImageLoad(name);
+  CHECK(back == NULL, "file missing its last byte accepted");
+  ImageDestroy(&back);
+  unlink(name);
+  ImageDestroy(&img);
+}
+
+// Read the whole file name into a new buffer, and its length into *len.
+static uint8* readBytes(const char* name, long* len) {
+  FILE* f = fopen(name, "rb");
+  if (f == NULL) error(2, errno, "%s", name);
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  uint8* buf = (uint8*)malloc(*len + 1);
+  if (buf == NULL || fread(buf, 1, *len, f) != (size_t)*len) error(2, errno, "%s", name);
+  fclose(f);
+  return buf;
+}
+
+// Raw PGM files: exact bytes written, and loading of files smaller than,
+// equal to and larger than the read buffer (64 KiB).
+static void checkFiles(void) {
+  char name[256];   // LOAD uses another scratch file
+  strcpy(name, scratch(".pgm"));
+  static const int sizes[][2] = { { 1, 1 }, { 255, 256 }, { 256, 256 }, { 65520, 1 },
+                                  { 65521, 1 }, { 65522, 1 }, { 1000, 700 }, { 0, 5 } };
+  for (int k = 0; k < (int)(sizeof(sizes)/sizeof(sizes[0])); k++) {
+    int w = sizes[k][0], h = sizes[k][1];
+    Image img = synth(w, h, 10 + k);
+    CHECK(ImageSave(img, name), "save %dx%d: %s", w, h, ImageErrMsg());
+    long len;
+    uint8* bytes = readBytes(name, &len);
+    char header[64];
+    int hl = sprintf(header, "P5\n%d %d\n%d\n", w, h, ImageMaxval(img));
+    int ok = len == hl + (long)w*h && memcmp(bytes, header, hl) == 0;
+    for (int i = 0; ok && i < w*h; i++) ok = bytes[hl + i] == ImageGetPixel(img, i % w, i / w);
+    CHECK(ok, "bytes written for %dx%d", w, h);
+    Image back = ImageLoad(name);
+    CHECK(back != NULL && diffPixels(back, img) == 0, "round trip %dx%d: %s",
+          w, h, back ? "wrong pixels" : ImageErrMsg());
+    ImageDestroy(&back);
+
+    // One byte short
+    if (len > hl) {
+      FILE* f = fopen(name, "wb");
+      fwrite(bytes, 1, len - 1, f);
+      fclose(f);
+      back = ImageLoad(name);
+      CHECK(back == NULL, "%dx%d file missing its last byte accepted", w, h);
+      ImageDestroy(&back);
+    }
+    free(bytes);
+    ImageDestroy(&img);
+  }
+
+  // Comments and any whitespace in the header
+  Image img = LOAD("P5\r\n#c1\n  3#c2\n#c3\n2\t# c4\n9\r\001\002\003\004\005\006");
+  static const uint8 pix[] = { 1, 2, 3, 4, 5, 6 };
+  CHECK(samePixels(img, 3, 2, 9, pix), "header with comments: %s", img ? "wrong pixels" : ImageErrMsg());
+  ImageDestroy(&img);
+  img = LOAD("P5 3 2 9\001\002\003\004\005\006");
+  CHECK(img == NULL, "header without whitespace after maxval accepted");
+  ImageDestroy(&img);
+
+  img = synth(10, 10, 1);
+  CHECK(!ImageSave(img, "/nonexistent/imageCheck.pgm"), "save to a missing directory succeeded");
+  CHECK(ImageLoad("/nonexistent/imageCheck.pgm") == NULL, "load of a missing file succeeded");
+  ImageDestroy(&img);
+  unlink(name);
+}
+
+// Mean of the (2dx+1)x(2dy+1) window of img at (x,y), clipped to the
+// image and rounded to nearest.
+static int meanAt(Image img, int x, int y, int dx, int dy) {
+  long sum = 0, n = 0;
+  for (int v = y - dy; v <= y + dy; v++)
+    for (int u = x - dx; u <= x + dx; u++)
+      if (0 <= u && u < ImageWidth(img) && 0 <= v && v < ImageHeight(img)) {
+        sum += ImageGetPixel(img, u, v);
+        n++;
+      }
+  return (int)((sum + n/2) / n);
+}
+
+// Blur (specialized and generic kernels) and threshold, against
+// references computed pixel by pixel.
+static void checkBlur(void) {
+  Image img = synth(83, 47, 11);
+  static const int windows[][2] = { { 1, 1 }, { 2, 2 }, { 3, 3 }, { 1, 0 }, { 0, 1 },
+                                    { 0, 0 }, { 4, 2 }, { 2, 5 }, { 50, 1 }, { 90, 60 } };
+  for (int k = 0; k < (int)(sizeof(windows)/sizeof(windows[0])); k++) {
+    int dx = windows[k][0], dy = windows[k][1];
+    Image b = copy(img);
+    ImageBlur(b, dx, dy);
+    long bad = 0;
+    for (int y = 0; y < ImageHeight(img); y++)
+      for (int x = 0; x < ImageWidth(img); x++)
+        bad += ImageGetPixel(b, x, y) != meanAt(img, x, y, dx, dy);
+    CHECK(bad == 0, "blur %d,%d: %ld pixels differ", dx, dy, bad);
+    ImageDestroy(&b);
+  }
+
+  // A thin image, narrower than the window
+  Image thin = synth(2, 40, 12);
+  Image b = copy(thin);
+  ImageBlur(b, 3, 3);
+  long bad = 0;
+  for (int y = 0; y < 40; y++)
+    for (int x = 0; x < 2; x++) bad += ImageGetPixel(b, x, y) != meanAt(thin, x, y, 3, 3);
+  CHECK(bad == 0, "blur 3,3 of a 2x40 image: %ld pixels differ", bad);
+  ImageDestroy(&b);
+  ImageDestroy(&thin);
+
+  static const int levels[] = { 0, 1, 128, 200, 255 };
+  for (int k = 0; k < (int)(sizeof(levels)/sizeof(levels[0])); k++) {
+    b = copy(img);
+    ImageThreshold(b, (uint8)levels[k]);
+    bad = 0;
+    for (int y = 0; y < ImageHeight(img); y++)
+      for (int x = 0; x < ImageWidth(img); x++)
+        bad += ImageGetPixel(b, x, y) != (ImageGetPixel(img, x, y) >= levels[k] ? ImageMaxval(img) : 0);
+    CHECK(bad == 0, "threshold %d: %ld pixels differ", levels[k], bad);
+    ImageDestroy(&b);
+  }
+  ImageDestroy(&img);
+}
+
+// Level of rank (percent*(n-1))/100 among the n pixels of the
+// (2dx+1)x(2dy+1) window of img at (x,y), clipped to the image:
+// percent 0 is the minimum and 100 the maximum.
+static int rankAt(Image img, int x, int y, int dx, int dy, int percent) {
+  long count[256] = { 0 }, n = 0;
+  for (int v = y - dy; v <= y + dy; v++)
+    for (int u = x - dx; u <= x + dx; u++)
+      if (0 <= u && u < ImageWidth(img) && 0 <= v && v < ImageHeight(img)) {
+        count[ImageGetPixel(img, u, v)]++;
+        n++;
+      }
+  long rank = (percent*(n - 1)) / 100;
+  int level = 0;
+  while (rank >= count[level]) rank -= count[level++];
+  return level;
+}
+
+// Count the pixels of out that differ from the rank reference of img.
+static long diffRank(Image out, Image img, int dx, int dy, int percent) {
+  long n = 0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      n += ImageGetPixel(out, x, y) != rankAt(img, x, y, dx, dy, percent);
+  return n;
+}
+
+// Erosion and dilation against brute-force minimum and maximum, and
+// opening and closing as their compositions.
+static void checkMorphology(void) {
+  Image img = synth(77, 51, 13);
+  static const int windows[][2] = { { 1, 1 }, { 0, 0 }, { 3, 0 }, { 0, 4 }, { 5, 2 },
+                                    { 40, 3 }, { 2, 30 }, { 100, 100 } };
+  for (int k = 0; k < (int)(sizeof(windows)/sizeof(windows[0])); k++) {
+    int dx = windows[k][0], dy = windows[k][1];
+    Image e = copy(img), d = copy(img);
+    ImageErode(e, dx, dy);
+    ImageDilate(d, dx, dy);
+    long bad = diffRank(e, img, dx, dy, 0);
+    CHECK(bad == 0, "erode %d,%d: %ld pixels differ", dx, dy, bad);
+    bad = diffRank(d, img, dx, dy, 100);
+    CHECK(bad == 0, "dilate %d,%d: %ld pixels differ", dx, dy, bad);
+
+    Image o = copy(img), c = copy(img);
+    ImageOpening(o, dx, dy);
+    ImageClosing(c, dx, dy);
+    ImageDilate(e, dx, dy);
+    ImageErode(d, dx, dy);
+    CHECK(diffPixels(o, e) == 0, "opening %d,%d is not erode then dilate", dx, dy);
+    CHECK(diffPixels(c, d) == 0, "closing %d,%d is not dilate then erode", dx, dy);
+    ImageDestroy(&e);
+    ImageDestroy(&d);
+    ImageDestroy(&o);
+    ImageDestroy(&c);
+  }
+
+  // Opening removes bright specks smaller than the rectangle
+  Image flat = need(ImageCreate(30, 20, PixMax), "Creating image");
+  ImageSetPixel(flat, 10, 10, 200);
+  ImageSetPixel(flat, 11, 10, 200);
+  ImageOpening(flat, 1, 1);
+  CHECK(ImageGetPixel(flat, 10, 10) == 0 && ImageGetPixel(flat, 11, 10) == 0, "speck not removed");
+  ImageDestroy(&flat);
+  ImageDestroy(&img);
+}
+
+// Rank and median filters against brute-force ranks, including the
+// erosion and dilation ends.
+static void checkRank(void) {
+  Image img = synth(71, 53, 14);
+  static const int windows[][3] = { { 1, 1, 50 }, { 2, 2, 50 }, { 0, 3, 50 }, { 4, 0, 50 },
+                                    { 3, 2, 0 }, { 3, 2, 100 }, { 2, 1, 25 }, { 5, 4, 90 },
+                                    { 0, 0, 37 }, { 40, 1, 50 }, { 80, 60, 75 } };
+  for (int k = 0; k < (int)(sizeof(windows)/sizeof(windows[0])); k++) {
+    int dx = windows[k][0], dy = windows[k][1], pct = windows[k][2];
+    Image r = copy(img);
+    ImageRankFilter(r, dx, dy, pct);
+    long bad = diffRank(r, img, dx, dy, pct);
+    CHECK(bad == 0, "rank %d,%d,%d: %ld pixels differ", dx, dy, pct, bad);
+    if (pct == 50) {
+      Image m = copy(img);
+      ImageMedian(m, dx, dy);
+      CHECK(diffPixels(m, r) == 0, "median %d,%d is not rank 50", dx, dy);
+      ImageDestroy(&m);
+    } else if (pct == 0 || pct == 100) {
+      Image m = copy(img);
+      (pct == 0 ? ImageErode : ImageDilate)(m, dx, dy);
+      CHECK(diffPixels(m, r) == 0, "rank %d,%d,%d differs from morphology", dx, dy, pct);
+      ImageDestroy(&m);
+    }
+    ImageDestroy(&r);
+  }
+
+  // Salt and pepper noise on a flat image is removed by a 3x3 median
+  Image flat = need(ImageCreate(40, 30, PixMax), "Creating image");
+  for (int y = 0; y < 30; y++)
+    for (int x = 0; x < 40; x++) ImageSetPixel(flat, x, y, 100);
+  Image noisy = copy(flat);
+  for (int i = 0; i < 40; i++) ImageSetPixel(noisy, (i*17) % 40, (i*7) % 30, (i & 1) ? PixMax : 0);
+  ImageMedian(noisy, 1, 1);
+  CHECK(diffPixels(noisy, flat) == 0, "median does not remove isolated noise");
+  ImageDestroy(&noisy);
+  ImageDestroy(&flat);
+  ImageDestroy(&img);
+}
+
+// Count the pixels of ImageAffine(img, m, fill) that differ by more than 1
+// from a bilinear reference; -1 if the warp fails.  Source points inside
+// [0, w) x [0, h) (continuous coordinates) sample img, clamped to its border
+// pixels, and the others give fill.  As source points are stepped in fixed
+// point, the reference is taken 1e-6 pixels around them (the weights, and
+// near the edges the fill, may go either way).
+static long diffAffine(Image img, const double m[6], int fill) {
+  Image out = ImageAffine(img, m, (uint8)fill);
+  if (out == NULL) return -1;
+  int w = ImageWidth(img), h = ImageHeight(img);
+  double det = m[0]*m[4] - m[1]*m[3];
+  long bad = 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      // Inverse transform of the center
+      double px = x + 0.5 - m[2], py = y + 0.5 - m[5];
+      double u = (m[4]*px - m[1]*py) / det;
+      double v = (m[0]*py - m[3]*px) / det;
+      int ok = 0;
+      for (int k = 0; k < 4; k++) {
+        double su = u + ((k & 1) ? 1e-6 : -1e-6), sv = v + ((k & 2) ? 1e-6 : -1e-6);
+        double ref = (su < 0 || sv < 0 || su >= w || sv >= h) ? fill : bilinear(img, su, sv);
+        ok = ok || fabs(ImageGetPixel(out, x, y) - ref) <= 1.0;
+      }
+      bad += !ok;
+    }
+  ImageDestroy(&out);
+  return bad;
+}
+
+// Affine warps and rotations: exact cases (identity, translations, right
+// angles) and a bilinear reference.
+static void checkAffine(void) {
+  Image img = synth(61, 61, 15);
+  static const double identity[6] = { 1, 0, 0, 0, 1, 0 };
+  Image out = need(ImageAffine(img, identity, 0), "Warping");
+  CHECK(diffPixels(out, img) == 0, "identity warp");
+  ImageDestroy(&out);
+  out = need(ImageRotateAngle(img, 0.0, 0), "Rotating");
+  CHECK(diffPixels(out, img) == 0, "rotation by 0");
+  ImageDestroy(&out);
+  out = need(ImageRotateAngle(img, 360.0, 0), "Rotating");
+  CHECK(diffPixels(out, img) == 0, "rotation by 360");
+  ImageDestroy(&out);
+
+  // Right angles of a square image move pixel centers to pixel centers
+  out = need(ImageRotateAngle(img, 90.0, 0), "Rotating");
+  Image r = need(ImageRotate(img), "Rotating");
+  CHECK(diffPixels(out, r) == 0, "rotation by 90 differs from ImageRotate");
+  ImageDestroy(&out);
+  out = need(ImageRotateAngle(img, -270.0, 0), "Rotating");
+  CHECK(diffPixels(out, r) == 0, "rotation by -270 differs from ImageRotate");
+  ImageDestroy(&out);
+  ImageDestroy(&r);
+
+  // Whole-pixel translation, with the uncovered pixels filled
+  static const double shift[6] = { 1, 0, 7, 0, 1, -4 };
+  out = need(ImageAffine(img, shift, 77), "Warping");
+  long bad = 0;
+  for (int y = 0; y < 61; y++)
+    for (int x = 0; x < 61; x++) {
+      int ref = (x < 7 || y >= 57) ? 77 : ImageGetPixel(img, x - 7, y + 4);
+      bad += ImageGetPixel(out, x, y) != ref;
+    }
+  CHECK(bad == 0, "translation: %ld pixels differ", bad);
+  ImageDestroy(&out);
+
+  // General transforms, on a non-square image
+  Image rect = synth(97, 44, 16);
+  static const double general[][6] = { { 0.8, 0.3, 5.5, -0.2, 1.1, -3.25 },
+                                       { 1.7, 0, -20, 0, 0.6, 10 },
+                                       { 0.866, -0.5, 30, 0.5, 0.866, -10 } };
+  for (int k = 0; k < 3; k++) {
+    bad = diffAffine(rect, general[k], 200);
+    CHECK(bad == 0, "transform %d: %ld pixels differ by more than 1", k, bad);
+  }
+  double a = 23.0*M_PI/180.0, c = cos(a), s = sin(a);
+  double rot[6] = { c, s, 48.5 - c*48.5 - s*22, -s, c, 22 + s*48.5 - c*22 };
+  bad = diffAffine(rect, rot, 0);
+  CHECK(bad == 0, "rotation by 23: %ld pixels differ by more than 1", bad);
+  out = need(ImageRotateAngle(rect, 23.0, 0), "Rotating");
+  Image ref = need(ImageAffine(rect, rot, 0), "Warping");
+  CHECK(diffPixels(out, ref) == 0, "rotation by 23 differs from its affine transform");
+  ImageDestroy(&out);
+  ImageDestroy(&ref);
+
+  // Near-identity transforms of a constant image keep it everywhere: the
+  // border pixels cover the image up to its edges
+  Image flat = need(ImageCreate(8, 4, PixMax), "Creating image");
+  for (int y = 0; y < 4; y++)
+    for (int x = 0; x < 8; x++) ImageSetPixel(flat, x, y, 100);
+  static const double nudges[][6] = { { 1, 0, -0.25, 0, 1, 0 }, { 1, 0, 0.25, 0, 1, 0 },
+                                      { 1, 0, 0, 0, 1, -0.25 }, { 1, 0, 0, 0, 1, 0.25 },
+                                      { 1, 0, 0.4, 0, 1, -0.4 } };
+  for (int k = 0; k < 5; k++) {
+    out = need(ImageAffine(flat, nudges[k], 0), "Warping");
+    CHECK(diffPixels(out, flat) == 0, "translation by (%g,%g) changes a constant image",
+          nudges[k][2], nudges[k][5]);
+    ImageDestroy(&out);
+  }
+  out = need(ImageRotateAngle(flat, 0.0001, 0), "Rotating");
+  CHECK(diffPixels(out, flat) == 0, "rotation by 0.0001 changes a constant image");
+  ImageDestroy(&out);
+  out = need(ImageRotateAngle(flat, -0.0001, 0), "Rotating");
+  CHECK(diffPixels(out, flat) == 0, "rotation by -0.0001 changes a constant image");
+  ImageDestroy(&out);
+  // Half a pixel or more beyond the edge is outside
+  static const double beyond[6] = { 1, 0, 0.75, 0, 1, 0 };
+  out = need(ImageAffine(flat, beyond, 0), "Warping");
+  CHECK(ImageGetPixel(out, 0, 2) == 0 && ImageGetPixel(out, 1, 2) == 100 && ImageGetPixel(out, 7, 2) == 100,
+        "translation by 0.75");
+  ImageDestroy(&out);
+  ImageDestroy(&flat);
+
+  static const double singular[6] = { 1, 2, 0, 2, 4, 0 };
+  CHECK(ImageAffine(rect, singular, 0) == NULL, "singular transform accepted");
+  ImageDestroy(&rect);
+  ImageDestroy(&img);
+}
+
+// Compare ImageBlobs(img, conn) with a flood fill from each unlabeled
+// foreground pixel, in raster order.  Returns the number of blobs that
+// differ (or -1 if their counts differ).
+static long diffBlobs(Image img, int conn) {
+  ImageBlob* blobs = NULL;
+  int n = ImageBlobs(img, conn, &blobs);
+  int w = ImageWidth(img), h = ImageHeight(img);
+  char* seen = (char*)calloc((size_t)w*h, 1);
+  int* stack = (int*)malloc(sizeof(int)*((size_t)w*h + 1));
+  long bad = 0;
+  int k = 0;
+  for (int p0 = 0; p0 < w*h; p0++) {
+    if (seen[p0] || ImageGetPixel(img, p0 % w, p0 / w) == 0) continue;
+    long area = 0;
+    double sx = 0, sy = 0;
+    int x0 = w, y0 = h, x1 = -1, y1 = -1, top = 0;
+    stack[top++] = p0;
+    seen[p0] = 1;
+    while (top > 0) {
+      int p = stack[--top], x = p % w, y = p / w;
+      area++;
+      sx += x;
+      sy += y;
+      if (x < x0) x0 = x;
+      if (x > x1) x1 = x;
+      if (y < y0) y0 = y;
+      if (y > y1) y1 = y;
+      for (int v = y - 1; v <= y + 1; v++)
+        for (int u = x - 1; u <= x + 1; u++) {
+          if (u < 0 || u >= w || v < 0 || v >= h || seen[v*w + u]) continue;
+          if (conn == 4 && u != x && v != y) continue;
+          if (ImageGetPixel(img, u, v) == 0) continue;
+          seen[v*w + u] = 1;
+          stack[top++] = v*w + u;
+        }
+    }
+    if (k < n) {
+      ImageBlob* b = &blobs[k];
+      bad += b->area != area || b->x != x0 || b->y != y0 || b->w != x1 - x0 + 1 ||
+             b->h != y1 - y0 + 1 || fabs(b->cx - sx/area) > 1e-9 || fabs(b->cy - sy/area) > 1e-9;
+    }
+    k++;
+  }
+  free(stack);
+  free(seen);
+  free(blobs);
+  return k == n ? bad : -1;
+}
+
+// Connected components with 4 and 8 connectivity, against a flood fill,
+// on images with many small blobs and with blobs that span many rows.
+static void checkBlobs(void) {
+  // Sparse dots and short runs, touching diagonally in places
+  Image dots = need(ImageCreate(157, 133, PixMax), "Creating image");
+  for (int y = 0; y < 133; y++)
+    for (int x = 0; x < 157; x++)
+      ImageSetPixel(dots, x, y, ((x*x*31 + y*17 + x*y*7) % 5 < 2) ? PixMax : 0);
+  // Thresholded smooth image: large blobs with holes
+  Image smooth = synth(211, 170, 17);
+  ImageThreshold(smooth, 128);
+  // Combs: U shapes whose branches only meet at the bottom, many rows below,
+  // and a diagonal staircase
+  Image combs = need(ImageCreate(64, 900, PixMax), "Creating image");
+  for (int y = 0; y < 890; y++)
+    for (int x = 2; x < 60; x += 4) ImageSetPixel(combs, x, y, PixMax);
+  for (int x = 2; x < 60; x++) ImageSetPixel(combs, x, 890, (x % 16 < 11) ? PixMax : 0);
+  for (int i = 0; i < 8; i++) ImageSetPixel(combs, 61 + i % 3, 891 + i, PixMax);
+  Image images[] = { dots, smooth, combs };
+  for (int k = 0; k < 3; k++)
+    for (int conn = 4; conn <= 8; conn += 4) {
+      long bad = diffBlobs(images[k], conn);
+      CHECK(bad == 0, "image %d, %d-connected: %ld%s", k, conn, bad, bad < 0 ? " (count)" : " blobs differ");
+    }
+
+  ImageBlob* blobs = NULL;
+  Image black = need(ImageCreate(10, 10, PixMax), "Creating image");
+  CHECK(ImageBlobs(black, 8, &blobs) == 0, "blobs in a black image");
+  free(blobs);
+  ImageDestroy(&black);
+  ImageDestroy(&dots);
+  ImageDestroy(&smooth);
+  ImageDestroy(&combs);
+}
+
+// Count the pixels of an RLE image and an image that differ (or -1 if
+// their sizes or maxvals differ).
+static long diffRLE(RLEImage a, Image b) {
+  if (RLEImageWidth(a) != ImageWidth(b) || RLEImageHeight(a) != ImageHeight(b) ||
+      RLEImageMaxval(a) != ImageMaxval(b))
+    return -1;
+  Image d = need(RLEImageToImage(a), "Decoding");
+  long n = diffPixels(d, b);
+  for (int y = 0; y < ImageHeight(b); y++)
+    for (int x = 0; x < ImageWidth(b); x++) n += RLEImageGetPixel(a, x, y) != ImageGetPixel(b, x, y);
+  ImageDestroy(&d);
+  return n;
+}
+
+static RLEImage needRLE(RLEImage img, const char* what) {
+  if (img == NULL) error(2, errno, "%s: %s", what, ImageErrMsg());
+  return img;
+}
+
+// Run-length encoded images: every operation against the dense one.
+static void checkRLE(void) {
+  Image thr = synth(143, 91, 18);
+  ImageThreshold(thr, 100);
+  Image dots = need(ImageCreate(70, 40, PixMax), "Creating image");
+  for (int y = 0; y < 40; y++)
+    for (int x = 0; x < 70; x++) ImageSetPixel(dots, x, y, ((x*7 + y*y) % 11 == 0) ? 30 + y : 0);
+  Image gray = synth(50, 30, 19);
+  Image column = synth(1, 25, 20);
+  Image images[] = { thr, dots, gray, column };
+  for (int k = 0; k < 4; k++) {
+    Image img = images[k];
+    int w = ImageWidth(img), h = ImageHeight(img);
+    RLEImage r = needRLE(RLEImageFromImage(img), "Encoding");
+    CHECK(diffRLE(r, img) == 0, "image %d: round trip", k);
+    size_t runs = 0;
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) runs += x == 0 || ImageGetPixel(img, x, y) != ImageGetPixel(img, x-1, y);
+    CHECK(RLEImageRuns(r) == runs, "image %d: %zu runs, expected %zu", k, RLEImageRuns(r), runs);
+
+    uint8 min, max, dmin, dmax;
+    RLEImageStats(r, &min, &max);
+    ImageStats(img, &dmin, &dmax);
+    CHECK(min == dmin && max == dmax, "image %d: stats", k);
+
+    RLEImage m = needRLE(RLEImageMirror(r), "Mirroring");
+    Image dm = need(ImageMirror(img), "Mirroring");
+    CHECK(diffRLE(m, dm) == 0, "image %d: mirror", k);
+    RLEImageDestroy(&m);
+    ImageDestroy(&dm);
+
+    // Crops, pastes and matches at the corners and inside, with d kept
+    // equal to r
+    int cw = (w + 2) / 3, ch = (h + 1) / 2;
+    int xs[] = { 0, w - cw, w / 3 }, ys[] = { 0, h - ch, h / 4 };
+    Image d = copy(img);
+    for (int i = 0; i < 3; i++) {
+      RLEImage c = needRLE(RLEImageCrop(r, xs[i], ys[i], cw, ch), "Cropping");
+      Image dc = need(ImageCrop(d, xs[i], ys[i], cw, ch), "Cropping");
+      CHECK(diffRLE(c, dc) == 0, "image %d: crop %d", k, i);
+      CHECK(RLEImageMatchSubImage(r, xs[i], ys[i], c) == 1, "image %d: crop %d does not match", k, i);
+      int mx = xs[(i+1) % 3], my = ys[(i+1) % 3];
+      CHECK(RLEImageMatchSubImage(r, mx, my, c) == ImageMatchSubImage(d, mx, my, dc),
+            "image %d: match of crop %d elsewhere", k, i);
+      // Paste a negated crop at another position
+      RLEImageNegative(c);
+      ImageNegative(dc);
+      CHECK(diffRLE(c, dc) == 0, "image %d: negative of crop %d", k, i);
+      RLEImagePaste(r, mx, my, c);
+      ImagePaste(d, mx, my, dc);
+      CHECK(diffRLE(r, d) == 0, "image %d: paste %d", k, i);
+      CHECK(RLEImageMatchSubImage(r, mx, my, c), "image %d: paste %d does not match", k, i);
+      RLEImageDestroy(&c);
+      ImageDestroy(&dc);
+    }
+    RLEImageNegative(r);
+    ImageNegative(d);
+    CHECK(diffRLE(r, d) == 0, "image %d: negative", k);
+    ImageDestroy(&d);
+    RLEImageDestroy(&r);
+  }
+  for (int k = 0; k < 4; k++) ImageDestroy(&images[k]);
+}
+
+static BitImage needBits(BitImage img, const char* what) {
+  if (img == NULL) error(2, errno, "%s: %s", what, ImageErrMsg());
+  return img;
+}
+
+// Count the pixels of a binary image that differ from a thresholded
+// image (or -1 if their sizes differ), through BitImageToImage and
+// BitImageGetPixel.
+static long diffBits(BitImage a, Image b) {
+  if (BitImageWidth(a) != ImageWidth(b) || BitImageHeight(a) != ImageHeight(b)) return -1;
+  Image d = need(BitImageToImage(a), "Unpacking");
+  long n = diffPixels(d, b);
+  for (int y = 0; y < ImageHeight(b); y++)
+    for (int x = 0; x < ImageWidth(b); x++) n += BitImageGetPixel(a, x, y) != (ImageGetPixel(b, x, y) != 0);
+  ImageDestroy(&d);
+  return n;
+}
+
+// Number of differing pixels between img2 and the subimage of img1 at (x, y).
+static long hamming(Image img1, int x, int y, Image img2) {
+  long n = 0;
+  for (int v = 0; v < ImageHeight(img2); v++)
+    for (int u = 0; u < ImageWidth(img2); u++)
+      n += ImageGetPixel(img1, x + u, y + v) != ImageGetPixel(img2, u, v);
+  return n;
+}
+
+// Binary images: packing, crop, paste and tolerant matching against
+// thresholded dense images, at widths around the 64-bit words.
+static void checkBitImage(void) {
+  static const int widths[] = { 1, 63, 64, 65, 130, 203 };
+  for (int k = 0; k < (int)(sizeof(widths)/sizeof(widths[0])); k++) {
+    int w = widths[k], h = 37;
+    Image img = synth(w, h, 21 + k);
+    for (int thr = 0; thr <= PixMax; thr += 85) {
+      BitImage b = needBits(BitImageFromImage(img, (uint8)thr), "Packing");
+      Image t = copy(img);
+      ImageThreshold(t, (uint8)thr);
+      CHECK(diffBits(b, t) == 0, "width %d: threshold %d", w, thr);
+      BitImageDestroy(&b);
+      ImageDestroy(&t);
+    }
+    if (w < 8) {
+      ImageDestroy(&img);
+      continue;
+    }
+
+    // Crops and pastes at unaligned positions
+    Image t = copy(img);
+    ImageThreshold(t, 128);
+    BitImage b = needBits(BitImageFromImage(img, 128), "Packing");
+    int cw = w / 2 + 1, ch = 11;
+    int xs[] = { 0, w - cw, 3, w / 3 }, ys[] = { 0, h - ch, 5, 17 };
+    for (int i = 0; i < 4; i++) {
+      BitImage c = needBits(BitImageCrop(b, xs[i], ys[i], cw, ch), "Cropping");
+      Image dc = need(ImageCrop(t, xs[i], ys[i], cw, ch), "Cropping");
+      CHECK(diffBits(c, dc) == 0, "width %d: crop %d", w, i);
+      int px = xs[(i+1) % 4], py = ys[(i+1) % 4];
+      long dist = hamming(t, px, py, dc);
+      CHECK(BitImageMatchSubImage(b, px, py, c, 0) == ImageMatchSubImage(t, px, py, dc),
+            "width %d: exact match of crop %d", w, i);
+      CHECK(BitImageMatchSubImage(b, px, py, c, (int)dist), "width %d: match of crop %d within %ld", w, i, dist);
+      CHECK(dist == 0 || !BitImageMatchSubImage(b, px, py, c, (int)dist - 1),
+            "width %d: match of crop %d within %ld", w, i, dist - 1);
+      BitImagePaste(b, px, py, c);
+      ImagePaste(t, px, py, dc);
+      CHECK(diffBits(b, t) == 0, "width %d: paste %d", w, i);
+      BitImageDestroy(&c);
+      ImageDestroy(&dc);
+    }
+
+    // Locate, exact and tolerant, against a brute-force search
+    int sx = w / 2 - 2, sy = 20;
+    Image patch = need(ImageCrop(t, sx, sy, 7, 9), "Cropping");
+    ImageSetPixel(patch, 3, 4, ImageGetPixel(patch, 3, 4) ? 0 : PixMax);
+    BitImage bp = needBits(BitImageFromImage(patch, 128), "Packing");
+    for (int maxdiff = 0; maxdiff <= 2; maxdiff++) {
+      int rx = -1, ry = -1, found = 0;
+      for (int y = 0; !found && y <= h - 9; y++)
+        for (int x = 0; !found && x <= w - 7; x++)
+          if (hamming(t, x, y, patch) <= maxdiff) {
+            found = 1;
+            rx = x;
+            ry = y;
+          }
+      int x = -1, y = -1;
+      int f = BitImageLocateSubImage(b, &x, &y, bp, maxdiff);
+      CHECK(f == found && (!found || (x == rx && y == ry)), "width %d: locate within %d: %d (%d,%d), expected %d (%d,%d)",
+            w, maxdiff, f, x, y, found, rx, ry);
+    }
+    BitImageDestroy(&bp);
+    ImageDestroy(&patch);
+    BitImageDestroy(&b);
+    ImageDestroy(&t);
+    ImageDestroy(&img);
+  }
+}
+
+// Check that ImageStats(img) gives the minimum and maximum levels.
+static int statsOK(Image img) {
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+  int rmin = PixMax, rmax = 0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) {
+      int v = ImageGetPixel(img, x, y);
+      if (v < rmin) rmin = v;
+      if (v > rmax) rmax = v;
+    }
+  return min == rmin && max == rmax;
+}
+
+// Check that the dirty rectangle of img is (x, y, w, h) (all 0: none).
+static int dirtyIs(Image img, int x, int y, int w, int h) {
+  int dx = -1, dy = -1, dw = -1, dh = -1;
+  int r = ImageDirtyRect(img, &dx, &dy, &dw, &dh);
+  return r == (w > 0) && dx == x && dy == y && dw == w && dh == h;
+}
+
+// Dirty rectangles, and the stats and blurs kept up to date with them, by
+// the changes of a sequence of edits.
+static void checkDirty(void) {
+  const int w = 180, h = 120;
+  Image img = synth(w, h, 27);
+  CHECK(dirtyIs(img, 0, 0, w, h), "new image is not all dirty");
+  ImageClearDirty(img);
+  CHECK(dirtyIs(img, 0, 0, 0, 0), "cleared image is dirty");
+  ImageSetPixel(img, 5, 7, 1);
+  CHECK(dirtyIs(img, 5, 7, 1, 1), "set pixel");
+  ImageSetPixel(img, 20, 3, 2);
+  CHECK(dirtyIs(img, 5, 3, 16, 5), "two set pixels");
+  Image patch = synth(30, 10, 28);
+  ImageClearDirty(img);
+  ImagePaste(img, 100, 90, patch);
+  CHECK(dirtyIs(img, 100, 90, 30, 10), "paste");
+  ImageBlend(img, 140, 20, patch, 0.5);
+  CHECK(dirtyIs(img, 100, 20, 70, 80), "paste and blend");
+  ImageClearDirty(img);
+  ImageNegative(img);
+  CHECK(dirtyIs(img, 0, 0, w, h), "negative does not dirty the whole image");
+
+  // Edits, each followed by a dirty blur and stats
+  static const int windows[][2] = { { 1, 1 }, { 2, 2 }, { 4, 1 }, { 9, 6 } };
+  Image blurred[4];
+  for (int k = 0; k < 4; k++) blurred[k] = need(ImageCreate(w, h, PixMax), "Creating image");
+  CHECK(statsOK(img), "stats of the negative");
+  for (int step = 0; step < 12; step++) {
+    int x = (step*53) % (w - 30), y = (step*37) % (h - 10);
+    switch (step % 6) {
+    case 0: ImagePaste(img, x, y, patch); break;
+    case 1: ImageBlend(img, x, y, patch, 0.25); break;
+    case 2: ImageSetPixel(img, x, y, (uint8)(step*20)); ImageSetPixel(img, w-1, h-1, 255); break;
+    case 3: ImageSetPixel(img, x, 0, 0); ImageSetPixel(img, 0, y, 3); break;
+    case 4: ImageThreshold(patch, 90); ImagePaste(img, x, y, patch); break;
+    case 5: ImageBrighten(img, 0.9); break;
+    }
+    CHECK(statsOK(img), "stats after step %d", step);
+    // All blurs are refreshed from the same dirty rectangle
+    int dx, dy, dw, dh;
+    ImageDirtyRect(img, &dx, &dy, &dw, &dh);
+    for (int k = 0; k < 4; k++) {
+      Image ref = copy(img);
+      ImageBlur(ref, windows[k][0], windows[k][1]);
+      Image saved = copy(img);
+      ImageBlurDirty(img, blurred[k], windows[k][0], windows[k][1]);
+      CHECK(diffPixels(blurred[k], ref) == 0, "blur %d,%d after step %d", windows[k][0], windows[k][1], step);
+      CHECK(dirtyIs(img, 0, 0, 0, 0), "dirty blur does not clear the dirty rectangle");
+      CHECK(diffPixels(saved, img) == 0, "dirty blur changes its source");
+      ImageDestroy(&ref);
+      ImageDestroy(&saved);
+      if (k < 3) {
+        // Restore the dirty rectangle for the next blur
+        ImageSetPixel(img, dx, dy, ImageGetPixel(img, dx, dy));
+        ImageSetPixel(img, dx + dw - 1, dy + dh - 1, ImageGetPixel(img, dx + dw - 1, dy + dh - 1));
+      }
+    }
+  }
+  for (int k = 0; k < 4; k++) ImageDestroy(&blurred[k]);
+  ImageDestroy(&patch);
+  ImageDestroy(&img);
+}
+
+// Frame sequences and frame differencing: frames read back from a
+// concatenated file, and AbsDiff, Accumulate and Motion against references.
+static void checkSeq(void) {
+  const int w = 90, h = 60, n = 5;
+  char name[256];
+  strcpy(name, scratch(".seq"));
+  Image frames[5];
+  FILE* f = fopen(name, "wb");
+  for (int k = 0; k < n; k++) {
+    frames[k] = synth(w, h, 30);
+    Image sq = need(ImageCreate(12, 9, PixMax), "Creating image");
+    ImageNegative(sq);
+    ImagePaste(frames[k], 10 + 15*k, 5 + 8*k, sq);
+    ImageDestroy(&sq);
+    const char* fname = scratch(".pgm");
+    ImageSave(frames[k], fname);
+    long len;
+    uint8* bytes = readBytes(fname, &len);
+    fwrite(bytes, 1, len, f);
+    free(bytes);
+    unlink(fname);
+  }
+  fclose(f);
+
+  ImageSeq seq = ImageSeqOpen(name, 2);
+  CHECK(seq != NULL, "open: %s", ImageErrMsg());
+  Image bg = need(ImageCreate(w, h, PixMax), "Creating image");
+  Image mask = need(ImageCreate(w, h, PixMax), "Creating image");
+  for (int k = 0; seq != NULL && k < n; k++) {
+    Image fr = ImageSeqNext(seq);
+    CHECK(fr != NULL && diffPixels(fr, frames[k]) == 0, "frame %d", k);
+    if (fr == NULL) break;
+    CHECK(ImageSeqCount(seq) == k + 1 && !ImageSeqEnded(seq), "count after frame %d", k);
+    CHECK(ImageSeqFrame(seq, 0) == fr, "frame 0 back is not the last frame");
+    if (k == 0) continue;
+    Image prev = ImageSeqFrame(seq, 1);
+    CHECK(diffPixels(prev, frames[k-1]) == 0, "frame before %d", k);
+
+    // Differences against references, then in place
+    ImageAbsDiff(bg, fr, prev);
+    long moving = 0, bad = 0, badmask = 0;
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) {
+        int d = abs(ImageGetPixel(fr, x, y) - ImageGetPixel(prev, x, y));
+        bad += ImageGetPixel(bg, x, y) != d;
+        moving += d > 25;
+      }
+    CHECK(bad == 0, "absdiff of frame %d: %ld pixels differ", k, bad);
+    long m = ImageMotion(mask, fr, prev, 25);
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        badmask += ImageGetPixel(mask, x, y) != (ImageGetPixel(bg, x, y) > 25 ? PixMax : 0);
+    CHECK(m == moving && badmask == 0, "motion of frame %d: %ld, expected %ld; %ld pixels differ",
+          k, m, moving, badmask);
+    Image a = copy(fr);
+    ImageAbsDiff(a, a, prev);
+    CHECK(diffPixels(a, bg) == 0, "absdiff in place");
+    CHECK(ImageMotion(a, fr, prev, 25) == moving, "motion in place");
+    CHECK(diffPixels(a, mask) == 0, "motion mask in place");
+    ImageDestroy(&a);
+  }
+  CHECK(seq != NULL && ImageSeqNext(seq) == NULL && ImageSeqEnded(seq) && ImageSeqCount(seq) == n,
+        "end of sequence");
+  ImageSeqClose(&seq);
+  CHECK(seq == NULL, "close");
+
+  // Running averages
+  static const double alphas[] = { 0.0, 1.0, 0.5, 0.1, 0.75 };
+  for (int k = 0; k < 5; k++) {
+    Image acc = copy(frames[0]);
+    ImageAccumulate(acc, frames[2], alphas[k]);
+    double a = round(alphas[k]*256) / 256;
+    long bad = 0;
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) {
+        double ref = (1 - a)*ImageGetPixel(frames[0], x, y) + a*ImageGetPixel(frames[2], x, y);
+        bad += fabs(ImageGetPixel(acc, x, y) - ref) > 0.5 + 1e-9;
+      }
+    CHECK(bad == 0, "accumulate %g: %ld pixels differ", alphas[k], bad);
+    ImageDestroy(&acc);
+  }
+
+  // A truncated last frame, and a frame of another size, are errors
+  f = fopen(name, "r+b");
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fclose(f);
+  if (truncate(name, len - 10) != 0) error(2, errno, "%s", name);
+  seq = ImageSeqOpen(name, 1);
+  CHECK(seq != NULL, "open: %s", ImageErrMsg());
+  int k = 0;
+  while (seq != NULL && ImageSeqNext(seq) != NULL) k++;
+  CHECK(seq != NULL && k == n - 1 && !ImageSeqEnded(seq), "truncated sequence: %d frames", k);
+  ImageSeqClose(&seq);
+  Image other = synth(w, h + 1, 31);
+  const char* oname = scratch(".pgm");
+  ImageSave(other, oname);
+  uint8* bytes = readBytes(oname, &len);
+  unlink(oname);
+  ImageSave(frames[0], name);
+  f = fopen(name, "ab");
+  fwrite(bytes, 1, len, f);
+  fclose(f);
+  free(bytes);
+  seq = ImageSeqOpen(name, 1);
+  CHECK(seq != NULL && ImageSeqNext(seq) != NULL && ImageSeqNext(seq) == NULL && !ImageSeqEnded(seq),
+        "frame of another size accepted");
+  ImageSeqClose(&seq);
+  ImageDestroy(&other);
+
+  unlink(name);
+  ImageDestroy(&bg);
+  ImageDestroy(&mask);
+  for (int k = 0; k < n; k++) ImageDestroy(&frames[k]);
+}
+
+static const struct {
+  const char* name;
+  void (*fn)(void);
+  const char* doc;
+} checks[] = {
+  { "basic", checkBasic, "create, rotate, mirror, crop, paste, blend, locate..." },
+  { "tiled", checkTiled, "tiled images, read and written back" },
+  { "pyramid", checkPyramid, "pyramid levels and coarse-to-fine locate" },
+  { "resize", checkResize, "resize in nearest, bilinear and area modes" },
+  { "16bit", check16, "16-bit images, against 8-bit ones and references" },
+  { "netpbm", checkNetpbm, "plain and raw PGM, PBM and PPM files" },
+  { "pz", checkCompressed, "compressed files: round trips and corrupt files" },
+  { "pgm", checkFiles, "raw PGM files: bytes written, buffer boundaries" },
+  { "blur", checkBlur, "blur kernels and threshold, against references" },
+  { "morph", checkMorphology, "erode, dilate, open and close, against references" },
+  { "rank", checkRank, "rank and median filters, against references" },
+  { "affine", checkAffine, "affine warps and rotations" },
+  { "blobs", checkBlobs, "connected components, against a flood fill" },
+  { "rle", checkRLE, "run-length encoded images, against dense ones" },
+  { "bits", checkBitImage, "binary images, against thresholded ones" },
+  { "dirty", checkDirty, "dirty rectangles, stats and dirty blurs after edits" },
+  { "seq", checkSeq, "frame sequences and frame differencing" },
+};
+
+#define NCHECKS (int)(sizeof(checks)/sizeof(checks[0]))
+
+// Run check i.  Returns 1 if it passed.
+static int runCheck(int i) {
+  failures = 0;
+  checks[i].fn();
+  if (failures == 0) printf("%-12s ok\n", checks[i].name);
+  else printf("%-12s FAILED (%d)\n", checks[i].name, failures);
+  return failures == 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "%s", USAGE);
+    for (int i = 0; i < NCHECKS; i++)
+      fprintf(stderr, "  %-12s %s\n", checks[i].name, checks[i].doc);
+    exit(1);
+  }
+  if (strcmp(argv[1], "-g") == 0) {
+    if (argc != 6) error(1, 0, "-g needs FILE W H SEED");
+    Image img = synth(atoi(argv[3]), atoi(argv[4]), (unsigned)atoi(argv[5]));
+    if (!ImageSave(img, argv[2])) error(2, errno, "%s: %s", argv[2], ImageErrMsg());
+    ImageDestroy(&img);
+    return 0;
+  }
+  int ok = 1;
+  for (int k = 1; k < argc; k++) {
+    int found = 0;
+    for (int i = 0; i < NCHECKS; i++) {
+      if (strcmp(argv[k], "all") == 0 || strcmp(argv[k], checks[i].name) == 0) {
+        ok &= runCheck(i);
+        found = 1;
+      }
+    }
+    if (!found) error(1, 0, "%s: no such check", argv[k]);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+// imageClient - Send image processing pipelines to an imageTool server.
+//
+// This program is the local client for `imageTool --serve SOCKET`.
+// It sends a pipeline (with the same operations as imageTool) to the
+// server, prints the results and progress messages, and saves the images
+// that the pipeline sends back (with the "send" operation).
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+static const char* USAGE =
+    "USAGE: imageClient SOCKET [-o FILE]... [OPERATION [OPERAND...]]\n"
+    "  Run a pipeline of operations on the imageTool server at SOCKET.\n"
+    "  Files named in the pipeline are read and written by the server.\n"
+    "  -o FILE         Save the next image sent back by the pipeline to FILE\n"
+    "\n"
+    "EXAMPLE:\n"
+    "  imageTool --serve /tmp/img.sock &\n"
+    "  imageClient /tmp/img.sock -o neg.pgm \"$PWD/in.pgm\" neg send\n"
+    "\n"
+    ;
+
+// Response header, as sent by the server (see imageTool.c)
+typedef struct {
+  int32_t status;
+  int32_t nimages;
+  uint64_t outlen;
+  uint64_t loglen;
+} ServeHeader;
+
+// Maximum number of images sent back by one request
+#define MAXSEND 16
+
+// Read exactly len bytes from fd.  Returns 0 on failure or early EOF.
+static int readAll(int fd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t r = read(fd, buf, len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    buf += r;
+    len -= r;
+  }
+  return 1;
+}
+
+// Copy len bytes from fd to the given stream
+static int copyOut(int fd, uint64_t len, FILE* f) {
+  char buf[65536];
+  while (len > 0) {
+    size_t chunk = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+    if (!readAll(fd, buf, chunk)) return 0;
+    fwrite(buf, 1, chunk, f);
+    len -= chunk;
+  }
+  return 1;
+}
+
+// Save the image in memory file fd to filename
+static int saveImage(int fd, const char* filename) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return 0;
+  int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out < 0) return 0;
+  off_t off = 0;
+  while (off < st.st_size) {
+    ssize_t r = sendfile(out, fd, &off, st.st_size - off);
+    if (r <= 0) { close(out); return 0; }
+  }
+  return close(out) == 0;
+}
+
+int main(int ac, char* av[]) {
+  if (ac < 2) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  const char* path = av[1];
+
+  // Collect output files and build the request
+  const char* outfiles[MAXSEND];
+  int nout = 0;
+  char* req = NULL;
+  size_t len = 0;
+  FILE* r = open_memstream(&req, &len);
+  if (r == NULL) error(2, errno, "open_memstream");
+  for (int k = 2; k < ac; k++) {
+    if (strcmp(av[k], "-o") == 0 && k+1 < ac) {
+      if (nout >= MAXSEND) error(5, 0, "Too many output files");
+      outfiles[nout++] = av[++k];
+    } else {
+      fwrite(av[k], 1, strlen(av[k]) + 1, r);  // including the NUL
+    }
+  }
+  fclose(r);
+
+  // Connect and send the request
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) error(5, 0, "Socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) error(2, errno, "socket");
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) error(2, errno, "%s", path);
+  for (size_t off = 0; off < len; ) {
+    ssize_t w = write(fd, req + off, len - off);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) error(2, errno, "Sending request");
+    off += w;
+  }
+  free(req);
+  shutdown(fd, SHUT_WR);
+
+  // Receive the header, with the image descriptors
+  ServeHeader h;
+  union {
+    char buf[CMSG_SPACE(MAXSEND*sizeof(int))];
+    struct cmsghdr align;
+  } ctl;
+  struct iovec iov = { &h, sizeof(h) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  ssize_t got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (got <= 0) error(2, errno, "Receiving response");
+  int fds[MAXSEND];
+  int nfds = 0;
+  for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (nfds > MAXSEND) nfds = MAXSEND;
+      memcpy(fds, CMSG_DATA(cm), nfds*sizeof(int));
+    }
+  }
+  if (got < (ssize_t)sizeof(h) && !readAll(fd, (char*)&h + got, sizeof(h) - got))
+    error(2, errno, "Receiving response");
+
+  // Results go to stdout, messages to stderr
+  if (!copyOut(fd, h.outlen, stdout) ||
+      !copyOut(fd, h.loglen, stderr))
+    error(2, errno, "Receiving response");
+  close(fd);
+
+  // Save the images
+  int status = h.status;
+  for (int i = 0; i < nfds; i++) {
+    if (i < nout) {
+      if (!saveImage(fds[i], outfiles[i])) {
+        error(0, errno, "%s", outfiles[i]);
+        status = 2;
+      }
+    } else {
+      error(0, 0, "Image %d was sent back, but no -o FILE was given for it", i);
+    }
+    close(fds[i]);
+  }
+  return status;
+}
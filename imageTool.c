@@ -9,12 +9,28 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#define _GNU_SOURCE   // for memfd_create, accept4
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <error.h>
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -27,7 +43,10 @@
 //-----
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [CACHE] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [CACHE] --batch [-j JOBS] [-u] [-q DEPTH] INPUT... -- [OPERATION [OPERAND...]]\n"
+    "       imageTool --serve SOCKET [-j JOBS]\n"
+    "       imageTool --seq [-b ALPHA] [-t THR] [-q] INPUT\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -36,33 +55,65 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Other images are freed, but a copy may be kept in a named register.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit PGM format (raw or plain) are accepted, as well as\n"
+    "  PBM and PPM files, which are converted to gray.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  saveascii FILE  Save CURR to plain (ASCII) PGM file\n"
+    "  savez FILE      Save CURR to compressed file (loaded like PGM files)\n"
+    "  tiled FILE      Open PGM file as a tiled image (pixels read on demand)\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "                  Counters are kept per pipeline (also in batch and\n"
+    "                  server modes); times are those of the whole process.\n"
+    "  -f SCRIPT       Run the operations in file SCRIPT (# starts a comment)\n"
+    "\n"
+    "  store NAME      Store a copy of CURR in register NAME\n"
+    "  recall NAME     Copy the image in register NAME, creating new image\n"
+    "  drop NAME       Release register NAME\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
-    "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotate [DEG]    Rotate CURR 90º (or DEG degrees) counter-clockwise,\n"
+    "                  creating new image (same size, for DEG; corners are black)\n"
+    "  affine A,B,C,D,E,F  Map CURR with the affine transform\n"
+    "                  (x,y) -> (A*x+B*y+C, D*x+E*y+F), creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH, creating new image; M is the method:\n"
+    "                  nearest, bilinear (default) or area (best to shrink)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  absdiff         Replace CURR by its absolute difference to PRED\n"
+    "  motion THR      Replace CURR by the mask of pixels that differ from PRED\n"
+    "                  by more than THR (white), and print their number\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  pyrlocate       Like locate, but with a coarse-to-fine search in a pyramid\n"
+    "  bitlocate THR,D Like locate, on PRED and CURR thresholded at THR (packed\n"
+    "                  1 bit per pixel), allowing up to D differing pixels\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  erode DX,DY     erode CURR with a (2DX+1)x(2DY+1) rectangle (local min)\n"
+    "  dilate DX,DY    dilate CURR with a (2DX+1)x(2DY+1) rectangle (local max)\n"
+    "  open DX,DY      open CURR (erode, then dilate)\n"
+    "  close DX,DY     close CURR (dilate, then erode)\n"
+    "  median DX,DY    median filter CURR in a (2DX+1)x(2DY+1) rectangle\n"
+    "  rank DX,DY,PCT  replace each pixel of CURR by the PCT percentile of its\n"
+    "                  (2DX+1)x(2DY+1) rectangle (0 = min, 50 = median, 100 = max)\n"
+    "  blobs CONN      Print area, bounding box and centroid of the connected\n"
+    "                  components of non-zero pixels of CURR (CONN is 4 or 8)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -70,6 +121,44 @@ static const char* USAGE =
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "BATCH MODE:\n"
+    "  Apply the same pipeline to each INPUT file, which is loaded as I0.\n"
+    "  INPUT may be a file name, a quoted wildcard pattern, or @LIST to read\n"
+    "  file names from LIST, one per line.\n"
+    "  In the FILE operand of save, %n expands to the sequence number of the\n"
+    "  input (0000, 0001, ...), %b to its basename without extension, and %%\n"
+    "  to a literal %.\n"
+    "  -j JOBS         Process up to JOBS files concurrently (default: #cpus);\n"
+    "                  parallel operations get the remaining cpus\n"
+    "  -u              Print results as files complete, not in input order\n"
+    "  -q DEPTH        Load inputs and save outputs in background threads, up to\n"
+    "                  DEPTH files ahead/behind (default: 2*JOBS; 0 disables)\n"
+    "\n"
+    "CACHE:\n"
+    "  --cache DIR     Keep the results of pipelines in directory DIR, and reuse\n"
+    "                  them when the same input files (unchanged) go through the\n"
+    "                  same leading operations, skipping their loading and work.\n"
+    "                  Results are saved after each image operation up to the\n"
+    "                  first other operation (save, info, store, -f...), and\n"
+    "                  restored from the longest matching prefix.\n"
+    "  --cache-size MB Delete the least recently used results when DIR grows\n"
+    "                  beyond MB megabytes (default: 1024)\n"
+    "\n"
+    "SEQUENCE MODE:\n"
+    "  Read INPUT (- for standard input), a sequence of raw PGM frames of the\n"
+    "  same size, concatenated, and print the number of moving pixels of each\n"
+    "  frame, and the throughput (frames per second) at the end.\n"
+    "  -b ALPHA        Compare each frame to a running-average background,\n"
+    "                  updated with weight ALPHA (default: previous frame)\n"
+    "  -t THR          Pixels that differ by more than THR move (default: 25)\n"
+    "  -q              Print only the throughput\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  Listen on Unix-domain SOCKET for pipelines sent by imageClient, and run\n"
+    "  up to JOBS of them concurrently (default: #cpus).\n"
+    "  Loaded files are kept in a shared pool and reused while unchanged.\n"
+    "  send            Send CURR back to the client (server mode only)\n"
+    "\n"
     ;
 
 static char* errors[] = {
@@ -81,6 +170,10 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation not available in this mode",
+  "Script files nested too deeply",
+  "Cannot read script file",
+  "Image sizes differ",
 };
 
 
@@ -92,151 +185,1701 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Context of one run of a pipeline
+typedef struct {
+  FILE* out;            // where results are printed (info, locate, toc...)
+  FILE* log;            // where progress messages are printed
+  const char* input;    // batch mode: the input file; NULL otherwise
+  int index;            // batch mode: sequence number of the input file
+  struct imagePool* pool;  // server mode: shared pool of loaded files
+  int* fds;             // server mode: images to send back (file descriptors)
+  int nfds;
+  int depth;            // nesting level of script files
+  struct batch* batch;  // batch mode with write-behind: saves are queued here
+  struct resultCache* cache;  // on-disk cache of results (--cache), or NULL
+} Pipeline;
+
+// Maximum number of images sent back by one request in server mode
+#define MAXSEND 16
+
+// Maximum number of named image registers
+#define MAXREGS 64
+
+// Maximum nesting of script files
+#define MAXDEPTH 16
+
+// Number of tiles cached for tiled images (256x256 pixels each)
+#define TILECACHE 64
+
+static Image poolLoad(struct imagePool* pool, const char* filename);
+// A function that saves an image to a file (ImageSave, ...)
+typedef int (*Saver)(Image img, const char* filename);
+
+static int batchWrite(struct batch* b, int i, Image img, const char* filename, Saver saver);
+
+// If s is a number (all of it), store it in *v and return 1.
+static int parseNumber(const char* s, double* v) {
+  char* end;
+  *v = strtod(s, &end);
+  return end != s && *end == '\0' && isfinite(*v);
+}
+
+// The image buffer
+//
+// Images are numbered I0, I1, ... in order of creation, and the buffer
+// grows as needed.  Operations only use CURR and PRED, so any other image
+// can only be reached again through a copy kept in a named register.
+// Images that are neither CURR nor PRED are destroyed immediately, which
+// keeps memory proportional to the live images.
+typedef struct {
+  Image* img;           // img[i] is Ii, or NULL if it was already destroyed
+  int n;                // number of images created
+  int cap;              // capacity of img
+  struct {              // named registers
+    char* name;
+    Image img;          // a copy of the stored image, owned by the register
+  } reg[MAXREGS];
+  int nregs;
+} ImageBuffer;
+
+// Destroy image Ii if it is no longer reachable (as CURR or PRED).
+static void bufferRelease(ImageBuffer* b, int i) {
+  if (i >= 0 && i < b->n - 2 && b->img[i] != NULL)
+    ImageDestroy(&b->img[i]);
+}
+
+// Copy a whole image
+static Image copyImage(Image img) {
+  return ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+}
+
+// Make room for one more image.  Returns 0 on failure.
+static int bufferReserve(ImageBuffer* b) {
+  if (b->n < b->cap) return 1;
+  int cap = b->cap ? 2*b->cap : 16;
+  Image* img = (Image*)realloc(b->img, cap*sizeof(Image));
+  if (img == NULL) return 0;
+  b->img = img;
+  b->cap = cap;
+  return 1;
+}
+
+// Account for the image just stored in b->img[b->n].
+// The former PRED falls out of reach, and may be destroyed.
+static void bufferPush(ImageBuffer* b) {
+  b->n++;
+  bufferRelease(b, b->n - 3);
+}
+
+// Find the register with the given name, or -1.
+static int bufferFindReg(const ImageBuffer* b, const char* name) {
+  for (int r = 0; r < b->nregs; r++)
+    if (strcmp(b->reg[r].name, name) == 0) return r;
+  return -1;
+}
+
+// Destroy all images and registers in the buffer.
+static void bufferDestroy(ImageBuffer* b) {
+  while (b->n > 0) {
+    ImageDestroy(&b->img[--b->n]);
+  }
+  for (int r = 0; r < b->nregs; r++) {
+    free(b->reg[r].name);
+    ImageDestroy(&b->reg[r].img);
   }
+  b->nregs = 0;
+  free(b->img);
+  b->img = NULL;
+  b->cap = 0;
+}
 
-  ImageInit();
+// Script files
+//
+// A script file holds a pipeline, with operations and operands separated
+// by whitespace.  A '#' starts a comment that extends to the end of line.
+
+// Read the tokens of script file filename.
+// On success, returns the number of tokens, stored in a new array (*tokp),
+// and the memory holding their text in (*textp).  Returns -1 on failure.
+static int readScript(const char* filename, char*** tokp, char** textp) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) return -1;
+  char* text = NULL;
+  size_t len = 0;
+  FILE* m = open_memstream(&text, &len);
+  if (m == NULL) { fclose(f); return -1; }
+  int c;
+  int ntok = 0;
+  int intoken = 0;
+  while ((c = fgetc(f)) != EOF) {
+    if (c == '#') {
+      while (c != '\n' && c != EOF) c = fgetc(f);
+    }
+    if (c == EOF || isspace(c)) {
+      if (intoken) fputc('\0', m);
+      intoken = 0;
+    } else {
+      ntok += !intoken;
+      intoken = 1;
+      fputc(c, m);
+    }
+  }
+  if (intoken) fputc('\0', m);
+  fclose(f);
+  fclose(m);
+  char** tok = (char**)malloc((ntok + 1)*sizeof(char*));
+  if (tok == NULL) { free(text); return -1; }
+  size_t pos = 0;
+  for (int t = 0; t < ntok; t++) {
+    tok[t] = text + pos;
+    pos += strlen(text + pos) + 1;
+  }
+  *tokp = tok;
+  *textp = text;
+  return ntok;
+}
+
+// Expand the output file name template tmpl for the input of pipeline p,
+// writing the result into buf (with given size).
+// Returns 0 if the template is invalid or the result does not fit.
+static int expandName(char* buf, size_t size, const char* tmpl, const Pipeline* p) {
+  size_t len = 0;
+  for (const char* t = tmpl; *t != '\0'; t++) {
+    int r;
+    if (*t != '%') {
+      r = snprintf(buf + len, size - len, "%c", *t);
+    } else if (*++t == 'n') {
+      r = snprintf(buf + len, size - len, "%04d", p->index);
+    } else if (*t == 'b') {
+      // basename without directory and extension
+      const char* base = strrchr(p->input, '/');
+      base = (base == NULL) ? p->input : base + 1;
+      const char* dot = strrchr(base, '.');
+      int blen = (dot == NULL || dot == base) ? (int)strlen(base) : (int)(dot - base);
+      r = snprintf(buf + len, size - len, "%.*s", blen, base);
+    } else if (*t == '%') {
+      r = snprintf(buf + len, size - len, "%%");
+    } else {
+      return 0;
+    }
+    if (r < 0 || (size_t)r >= size - len) return 0;
+    len += r;
+  }
+  return 1;
+}
+
+// Result cache
+//
+// With --cache DIR, the results of pipelines are kept on disk and reused by
+// later runs of the same pipeline on the same input files.
+// The cacheable prefix of a pipeline is its leading run of input files and
+// image operations (no scripts, registers, printed results or saves).
+// After each operation of that prefix, CURR and PRED are saved in DIR,
+// keyed by a normalized text of the prefix so far: one line per input file,
+// which names it by device, inode, size and mtime (so that the key costs no
+// file reads), and one line per operation with its operands.
+// A later run restores the state after the longest cached prefix of its
+// pipeline and runs only the rest, so a hit on the whole prefix loads no
+// input file and computes nothing.
+//
+// Entry KEY (a hash of the text) is made of files KEY.key, which holds the
+// number of images and the prefix text (checked on lookup, so hash
+// collisions are harmless), KEY.0.pgm (CURR) and KEY.1.pgm (PRED, if any).
+// Files are written under temporary names and renamed, and KEY.key comes
+// last, so concurrent runs never see partial entries.
+// A hit touches the files of the entry, and whenever the directory grows
+// beyond its size limit, the least recently used entries are deleted.
+
+#define CACHEVERSION "imageTool-cache 1\n"
+
+// Maximum number of cache points (operations) in a pipeline prefix
+#define MAXPOINTS 64
+
+typedef struct resultCache {
+  const char* dir;
+  long long maxbytes;     // size limit of the directory
+  pthread_mutex_t lock;   // serializes eviction, protects seq
+  unsigned long seq;      // for unique temporary file names
+} ResultCache;
+
+// The cacheable prefix of a pipeline
+typedef struct {
+  char* text;           // the normalized text of the whole prefix
+  size_t textlen;
+  int n;                // number of cache points
+  struct {
+    int end;            // index of the argument after the operation
+    size_t len;         // length of the prefix text up to the operation
+    uint64_t key;       // hash of that text
+  } point[MAXPOINTS];
+} CachePrefix;
+
+// Image operations that may be cached, with their number of operands
+// (-1: rotate, whose angle is optional).  Keep in sync with runPipeline.
+static const struct { const char* name; int nargs; } cacheOps[] = {
+  { "neg", 0 }, { "thr", 1 }, { "bri", 1 }, { "create", 1 },
+  { "rotate", -1 }, { "affine", 1 }, { "mirror", 0 }, { "crop", 1 },
+  { "resize", 1 }, { "paste", 1 }, { "blend", 1 }, { "blur", 1 },
+  { "erode", 1 }, { "dilate", 1 }, { "open", 1 }, { "close", 1 },
+  { "median", 1 }, { "rank", 1 }, { "absdiff", 0 },
+};
+
+// The other operations, which end the cacheable prefix
+static const char* cacheStops[] = {
+  "-f", "store", "recall", "drop", "tiled", "info", "tic", "toc",
+  "locate", "pyrlocate", "bitlocate", "blobs", "motion", "save", "saveascii",
+  "savez", "match", "send",
+};
+
+// FNV-1a hash of len bytes of s
+static uint64_t hashText(const char* s, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Find the cache points of the pipeline in av[k..ac-1].
+// Returns 0 on failure (out of memory).
+static int cachePrefix(CachePrefix* cp, int ac, char* av[], int k) {
+  cp->text = NULL;
+  cp->n = 0;
+  FILE* m = open_memstream(&cp->text, &cp->textlen);
+  if (m == NULL) return 0;
+  fputs(CACHEVERSION, m);
+  while (k < ac && cp->n < MAXPOINTS) {
+    int op = (int)(sizeof(cacheOps)/sizeof(cacheOps[0])) - 1;
+    while (op >= 0 && strcmp(av[k], cacheOps[op].name) != 0) op--;
+    if (op < 0) {
+      int stop = (int)(sizeof(cacheStops)/sizeof(cacheStops[0])) - 1;
+      while (stop >= 0 && strcmp(av[k], cacheStops[stop]) != 0) stop--;
+      struct stat st;
+      if (stop >= 0 || stat(av[k], &st) != 0 || !S_ISREG(st.st_mode)) break;
+      fprintf(m, "F %ju %ju %jd %jd.%09ld\n", (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+              (intmax_t)st.st_size, (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+      k++;
+      continue;
+    }
+    int nargs = cacheOps[op].nargs;
+    double deg;
+    if (nargs < 0) nargs = (k+1 < ac && parseNumber(av[k+1], &deg));
+    if (k + nargs >= ac) break;
+    fputs(av[k++], m);
+    for (int a = 0; a < nargs; a++) fprintf(m, " %s", av[k++]);
+    fputc('\n', m);
+    fflush(m);
+    cp->point[cp->n].end = k;
+    cp->point[cp->n].len = cp->textlen;
+    cp->point[cp->n].key = hashText(cp->text, cp->textlen);
+    cp->n++;
+  }
+  if (fclose(m) != 0) {
+    free(cp->text);
+    cp->text = NULL;
+    cp->n = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// Path of the file of entry key with the given suffix.
+static void cachePath(char* buf, size_t size, const ResultCache* c, uint64_t key, const char* suffix) {
+  snprintf(buf, size, "%s/%016" PRIx64 "%s", c->dir, key, suffix);
+}
+
+// Restore the image buffer b (which must be empty) from the entry of
+// cache point j.  Returns 0 on a miss.
+static int cacheLoad(const ResultCache* c, const CachePrefix* cp, int j, ImageBuffer* b) {
+  char path[FILENAME_MAX];
+  cachePath(path, sizeof(path), c, cp->point[j].key, ".key");
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0;
+  int n, nimg;
+  int ok = fscanf(f, "%d %d", &n, &nimg) == 2 && fgetc(f) == '\n' &&
+           nimg >= 1 && nimg <= 2 && n >= nimg;
+  // The prefix text must match, byte by byte
+  for (size_t i = 0; ok && i < cp->point[j].len; i++) {
+    ok = (fgetc(f) == (unsigned char)cp->text[i]);
+  }
+  ok = ok && fgetc(f) == EOF;
+  fclose(f);
+
+  Image img[2] = { NULL, NULL };   // CURR and PRED
+  for (int i = 0; ok && i < nimg; i++) {
+    cachePath(path, sizeof(path), c, cp->point[j].key, i ? ".1.pgm" : ".0.pgm");
+    ok = (img[i] = ImageLoad(path)) != NULL;
+  }
+  if (ok && b->cap < n) {
+    Image* slots = (Image*)realloc(b->img, n*sizeof(Image));
+    ok = (slots != NULL);
+    if (ok) {
+      b->img = slots;
+      b->cap = n;
+    }
+  }
+  if (!ok) {
+    ImageDestroy(&img[0]);
+    ImageDestroy(&img[1]);
+    return 0;
+  }
+  // Images I0..I(n-3) were out of reach already
+  for (int i = 0; i < n; i++) b->img[i] = NULL;
+  b->img[n-1] = img[0];
+  if (nimg == 2) b->img[n-2] = img[1];
+  b->n = n;
+
+  // Mark the entry as recently used
+  const char* suffix[] = { ".key", ".0.pgm", ".1.pgm" };
+  for (int i = 0; i <= nimg; i++) {
+    cachePath(path, sizeof(path), c, cp->point[j].key, suffix[i]);
+    utimensat(AT_FDCWD, path, NULL, 0);
+  }
+  return 1;
+}
 
+// Files of the cache directory, for eviction
+struct cacheFile {
+  char* name;
+  long long bytes;
+  struct timespec mtime;
+  int entry;            // index of its entry, after grouping
+};
+
+// An entry of the cache directory (all files with the same KEY)
+struct cacheEntry {
+  long long bytes;
+  struct timespec used; // latest mtime of its files
+};
+
+static int byName(const void* a, const void* b) {
+  return strcmp(((const struct cacheFile*)a)->name, ((const struct cacheFile*)b)->name);
+}
+
+// Compare two times, like strcmp
+static int timeCmp(const struct timespec* a, const struct timespec* b) {
+  if (a->tv_sec != b->tv_sec) return (a->tv_sec > b->tv_sec) - (a->tv_sec < b->tv_sec);
+  return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+static int byUse(const void* a, const void* b) {
+  return timeCmp(&(*(struct cacheEntry* const*)a)->used, &(*(struct cacheEntry* const*)b)->used);
+}
+
+// Delete the least recently used entries until the cache directory fits
+// in its size limit.
+static void cacheEvict(ResultCache* c) {
+  pthread_mutex_lock(&c->lock);
+  DIR* d = opendir(c->dir);
+  struct cacheFile* file = NULL;
+  int nfiles = 0, cap = 0;
+  long long total = 0;
+  struct dirent* de;
+  while (d != NULL && (de = readdir(d)) != NULL) {
+    if (strspn(de->d_name, "0123456789abcdef") != 16 || de->d_name[16] != '.') continue;
+    struct stat st;
+    if (fstatat(dirfd(d), de->d_name, &st, 0) != 0) continue;
+    if (nfiles == cap) {
+      cap = cap ? 2*cap : 64;
+      struct cacheFile* nf = (struct cacheFile*)realloc(file, cap*sizeof(struct cacheFile));
+      if (nf == NULL) break;
+      file = nf;
+    }
+    if ((file[nfiles].name = strdup(de->d_name)) == NULL) break;
+    file[nfiles].bytes = st.st_size;
+    file[nfiles].mtime = st.st_mtim;
+    total += st.st_size;
+    nfiles++;
+  }
+
+  if (total > c->maxbytes) {
+    // Group the files by entry
+    qsort(file, nfiles, sizeof(struct cacheFile), byName);
+    struct cacheEntry* entry = (struct cacheEntry*)malloc(nfiles*sizeof(struct cacheEntry));
+    struct cacheEntry** order = (struct cacheEntry**)malloc(nfiles*sizeof(struct cacheEntry*));
+    int nentries = 0;
+    for (int i = 0; entry != NULL && order != NULL && i < nfiles; i++) {
+      if (i == 0 || strncmp(file[i].name, file[i-1].name, 16) != 0) {
+        entry[nentries].bytes = 0;
+        entry[nentries].used = file[i].mtime;
+        order[nentries] = &entry[nentries];
+        nentries++;
+      }
+      struct cacheEntry* e = &entry[nentries-1];
+      e->bytes += file[i].bytes;
+      if (timeCmp(&file[i].mtime, &e->used) > 0) e->used = file[i].mtime;
+      file[i].entry = nentries-1;
+    }
+    // Mark the victims (bytes = -1), oldest first
+    qsort(order, nentries, sizeof(struct cacheEntry*), byUse);
+    for (int i = 0; i < nentries && total > c->maxbytes; i++) {
+      total -= order[i]->bytes;
+      order[i]->bytes = -1;
+    }
+    for (int i = 0; nentries > 0 && i < nfiles; i++) {
+      if (entry[file[i].entry].bytes < 0) unlinkat(dirfd(d), file[i].name, 0);
+    }
+    free(entry);
+    free(order);
+  }
+
+  for (int i = 0; i < nfiles; i++) free(file[i].name);
+  free(file);
+  if (d != NULL) closedir(d);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Save CURR and PRED of image buffer b as the entry of cache point j,
+// unless it exists already, and evict old entries if needed.
+// Failures are ignored: the cache only saves work.
+static void cacheStore(ResultCache* c, const CachePrefix* cp, int j, const ImageBuffer* b) {
+  char path[FILENAME_MAX];
+  char tmp[FILENAME_MAX + 64];
+  uint64_t key = cp->point[j].key;
+  cachePath(path, sizeof(path), c, key, ".key");
+  if (access(path, F_OK) == 0) return;
+
+  int nimg = (b->n >= 2) ? 2 : 1;
+  long long bytes = 0;
+  for (int i = 0; i < nimg; i++) {
+    bytes += (long long)ImageWidth(b->img[b->n-1-i])*ImageHeight(b->img[b->n-1-i]);
+  }
+  if (bytes > c->maxbytes) return;   // would be evicted at once
+  pthread_mutex_lock(&c->lock);
+  unsigned long seq = c->seq++;
+  pthread_mutex_unlock(&c->lock);
+  int ok = 1;
+  for (int i = 0; ok && i < nimg; i++) {
+    cachePath(path, sizeof(path), c, key, i ? ".1.pgm" : ".0.pgm");
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%lu", path, (long)getpid(), seq);
+    ok = ImageSave(b->img[b->n-1-i], tmp) && rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+  }
+  // The key file goes last, as it makes the entry visible
+  if (ok) {
+    cachePath(path, sizeof(path), c, key, ".key");
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%lu", path, (long)getpid(), seq);
+    FILE* f = fopen(tmp, "w");
+    ok = (f != NULL);
+    if (ok) {
+      fprintf(f, "%d %d\n", b->n, nimg);
+      fwrite(cp->text, 1, cp->point[j].len, f);
+      ok = (fclose(f) == 0) && rename(tmp, path) == 0;
+    }
+    if (!ok) unlink(tmp);
+  }
+  if (ok) cacheEvict(c);
+}
+
+// Run the pipeline of operations in av[k..ac-1] on the image buffer b.
+// Returns an error code (index into errors[]), 0 on success.
+static int runPipeline(Pipeline* p, int ac, char* av[], int k, ImageBuffer* b) {
   int err = 0;
   int x, y, w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  // With a result cache, resume after the longest cached prefix
+  CachePrefix cp;
+  cp.text = NULL;
+  cp.n = 0;
+  int point = 0;        // next cache point
+  if (p->cache != NULL && p->depth == 0 && b->n == 0) {
+    int errsave = errno;
+    if (cachePrefix(&cp, ac, av, k)) {
+      for (point = cp.n; point > 0; point--) {
+        if (cacheLoad(p->cache, &cp, point-1, b)) {
+          fprintf(p->log, "Reusing cached results of %d arguments -> I%d\n", cp.point[point-1].end - k, b->n-1);
+          k = cp.point[point-1].end;
+          break;
+        }
+      }
+    }
+    errno = errsave;
+  }
 
-  int k = 1;
   while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+    if (strcmp(av[k], "-f") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (p->depth >= MAXDEPTH) { err = 9; break; }
+      char** tok;
+      char* text;
+      int ntok = readScript(av[k], &tok, &text);
+      if (ntok < 0) { err = 10; break; }
+      fprintf(p->log, "Running script %s\n", av[k]);
+      p->depth++;
+      err = runPipeline(p, ntok, tok, 0, b);
+      p->depth--;
+      free(tok);
+      free(text);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "store") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      int r = bufferFindReg(b, av[k]);
+      if (r < 0 && b->nregs >= MAXREGS) { err = 3; break; }
+      // Copy, so that in-place operations on CURR do not change the register
+      Image img = copyImage(b->img[b->n-1]);
+      if (img == NULL) { err = 4; break; }
+      if (r < 0) {
+        char* name = strdup(av[k]);
+        if (name == NULL) { ImageDestroy(&img); err = 3; break; }
+        r = b->nregs++;
+        b->reg[r].name = name;
+      } else {
+        ImageDestroy(&b->reg[r].img);
+      }
+      b->reg[r].img = img;
+      fprintf(p->log, "Storing I%d in %s\n", b->n-1, av[k]);
+    } else if (strcmp(av[k], "recall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int r = bufferFindReg(b, av[k]);
+      if (r < 0) { err = 5; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      fprintf(p->log, "Recalling %s -> I%d\n", av[k], b->n);
+      // Copy, so that in-place operations on CURR do not change the register
+      b->img[b->n] = copyImage(b->reg[r].img);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int r = bufferFindReg(b, av[k]);
+      if (r < 0) { err = 5; break; }
+      fprintf(p->log, "Dropping %s\n", av[k]);
+      free(b->reg[r].name);
+      ImageDestroy(&b->reg[r].img);
+      b->reg[r] = b->reg[--b->nregs];
+    } else if (strcmp(av[k], "tiled") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      fprintf(p->log, "Opening tiled %s -> I%d\n", av[k], b->n);
+      b->img[b->n] = ImageOpenTiled(av[k], TILECACHE, 0);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
+    } else if (strcmp(av[k], "info") == 0) {
+      if (b->n < 1) { err = 2; break; }
+      fprintf(p->log, "Info on I%d\n", b->n-1);
       uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      w = ImageWidth(b->img[b->n-1]);
+      h = ImageHeight(b->img[b->n-1]);
+      uint8 maxval = ImageMaxval(b->img[b->n-1]);
+      ImageStats(b->img[b->n-1], &min, &max);
+      fprintf(p->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(p->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      InstrFprint(p->out);
       //-----
-      printf("pixel read/write ratio: %ld\n", PIXRD/PIXWR);
+      if (PIXWR > 0) fprintf(p->out, "pixel read/write ratio: %ld\n", PIXRD/PIXWR);
       //-----
     } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      if (b->n < 1) { err = 2; break; }
+      fprintf(p->log, "Negating I%d\n", b->n-1);
+      ImageNegative(b->img[b->n-1]);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
+      if (b->n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      fprintf(p->log, "Thresholding I%d at %d\n", b->n-1, thr);
+      ImageThreshold(b->img[b->n-1], (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
+      if (b->n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      fprintf(p->log, "Brightening I%d by %lf\n", b->n-1, factor);
+      ImageBrighten(b->img[b->n-1], factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      fprintf(p->log, "Creating black image (%d,%d) -> I%d\n", w, h, b->n);
+      b->img[b->n] = ImageCreate(w, h, PixMax);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
     } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (b->n < 1) { err = 2; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      // The angle is optional: take the next argument only if it is a number
+      double deg;
+      if (k+1 < ac && parseNumber(av[k+1], &deg)) {
+        k++;
+        fprintf(p->log, "Rotating I%d by %g degrees -> I%d\n", b->n-1, deg, b->n);
+        b->img[b->n] = ImageRotateAngle(b->img[b->n-1], deg, 0);
+      } else {
+        fprintf(p->log, "Rotating I%d -> I%d\n", b->n-1, b->n);
+        b->img[b->n] = ImageRotate(b->img[b->n-1]);
+      }
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
+    } else if (strcmp(av[k], "affine") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      double m[6];
+      if (sscanf(av[k], "%lf,%lf,%lf,%lf,%lf,%lf", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) { err = 5; break; }
+      fprintf(p->log, "Mapping I%d with affine (%g,%g,%g,%g,%g,%g) -> I%d\n",
+              b->n-1, m[0], m[1], m[2], m[3], m[4], m[5], b->n);
+      b->img[b->n] = ImageAffine(b->img[b->n-1], m, 0);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
     } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (b->n < 1) { err = 2; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      fprintf(p->log, "Mirroring I%d -> I%d\n", b->n-1, b->n);
+      b->img[b->n] = ImageMirror(b->img[b->n-1]);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
+      if (b->n < 1) { err = 2; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (!ImageValidRect(b->img[b->n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(p->log, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", b->n-1, x, y, w, h, b->n);
+      b->img[b->n] = ImageCrop(b->img[b->n-1], x, y, w, h);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      if (!bufferReserve(b)) { err = 3; break; }
+      char method[16] = "bilinear";
+      int n = sscanf(av[k], "%d,%d,%15s", &w, &h, method);
+      if (n < 2 || w < 0 || h < 0) { err = 5; break; }
+      int mode;
+      if (strcmp(method, "nearest") == 0) mode = RESIZE_NEAREST;
+      else if (strcmp(method, "bilinear") == 0) mode = RESIZE_BILINEAR;
+      else if (strcmp(method, "area") == 0) mode = RESIZE_AREA;
+      else { err = 5; break; }
+      fprintf(p->log, "Resizing I%d to %dx%d (%s) -> I%d\n", b->n-1, w, h, method, b->n);
+      b->img[b->n] = ImageResize(b->img[b->n-1], w, h, mode);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
+      if (b->n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      w = ImageWidth(b->img[b->n-2]);
+      h = ImageHeight(b->img[b->n-2]);
+      if (!ImageValidRect(b->img[b->n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(p->log, "Pasting I%d at I%d (%d,%d)\n", b->n-2, b->n-1, x, y);
+      ImagePaste(b->img[b->n-1], x, y, b->img[b->n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
+      if (b->n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      w = ImageWidth(b->img[b->n-2]);
+      h = ImageHeight(b->img[b->n-2]);
+      if (!ImageValidRect(b->img[b->n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(p->log, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", b->n-2, b->n-1, x, y, alpha);
+      ImageBlend(b->img[b->n-1], x, y, b->img[b->n-2], alpha);
+    } else if (strcmp(av[k], "absdiff") == 0) {
+      if (b->n < 2) { err = 2; break; }
+      w = ImageWidth(b->img[b->n-1]);
+      h = ImageHeight(b->img[b->n-1]);
+      if (ImageWidth(b->img[b->n-2]) != w || ImageHeight(b->img[b->n-2]) != h) { err = 11; break; }
+      fprintf(p->log, "Difference of I%d and I%d\n", b->n-1, b->n-2);
+      ImageAbsDiff(b->img[b->n-1], b->img[b->n-1], b->img[b->n-2]);
+    } else if (strcmp(av[k], "motion") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 2) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      w = ImageWidth(b->img[b->n-1]);
+      h = ImageHeight(b->img[b->n-1]);
+      if (ImageWidth(b->img[b->n-2]) != w || ImageHeight(b->img[b->n-2]) != h) { err = 11; break; }
+      fprintf(p->log, "Motion of I%d from I%d above %d\n", b->n-1, b->n-2, thr);
+      long moving = ImageMotion(b->img[b->n-1], b->img[b->n-1], b->img[b->n-2], thr);
+      fprintf(p->out, "# MOTION %ld\n", moving);
     } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+      if (b->n < 2) { err = 2; break; }
+      fprintf(p->log, "Locating I%d in I%d\n", b->n-2, b->n-1);
+      if (ImageLocateSubImage(b->img[b->n-1], &x, &y, b->img[b->n-2])) {
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(p->out, "# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "pyrlocate") == 0) {
+      if (b->n < 2) { err = 2; break; }
+      fprintf(p->log, "Locating I%d in I%d (pyramid)\n", b->n-2, b->n-1);
+      Pyramid pyr = ImageBuildPyramid(b->img[b->n-1], 8);
+      if (pyr == NULL) { err = 4; break; }
+      if (ImageLocateSubImagePyramid(pyr, &x, &y, b->img[b->n-2])) {
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(p->out, "# NOTFOUND\n");
+      }
+      ImageDestroyPyramid(&pyr);
+    } else if (strcmp(av[k], "bitlocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 2) { err = 2; break; }
+      int thr; int maxdiff;
+      if (sscanf(av[k], "%d,%d", &thr, &maxdiff) != 2 || thr < 0 || thr > PixMax || maxdiff < 0) { err = 5; break; }
+      fprintf(p->log, "Locating I%d in I%d (thresholded at %d, up to %d differences)\n", b->n-2, b->n-1, thr, maxdiff);
+      BitImage img1 = BitImageFromImage(b->img[b->n-1], (uint8)thr);
+      BitImage img2 = BitImageFromImage(b->img[b->n-2], (uint8)thr);
+      if (img1 == NULL || img2 == NULL) {
+        BitImageDestroy(&img1);
+        BitImageDestroy(&img2);
+        err = 4; break;
+      }
+      if (BitImageLocateSubImage(img1, &x, &y, img2, maxdiff)) {
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(p->out, "# NOTFOUND\n");
+      }
+      BitImageDestroy(&img1);
+      BitImageDestroy(&img2);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
+      if (b->n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
+      fprintf(p->log, "Blur I%d with %dx%d mean filter\n", b->n-1, 2*dx+1, 2*dy+1);
+      ImageBlur(b->img[b->n-1], dx, dy);
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      fprintf(p->log, "%c%s I%d with %dx%d rectangle\n", toupper(op[0]), op + 1, b->n-1, 2*dx+1, 2*dy+1);
+      switch (op[0]) {
+      case 'e': ImageErode(b->img[b->n-1], dx, dy); break;
+      case 'd': ImageDilate(b->img[b->n-1], dx, dy); break;
+      case 'o': ImageOpening(b->img[b->n-1], dx, dy); break;
+      case 'c': ImageClosing(b->img[b->n-1], dx, dy); break;
+      }
+    } else if (strcmp(av[k], "median") == 0 || strcmp(av[k], "rank") == 0) {
+      int median = (av[k][0] == 'm');
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      int dx; int dy; int pct = 50;
+      if (median ? sscanf(av[k], "%d,%d", &dx, &dy) != 2
+                 : sscanf(av[k], "%d,%d,%d", &dx, &dy, &pct) != 3) { err = 5; break; }
+      if (dx < 0 || dy < 0 || pct < 0 || pct > 100 ||
+          (long)(2*dx + 1)*(2*dy + 1) > 65535) { err = 5; break; }
+      fprintf(p->log, "Rank filter I%d with %dx%d rectangle at %d%%\n", b->n-1, 2*dx+1, 2*dy+1, pct);
+      ImageRankFilter(b->img[b->n-1], dx, dy, pct);
+    } else if (strcmp(av[k], "blobs") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (b->n < 1) { err = 2; break; }
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1 || (conn != 4 && conn != 8)) { err = 5; break; }
+      fprintf(p->log, "Finding %d-connected components of I%d\n", conn, b->n-1);
+      ImageBlob* blobs;
+      int n = ImageBlobs(b->img[b->n-1], conn, &blobs);
+      if (n < 0) { err = 4; break; }
+      fprintf(p->out, "# BLOBS %d\n", n);
+      for (int i = 0; i < n; i++) {
+        fprintf(p->out, "# BLOB %d area %d box (%d,%d,%d,%d) centroid (%.2f,%.2f)\n", i, blobs[i].area,
+                blobs[i].x, blobs[i].y, blobs[i].w, blobs[i].h, blobs[i].cx, blobs[i].cy);
+      }
+      free(blobs);
+    } else if (strcmp(av[k], "save") == 0 || strcmp(av[k], "saveascii") == 0 ||
+               strcmp(av[k], "savez") == 0) {
+      Saver saver = (av[k][4] == '\0') ? ImageSave : (av[k][4] == 'a') ? ImageSaveAscii : ImageSaveCompressed;
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }
+      char outname[FILENAME_MAX];
+      const char* filename = av[k];
+      if (p->input != NULL) {  // batch mode: expand name template
+        if (!expandName(outname, sizeof(outname), av[k], p)) { err = 5; break; }
+        filename = outname;
+      }
+      fprintf(p->log, "Saving %s <- I%d\n", filename, b->n-1);
+      if (p->batch != NULL) {
+        if (!batchWrite(p->batch, p->index, b->img[b->n-1], filename, saver)) { err = 4; break; }
+      } else {
+        if (saver(b->img[b->n-1], filename) == 0) { err = 4; break; }
+      }
       //-----
     } else if (strcmp(av[k], "match") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
+      if (b->n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      printf("Match: %d\n", ImageMatchSubImage(img[n-2], x, y, img[n-1]));
+      fprintf(p->out, "Match: %d\n", ImageMatchSubImage(b->img[b->n-2], x, y, b->img[b->n-1]));
       //-----
+    } else if (strcmp(av[k], "send") == 0) {
+      if (b->n < 1) { err = 2; break; }
+      if (p->fds == NULL) { err = 8; break; }
+      if (p->nfds >= MAXSEND) { err = 3; break; }
+      // Save to an anonymous memory file and pass its descriptor
+      int fd = memfd_create("imageTool", MFD_CLOEXEC);
+      if (fd < 0) { err = 4; break; }
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+      fprintf(p->log, "Sending I%d\n", b->n-1);
+      if (ImageSave(b->img[b->n-1], path) == 0) { close(fd); err = 4; break; }
+      p->fds[p->nfds++] = fd;
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (!bufferReserve(b)) { err = 3; break; }
+      fprintf(p->log, "Loading %s -> I%d\n", av[k], b->n);
+      b->img[b->n] = (p->pool != NULL) ? poolLoad(p->pool, av[k]) : ImageLoad(av[k]);
+      if (b->img[b->n] == NULL) { err = 4; break; }
+      bufferPush(b);
     }
     k++;
+    if (point < cp.n && k == cp.point[point].end) {
+      int errsave = errno;
+      cacheStore(p->cache, &cp, point++, b);
+      errno = errsave;
+    }
+  }
+
+  free(cp.text);
+  return err;
+}
+
+// Batch mode
+//
+// In batch mode, the same pipeline is applied to many input files,
+// by a pool of worker threads.  Each worker takes the next input file,
+// loads it as I0, runs the pipeline, and destroys its images before taking
+// another file, so at most JOBS files are in flight at any time.
+// The results and progress messages of each file are collected in memory
+// and printed in input order (or as soon as they are ready, if unordered).
+//
+// Unless disabled with -q 0, file I/O is taken off the workers by two
+// background threads, so that disk and CPU work overlap: the prefetch
+// thread loads input files up to DEPTH files ahead of the workers, and the
+// write-behind thread saves copies of the images queued by save operations
+// (at most DEPTH at a time) while the workers go on.
+// The results of a file are printed once its pipeline is done and all its
+// images are written, so that write errors are reported with their file.
+
+// Results of one input file
+struct batchResult {
+  char* out;            // results, or NULL while the pipeline is running
+  size_t outlen;
+  char* log;            // progress messages
+  size_t loglen;
+  int failed;
+  int pending;          // queued writes not done yet (-1 once printed)
+};
+
+// A queued write
+struct writeJob {
+  struct writeJob* next;
+  Image img;            // a copy of the image to save
+  char* filename;
+  Saver saver;          // how to save it
+  int index;            // input file it belongs to
+};
+
+typedef struct batch {
+  char** inputs;        // the input files
+  int ninputs;
+  char** ops;           // the pipeline operations and operands
+  int nops;
+  int unordered;        // print results as soon as each file is done
+  struct resultCache* cache;  // result cache, or NULL (disables prefetch)
+  int window;           // prefetch and write-behind depth (0 = synchronous I/O)
+  pthread_mutex_t lock; // protects the fields below and the output streams
+  pthread_cond_t cond;  // signalled whenever the fields below change
+  int next;             // next input file to process
+  int printed;          // number of files whose results were printed
+  int failures;         // number of files that failed
+  struct batchResult* res;  // res[i] holds the results of input file i
+  int prefetched;       // input files [0, prefetched) were loaded (or failed)
+  Image* pre;           // pre[i] is input file i, loaded ahead
+  const char** preMsg;  // pre[i]==NULL: the failure cause (ImageErrMsg)
+  int* preErrno;        //   and errno
+  struct writeJob* head;    // queue of writes
+  struct writeJob* tail;
+  int queued;           // writes queued or in progress
+  int done;             // no more writes will be queued
+} Batch;
+
+// Is the result of a file complete and not printed yet?
+static int batchComplete(const struct batchResult* r) {
+  return r->out != NULL && r->pending == 0;
+}
+
+// Print the (complete) result of a file.  Must be called with b->lock held.
+static void batchPrint(Batch* b, struct batchResult* r) {
+  fwrite(r->log, 1, r->loglen, stderr);
+  fwrite(r->out, 1, r->outlen, stdout);
+  fflush(stdout);
+  b->printed++;
+  b->failures += r->failed;
+  free(r->out);
+  free(r->log);
+  r->out = r->log = NULL;
+  r->pending = -1;
+}
+
+// Print the results that are complete after a change to that of input
+// file i: that one, if unordered, or else the complete ones that follow
+// the last printed, in input order.  Must be called with b->lock held.
+static void batchFlush(Batch* b, int i) {
+  if (b->unordered) {
+    if (batchComplete(&b->res[i])) batchPrint(b, &b->res[i]);
+    return;
+  }
+  while (b->printed < b->ninputs && batchComplete(&b->res[b->printed]))
+    batchPrint(b, &b->res[b->printed]);
+}
+
+// Queue a copy of img to be saved to filename, for input file i,
+// waiting while the queue is full.  Returns 0 on failure (out of memory).
+static int batchWrite(Batch* b, int i, Image img, const char* filename, Saver saver) {
+  struct writeJob* job = (struct writeJob*)malloc(sizeof(struct writeJob));
+  if (job == NULL) return 0;
+  job->img = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  job->filename = strdup(filename);
+  if (job->img == NULL || job->filename == NULL) {
+    ImageDestroy(&job->img);
+    free(job->filename);
+    free(job);
+    return 0;
+  }
+  job->saver = saver;
+  job->index = i;
+  job->next = NULL;
+
+  pthread_mutex_lock(&b->lock);
+  while (b->queued >= b->window)
+    pthread_cond_wait(&b->cond, &b->lock);
+  if (b->tail != NULL) b->tail->next = job; else b->head = job;
+  b->tail = job;
+  b->queued++;
+  b->res[i].pending++;
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&b->lock);
+  return 1;
+}
+
+// Append len bytes of msg to the log of r.
+static void appendLog(struct batchResult* r, const char* msg, size_t len) {
+  char* log = (char*)realloc(r->log, r->loglen + len);
+  if (log == NULL) return;
+  memcpy(log + r->loglen, msg, len);
+  r->log = log;
+  r->loglen += len;
+}
+
+// Write-behind thread: save the queued images, until there are no more.
+static void* batchWriter(void* arg) {
+  Batch* b = (Batch*)arg;
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    while (b->head == NULL && !b->done)
+      pthread_cond_wait(&b->cond, &b->lock);
+    struct writeJob* job = b->head;
+    if (job == NULL) break;
+    b->head = job->next;
+    if (b->head == NULL) b->tail = NULL;
+    pthread_mutex_unlock(&b->lock);
+
+    errno = 0;
+    int ok = job->saver(job->img, job->filename);
+    int errsave = errno;
+    char msg[2*FILENAME_MAX];
+    int len = 0;
+    if (!ok) {
+      len = snprintf(msg, sizeof(msg), "imageTool: %s: %s: ", b->inputs[job->index], job->filename);
+      len += snprintf(msg + len, sizeof(msg) - len, errors[4], ImageErrMsg());
+      len += snprintf(msg + len, sizeof(msg) - len, "%s%s\n", errsave ? ": " : "", errsave ? strerror(errsave) : "");
+      if (len >= (int)sizeof(msg)) len = sizeof(msg) - 1;
+    }
+    ImageDestroy(&job->img);
+    free(job->filename);
+
+    pthread_mutex_lock(&b->lock);
+    struct batchResult* r = &b->res[job->index];
+    if (!ok) {
+      appendLog(r, msg, len);
+      r->failed = 1;
+    }
+    r->pending--;
+    b->queued--;
+    batchFlush(b, job->index);
+    free(job);
+    pthread_cond_broadcast(&b->cond);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+// Prefetch thread: load the input files, up to b->window files ahead of
+// the workers.
+static void* batchPrefetcher(void* arg) {
+  Batch* b = (Batch*)arg;
+  for (int i = 0; i < b->ninputs; i++) {
+    pthread_mutex_lock(&b->lock);
+    while (i >= b->next + b->window)
+      pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    errno = 0;
+    Image img = ImageLoad(b->inputs[i]);
+    int errsave = errno;
+
+    pthread_mutex_lock(&b->lock);
+    b->pre[i] = img;
+    if (img == NULL) {
+      b->preMsg[i] = ImageErrMsg();
+      b->preErrno[i] = errsave;
+    }
+    b->prefetched = i + 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+// Worker thread: process input files until there are no more.
+static void* batchWorker(void* arg) {
+  Batch* b = (Batch*)arg;
+  char** jav = (char**)malloc((b->nops + 1)*sizeof(char*));
+  if (jav == NULL) error(2, errno, "Batch worker");
+  memcpy(jav + 1, b->ops, b->nops*sizeof(char*));
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_cond_broadcast(&b->cond);  // the prefetcher may go further
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->ninputs) break;
+
+    // Collect results and messages in memory
+    char* outbuf = NULL; size_t outlen = 0;
+    char* logbuf = NULL; size_t loglen = 0;
+    Pipeline p = { open_memstream(&outbuf, &outlen), open_memstream(&logbuf, &loglen),
+                   b->inputs[i], i, NULL, NULL, 0, 0, (b->window > 0) ? b : NULL, b->cache };
+    if (p.out == NULL || p.log == NULL) error(2, errno, "Batch worker");
+
+    // The input file is the first argument of the pipeline
+    jav[0] = b->inputs[i];
+    ImageBuffer buf;
+    memset(&buf, 0, sizeof(buf));
+    errno = 0;
+    int err;
+    const char* msg = NULL;   // failure cause, if not ImageErrMsg()
+    if (b->window > 0 && b->cache == NULL) {
+      // Take the prefetched input as I0, and run the rest of the pipeline
+      pthread_mutex_lock(&b->lock);
+      while (b->prefetched <= i)
+        pthread_cond_wait(&b->cond, &b->lock);
+      Image img = b->pre[i];
+      b->pre[i] = NULL;
+      pthread_mutex_unlock(&b->lock);
+      fprintf(p.log, "Loading %s -> I0\n", b->inputs[i]);
+      if (img == NULL) {
+        err = 4;
+        msg = b->preMsg[i];
+        errno = b->preErrno[i];
+      } else if (!bufferReserve(&buf)) {
+        err = 3;
+        ImageDestroy(&img);
+      } else {
+        buf.img[0] = img;
+        bufferPush(&buf);
+        err = runPipeline(&p, b->nops + 1, jav, 1, &buf);
+      }
+    } else {
+      err = runPipeline(&p, b->nops + 1, jav, 0, &buf);
+    }
+    if (err != 0) {
+      int errsave = errno;
+      fprintf(p.log, "imageTool: %s: ", b->inputs[i]);
+      fprintf(p.log, errors[err], msg != NULL ? msg : ImageErrMsg());
+      fprintf(p.log, "%s%s\n", errsave ? ": " : "", errsave ? strerror(errsave) : "");
+    }
+    bufferDestroy(&buf);
+    fclose(p.out);
+    fclose(p.log);
+
+    pthread_mutex_lock(&b->lock);
+    struct batchResult* r = &b->res[i];
+    // Write errors logged meanwhile go after the pipeline messages
+    char* werr = r->log;
+    size_t werrlen = r->loglen;
+    r->log = logbuf;
+    r->loglen = loglen;
+    appendLog(r, werr, werrlen);
+    free(werr);
+    r->out = outbuf;
+    r->outlen = outlen;
+    r->failed |= (err != 0);
+    batchFlush(b, i);
+    pthread_mutex_unlock(&b->lock);
+  }
+  free(jav);
+  return NULL;
+}
+
+// Append the input files named by arg to the list (*inputs, *n, *cap):
+// a @LISTFILE names a file with one input per line;
+// arguments with wildcards are expanded with glob().
+// Returns 0 on failure.
+static int addInputs(const char* arg, char*** inputs, int* n, int* cap) {
+  char** names = NULL;
+  size_t count = 0;
+  glob_t g;
+  int usedGlob = 0;
+  char* line = NULL;
+  size_t linecap = 0;
+  FILE* f = NULL;
+
+  if (arg[0] == '@') {
+    if ((f = fopen(arg + 1, "r")) == NULL) return 0;
+  } else if (strpbrk(arg, "*?[") != NULL) {
+    if (glob(arg, 0, NULL, &g) != 0) { errno = ENOENT; return 0; }
+    usedGlob = 1;
+    names = g.gl_pathv;
+    count = g.gl_pathc;
+  } else {
+    names = (char**)&arg;
+    count = 1;
+  }
+
+  int ok = 1;
+  for (size_t j = 0; ok; j++) {
+    const char* name;
+    if (f != NULL) {
+      ssize_t len = getline(&line, &linecap, f);
+      if (len < 0) break;
+      while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+      if (len == 0) continue;
+      name = line;
+    } else {
+      if (j >= count) break;
+      name = names[j];
+    }
+    if (*n == *cap) {
+      *cap = *cap ? 2*(*cap) : 64;
+      char** ni = (char**)realloc(*inputs, (*cap)*sizeof(char*));
+      if (ni == NULL) { ok = 0; break; }
+      *inputs = ni;
+    }
+    ok = ((*inputs)[*n] = strdup(name)) != NULL;
+    *n += ok;
+  }
+
+  free(line);
+  if (f != NULL) fclose(f);
+  if (usedGlob) globfree(&g);
+  return ok;
+}
+
+// Init the image library for up to jobs pipelines running concurrently.
+// They share the pool of threads of parallel operations, which gets the
+// processors left over by the jobs (unless IMAGE8BIT_THREADS is set), so
+// that the processors are not oversubscribed.
+static void initForJobs(long jobs) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long threads = (cpus > jobs) ? cpus - jobs + 1 : 1;
+  ImageInitThreads(getenv("IMAGE8BIT_THREADS") != NULL ? 0 : (int)threads);
+}
+
+// Run batch mode.  av[k] is the first argument after --batch.
+static int batchMain(int ac, char* av[], int k, ResultCache* cache) {
+  Batch b;
+  memset(&b, 0, sizeof(b));
+  b.cache = cache;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) jobs = 1;
+  long depth = -1;   // default: 2*jobs
+
+  // Options
+  for (; k < ac && av[k][0] == '-' && strcmp(av[k], "--") != 0; k++) {
+    if (strcmp(av[k], "-j") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%ld", &jobs) != 1 || jobs < 1) error(5, 0, "Invalid jobs: %s", av[k]);
+    } else if (strcmp(av[k], "-q") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%ld", &depth) != 1 || depth < 0) error(5, 0, "Invalid depth: %s", av[k]);
+    } else if (strcmp(av[k], "-u") == 0) {
+      b.unordered = 1;
+    } else {
+      error(5, 0, "\n%s", USAGE);
+    }
+  }
+
+  // Input files, up to "--"
+  int cap = 0;
+  for (; k < ac && strcmp(av[k], "--") != 0; k++) {
+    if (!addInputs(av[k], &b.inputs, &b.ninputs, &cap)) error(5, errno, "%s", av[k]);
+  }
+  if (k >= ac) error(5, 0, "Batch mode requires -- before the operations\n%s", USAGE);
+  b.ops = av + k + 1;
+  b.nops = ac - k - 1;
+
+  if (jobs > b.ninputs) jobs = b.ninputs;
+  initForJobs(jobs);
+  b.window = (depth >= 0) ? (int)depth : 2*(int)jobs;
+  b.res = (struct batchResult*)calloc(b.ninputs + 1, sizeof(struct batchResult));
+  b.pre = (Image*)calloc(b.ninputs + 1, sizeof(Image));
+  b.preMsg = (const char**)calloc(b.ninputs + 1, sizeof(char*));
+  b.preErrno = (int*)calloc(b.ninputs + 1, sizeof(int));
+  if (b.res == NULL || b.pre == NULL || b.preMsg == NULL || b.preErrno == NULL)
+    error(2, errno, "Batch mode");
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.cond, NULL);
+  pthread_t prefetcher, writer;
+  // With a result cache, inputs are only loaded on a miss, by the workers
+  int prefetch = (b.window > 0 && cache == NULL);
+  if (b.window > 0) {
+    int r = prefetch ? pthread_create(&prefetcher, NULL, batchPrefetcher, &b) : 0;
+    if (r == 0) r = pthread_create(&writer, NULL, batchWriter, &b);
+    if (r != 0) error(2, r, "Creating I/O thread");
+  }
+  pthread_t tid[jobs > 0 ? jobs : 1];
+  for (long t = 0; t < jobs; t++) {
+    int r = pthread_create(&tid[t], NULL, batchWorker, &b);
+    if (r != 0) error(2, r, "Creating worker thread");
+  }
+  for (long t = 0; t < jobs; t++) {
+    pthread_join(tid[t], NULL);
+  }
+  if (b.window > 0) {
+    pthread_mutex_lock(&b.lock);
+    b.done = 1;
+    pthread_cond_broadcast(&b.cond);
+    pthread_mutex_unlock(&b.lock);
+    pthread_join(writer, NULL);
+    if (prefetch) pthread_join(prefetcher, NULL);
+  }
+  pthread_cond_destroy(&b.cond);
+  pthread_mutex_destroy(&b.lock);
+
+  for (int i = 0; i < b.ninputs; i++) free(b.inputs[i]);
+  free(b.inputs);
+  free(b.res);
+  free(b.pre);
+  free(b.preMsg);
+  free(b.preErrno);
+  if (b.failures > 0) {
+    error(0, 0, "%d of %d files failed", b.failures, b.ninputs);
+    return 4;
+  }
+  return 0;
+}
+
+// Sequence mode
+//
+// The frames of the input are read one at a time into a ring of two frame
+// buffers (see ImageSeqOpen), and each one is compared to the previous
+// frame, or to a running-average background, to count its moving pixels.
+// After the first frame, no image is allocated.
+
+// Run sequence mode.  av[k] is the first argument after --seq.
+static int seqMain(int ac, char* av[], int k) {
+  double alpha = -1.0;  // weight of the background update (< 0: no background)
+  int thr = 25;
+  int quiet = 0;
+
+  // Options
+  for (; k < ac && av[k][0] == '-' && av[k][1] != '\0'; k++) {
+    if (strcmp(av[k], "-b") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%lf", &alpha) != 1 || !(alpha >= 0.0 && alpha <= 1.0)) error(5, 0, "Invalid alpha: %s", av[k]);
+    } else if (strcmp(av[k], "-t") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%d", &thr) != 1 || thr < 0 || thr > PixMax) error(5, 0, "Invalid threshold: %s", av[k]);
+    } else if (strcmp(av[k], "-q") == 0) {
+      quiet = 1;
+    } else {
+      error(5, 0, "\n%s", USAGE);
+    }
+  }
+  if (k != ac - 1) error(5, 0, "\n%s", USAGE);
+
+  ImageSeq seq = ImageSeqOpen(av[k], 2);
+  if (seq == NULL) error(4, errno, "%s: %s", av[k], ImageErrMsg());
+  Image mask = NULL;    // the moving pixels of the current frame
+  Image bg = NULL;      // the background
+  InstrReset();
+  double start = wall_time();
+  Image frame;
+  while ((frame = ImageSeqNext(seq)) != NULL) {
+    long n = ImageSeqCount(seq);
+    if (mask == NULL) {
+      mask = ImageCreate(ImageWidth(frame), ImageHeight(frame), PixMax);
+      if (alpha >= 0.0) bg = ImageCrop(frame, 0, 0, ImageWidth(frame), ImageHeight(frame));
+      if (mask == NULL || (alpha >= 0.0 && bg == NULL)) error(4, errno, "%s: %s", av[k], ImageErrMsg());
+    }
+    long moving = 0;
+    if (bg != NULL) {
+      moving = ImageMotion(mask, frame, bg, (uint8)thr);
+      ImageAccumulate(bg, frame, alpha);
+    } else if (n > 1) {
+      moving = ImageMotion(mask, frame, ImageSeqFrame(seq, 1), (uint8)thr);
+    }
+    if (!quiet) printf("# FRAME %ld motion %ld\n", n - 1, moving);
+  }
+  double elapsed = wall_time() - start;
+  int ended = ImageSeqEnded(seq);
+  if (!ended) error(0, errno, "%s: frame %ld: %s", av[k], ImageSeqCount(seq), ImageErrMsg());
+  long frames = ImageSeqCount(seq);
+  printf("# %ld frames", frames);
+  if (mask != NULL) printf(" of %dx%d", ImageWidth(mask), ImageHeight(mask));
+  printf(" in %.3f s: %.1f fps (%.1f Mpixel/s)\n", elapsed, elapsed > 0 ? frames/elapsed : 0.0,
+         (mask != NULL && elapsed > 0) ? frames*(double)ImageWidth(mask)*ImageHeight(mask)/elapsed/1e6 : 0.0);
+  fflush(stdout);
+  ImageDestroy(&mask);
+  ImageDestroy(&bg);
+  ImageSeqClose(&seq);
+  return ended ? 0 : 4;
+}
+
+// Server mode
+//
+// The server accepts connections on a Unix-domain socket.  Each connection
+// carries one request and its response, and is served by its own thread.
+//
+// Request: the pipeline arguments, each terminated by a NUL byte, followed
+// by end-of-file (the client shuts down its writing side).
+// Response: a ServeHeader, followed by outlen bytes of results and loglen
+// bytes of progress messages.  The header carries, as SCM_RIGHTS ancillary
+// data, one file descriptor per image sent with the "send" operation:
+// each is a memory file holding the image in PGM format, so the image is
+// never copied through the socket.
+
+typedef struct {
+  int32_t status;       // error code of the pipeline (0 = success)
+  int32_t nimages;      // number of file descriptors attached
+  uint64_t outlen;      // bytes of results following the header
+  uint64_t loglen;      // bytes of progress messages following them
+} ServeHeader;
+
+// Shared image pool
+//
+// Files loaded by server requests are kept in memory and reused by later
+// requests, as long as the file is unchanged (same inode, size and mtime).
+// Each request gets its own copy, since operations modify images in-place.
+
+#define POOLSIZE 64
+
+struct imagePool {
+  pthread_mutex_t lock;
+  unsigned long clock;  // incremented on each use, for LRU eviction
+  struct poolEntry {
+    char* filename;     // NULL if the entry is free
+    struct stat st;     // file status when loaded
+    Image img;
+    int refs;           // copies in progress (entry cannot be evicted)
+    unsigned long lastuse;
+  } e[POOLSIZE];
+};
+
+static int sameFile(const struct stat* a, const struct stat* b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Load filename through the pool.
+// On success, returns a new image, owned by the caller.
+// On failure, returns NULL and errno/ImageErrMsg() are set, as in ImageLoad.
+static Image poolLoad(struct imagePool* pool, const char* filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0) return ImageLoad(filename);  // for the error
+
+  // Hit: copy the pooled image
+  pthread_mutex_lock(&pool->lock);
+  struct poolEntry* hit = NULL;
+  for (int i = 0; i < POOLSIZE; i++) {
+    struct poolEntry* e = &pool->e[i];
+    if (e->filename != NULL && strcmp(e->filename, filename) == 0 && sameFile(&e->st, &st)) {
+      hit = e;
+      hit->refs++;
+      hit->lastuse = ++pool->clock;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (hit != NULL) {
+    Image img = copyImage(hit->img);
+    pthread_mutex_lock(&pool->lock);
+    hit->refs--;
+    pthread_mutex_unlock(&pool->lock);
+    return img;
+  }
+
+  // Miss: load and keep a copy in the least recently used free entry
+  Image img = ImageLoad(filename);
+  if (img == NULL) return NULL;
+  Image keep = copyImage(img);
+  char* name = strdup(filename);
+  if (keep == NULL || name == NULL) {
+    ImageDestroy(&keep);
+    free(name);
+    return img;
+  }
+  pthread_mutex_lock(&pool->lock);
+  struct poolEntry* victim = NULL;
+  for (int i = 0; i < POOLSIZE; i++) {
+    struct poolEntry* e = &pool->e[i];
+    if (e->refs == 0 && (victim == NULL || e->lastuse < victim->lastuse))
+      victim = e;
+  }
+  if (victim != NULL) {
+    free(victim->filename);
+    ImageDestroy(&victim->img);
+    victim->filename = name;
+    victim->st = st;
+    victim->img = keep;
+    victim->lastuse = ++pool->clock;
+    name = NULL;
+    keep = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  ImageDestroy(&keep);  // only if all entries were busy
+  free(name);
+  return img;
+}
+
+// Arguments for a connection thread
+typedef struct {
+  int fd;                   // the connection
+  struct imagePool* pool;
+  sem_t* slots;             // limits the number of concurrent requests
+} ServeConn;
+
+// Write all len bytes of buf to fd.  Returns 0 on failure.
+static int writeAll(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t r = write(fd, buf, len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    buf += r;
+    len -= r;
+  }
+  return 1;
+}
+
+// Serve one connection: read the request, run it, and send the response.
+static void* serveConnection(void* arg) {
+  ServeConn* c = (ServeConn*)arg;
+
+  // Read the whole request
+  char* req = NULL;
+  size_t len = 0, cap = 0;
+  for (;;) {
+    if (len == cap) {
+      cap = cap ? 2*cap : 4096;
+      char* nr = (char*)realloc(req, cap + 1);
+      if (nr == NULL) goto done;
+      req = nr;
+    }
+    ssize_t r = read(c->fd, req + len, cap - len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) goto done;
+    if (r == 0) break;
+    len += r;
   }
+  if (len == 0) goto done;
+  req[len] = '\0';  // in case the last argument is not terminated
+
+  // Split it into arguments
+  int ac = 0;
+  for (size_t i = 0; i < len; i++) ac += (req[i] == '\0');
+  if (req[len-1] != '\0') ac++;
+  char** av = (char**)malloc((ac + 1)*sizeof(char*));
+  if (av == NULL) goto done;
+  ac = 0;
+  for (size_t i = 0; i < len; i += strlen(req + i) + 1) av[ac++] = req + i;
+
+  // Run the pipeline
+  char* outbuf = NULL; size_t outlen = 0;
+  char* logbuf = NULL; size_t loglen = 0;
+  int fds[MAXSEND];
+  Pipeline p = { open_memstream(&outbuf, &outlen), open_memstream(&logbuf, &loglen),
+                 NULL, 0, c->pool, fds, 0, 0, NULL, NULL };
+  if (p.out != NULL && p.log != NULL) {
+    ImageBuffer buf;
+    memset(&buf, 0, sizeof(buf));
+    errno = 0;
+    int err = runPipeline(&p, ac, av, 0, &buf);
+    if (err != 0) {
+      int errsave = errno;
+      fprintf(p.log, "imageTool: ");
+      fprintf(p.log, errors[err], ImageErrMsg());
+      fprintf(p.log, "%s%s\n", errsave ? ": " : "", errsave ? strerror(errsave) : "");
+    }
+    bufferDestroy(&buf);
+    fclose(p.out);
+    fclose(p.log);
+
+    // Send the header with the image descriptors, then results and messages
+    ServeHeader h = { err, p.nfds, outlen, loglen };
+    struct iovec iov = { &h, sizeof(h) };
+    union {                 // ancillary buffer, properly aligned
+      char buf[CMSG_SPACE(sizeof(fds))];
+      struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (p.nfds > 0) {
+      msg.msg_control = ctl.buf;
+      msg.msg_controllen = CMSG_SPACE(p.nfds*sizeof(int));
+      struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(p.nfds*sizeof(int));
+      memcpy(CMSG_DATA(cm), fds, p.nfds*sizeof(int));
+    }
+    if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(h)) {
+      if (writeAll(c->fd, outbuf, outlen)) writeAll(c->fd, logbuf, loglen);
+    }
+  }
+  for (int i = 0; i < p.nfds; i++) close(fds[i]);
+  free(outbuf);
+  free(logbuf);
+  free(av);
+
+done:
+  free(req);
+  close(c->fd);
+  sem_post(c->slots);
+  free(c);
+  return NULL;
+}
+
+// Set by the signal handler to stop the server
+static volatile sig_atomic_t stopServer = 0;
+
+static void onStopSignal(int sig) {
+  (void)sig;
+  stopServer = 1;
+}
+
+// Run server mode.  av[k] is the first argument after --serve.
+static int serveMain(int ac, char* av[], int k) {
+  if (k >= ac) error(5, 0, "\n%s", USAGE);
+  const char* path = av[k++];
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) jobs = 1;
+  for (; k < ac; k++) {
+    if (strcmp(av[k], "-j") == 0 && k+1 < ac) {
+      if (sscanf(av[++k], "%ld", &jobs) != 1 || jobs < 1) error(5, 0, "Invalid jobs: %s", av[k]);
+    } else {
+      error(5, 0, "\n%s", USAGE);
+    }
+  }
+  initForJobs(jobs);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) error(5, 0, "Socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0) error(2, errno, "socket");
+  unlink(path);  // remove a stale socket
+  if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) error(2, errno, "%s", path);
+  if (listen(lfd, 64) != 0) error(2, errno, "listen");
+
+  // Stop on SIGINT/SIGTERM (without restarting accept)
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onStopSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  static struct imagePool pool;
+  pthread_mutex_init(&pool.lock, NULL);
+  sem_t slots;
+  sem_init(&slots, 0, (unsigned)jobs);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  fprintf(stderr, "Serving on %s with %ld jobs\n", path, jobs);
+  while (!stopServer) {
+    if (sem_wait(&slots) != 0) continue;  // interrupted: check stopServer
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      sem_post(&slots);
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error(0, errno, "accept");
+      break;
+    }
+    ServeConn* c = (ServeConn*)malloc(sizeof(ServeConn));
+    pthread_t tid;
+    if (c == NULL) { close(fd); sem_post(&slots); continue; }
+    c->fd = fd;
+    c->pool = &pool;
+    c->slots = &slots;
+    if (pthread_create(&tid, &attr, serveConnection, c) != 0) {
+      close(fd);
+      free(c);
+      sem_post(&slots);
+    }
+  }
+
+  // Wait for requests in progress
+  for (long j = 0; j < jobs; j++) {
+    while (sem_wait(&slots) != 0 && errno == EINTR) ;
+  }
+  close(lfd);
+  unlink(path);
+  for (int i = 0; i < POOLSIZE; i++) {
+    free(pool.e[i].filename);
+    ImageDestroy(&pool.e[i].img);
+  }
+  fprintf(stderr, "Server stopped\n");
+  return 0;
+}
+
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  // Result cache options
+  ResultCache cache = { NULL, 1024LL << 20, PTHREAD_MUTEX_INITIALIZER, 0 };
+  int k = 1;
+  for (; k+1 < ac; k += 2) {
+    if (strcmp(av[k], "--cache") == 0) {
+      cache.dir = av[k+1];
+    } else if (strcmp(av[k], "--cache-size") == 0) {
+      if (sscanf(av[k+1], "%lld", &cache.maxbytes) != 1 || cache.maxbytes < 0 ||
+          cache.maxbytes > (LLONG_MAX >> 20)) error(5, 0, "Invalid cache size: %s", av[k+1]);
+      cache.maxbytes <<= 20;
+    } else {
+      break;
+    }
+  }
+  if (k >= ac) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  if (cache.dir != NULL && mkdir(cache.dir, 0777) != 0 && errno != EEXIST) {
+    error(5, errno, "%s", cache.dir);
+  }
+  ResultCache* cachep = (cache.dir != NULL) ? &cache : NULL;
+
+  // Batch and server modes init the library for their number of jobs
+  if (strcmp(av[k], "--batch") == 0) {
+    return batchMain(ac, av, k+1, cachep);
+  }
+  if (strcmp(av[k], "--serve") == 0) {
+    if (cachep != NULL) error(5, 0, "--cache is not available in server mode");
+    return serveMain(ac, av, k+1);
+  }
+  ImageInit();
+  if (strcmp(av[k], "--seq") == 0) {
+    return seqMain(ac, av, k+1);
+  }
+
+  // The image buffer
+  ImageBuffer buf;
+  memset(&buf, 0, sizeof(buf));
+
+  Pipeline p = { stdout, stderr, NULL, 0, NULL, NULL, 0, 0, NULL, cachep };
+  errno = 0;
+  int err = runPipeline(&p, ac, av, k, &buf);
   
   // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
-  }
+  bufferDestroy(&buf);
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
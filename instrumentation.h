@@ -22,20 +22,28 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (elapsed real) time in seconds.
+/// Unlike cpu_time, this does not add up the time of concurrent threads.
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters.
+/// Each thread has its own counters (and reset time), so that concurrent
+/// threads may count their operations separately.
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds), by this thread
+extern _Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
@@ -48,7 +56,11 @@ void InstrCalibrate(void) ;
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times and all named counter values to stdout.
 void InstrPrint(void) ;
 
+/// Print times and all named counter values to stream out.
+void InstrFprint(FILE* out) ;
+
 #endif
 